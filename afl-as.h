@@ -37,6 +37,20 @@
 #include "config.h"
 #include "types.h"
 
+/* socketpair() and send() constants used by the pre-forking fork server.
+   glibc defines some of them as enums, so they can't be stringified. Without
+   MSG_NOSIGNAL, releasing a pre-forked child that died while parked may raise
+   SIGPIPE in the fork server. */
+
+#define AS_AF_UNIX          1
+#define AS_SOCK_STREAM      1
+
+#ifdef __linux__
+#  define AS_MSG_NOSIGNAL   0x4000
+#else
+#  define AS_MSG_NOSIGNAL   0
+#endif /* ^__linux__ */
+
 /* 
    ------------------
    Performances notes
@@ -234,18 +248,70 @@ static const u8* main_payload_32 =
   "  /* Store the address of the SHM region. */\n"
   "\n"
   "  movl %eax, __afl_area_ptr\n"
-  "  movl %eax, %edx\n"
+  "\n"
+  "  /* Map the test case SHM region, if afl-fuzz set one up. This one is\n"
+  "     optional, so failures just leave __afl_fuzz_ptr at NULL. */\n"
+  "\n"
+  "  pushl $.AFL_SHM_FUZZ_ENV\n"
+  "  call  getenv\n"
+  "  addl  $4, %esp\n"
+  "\n"
+  "  testl %eax, %eax\n"
+  "  je    __afl_setup_no_fuzz\n"
+  "\n"
+  "  pushl %eax\n"
+  "  call  atoi\n"
+  "  addl  $4, %esp\n"
+  "\n"
+  "  pushl $0          /* shmat flags    */\n"
+  "  pushl $0          /* requested addr */\n"
+  "  pushl %eax        /* SHM ID         */\n"
+  "  call  shmat\n"
+  "  addl  $12, %esp\n"
+  "\n"
+  "  cmpl $-1, %eax\n"
+  "  je   __afl_setup_no_fuzz\n"
+  "\n"
+  "  movl %eax, __afl_fuzz_ptr\n"
+  "\n"
+  "__afl_setup_no_fuzz:\n"
+  "\n"
+  "  /* In deferred mode, the fork server is started later on, when the\n"
+  "     program calls __afl_manual_init(). */\n"
+  "\n"
+  "  pushl $.AFL_DEFER_ENV\n"
+  "  call  getenv\n"
+  "  addl  $4, %esp\n"
+  "\n"
+  "  testl %eax, %eax\n"
+  "  jne   __afl_setup_done\n"
+  "\n"
+  "  call  __afl_forkserver\n"
+  "\n"
+  "__afl_setup_done:\n"
+  "\n"
+  "  movl __afl_area_ptr, %edx\n"
   "\n"
   "  popl %ecx\n"
   "  popl %eax\n"
+  "  jmp  __afl_store\n"
   "\n"
   "__afl_forkserver:\n"
   "\n"
-  "  /* Enter the fork server mode to avoid the overhead of execve() calls. */\n"
+  "  /* Enter the fork server mode to avoid the overhead of execve() calls.\n"
+  "     This is a normal function; it returns in the child, and never in the\n"
+  "     parent. */\n"
   "\n"
-  "  pushl %eax\n"
-  "  pushl %ecx\n"
-  "  pushl %edx\n"
+  "  /* Let the parent know if the test case SHM region is mapped. */\n"
+  "\n"
+  "  movl $0, __afl_temp\n"
+  "\n"
+  "  cmpl $0, __afl_fuzz_ptr\n"
+  "  je   __afl_fork_phone_home\n"
+  "\n"
+  "  movl $" STRINGIFY(FORKSRV_OPT_SHM_FUZZ) ", __afl_temp\n"
+  "\n"
+  "__afl_fork_phone_home:\n"
   "\n"
   "  /* Phone home and tell the parent that we're OK. (Note that signals with\n"
   "     no SA_RESTART will mess it up). If this fails, assume that the fd is\n"
@@ -261,8 +327,63 @@ static const u8* main_payload_32 =
   "  cmpl  $4, %eax\n"
   "  jne   __afl_fork_resume\n"
   "\n"
+  "  /* Persistent mode only makes sense with somebody to talk to. */\n"
+  "\n"
+  "  pushl $.AFL_PERSIST_ENV\n"
+  "  call  getenv\n"
+  "  addl  $4, %esp\n"
+  "\n"
+  "  testl %eax, %eax\n"
+  "  setne __afl_persist_mode\n"
+  "\n"
+  "  pushl $.AFL_PREFORK_ENV\n"
+  "  call  getenv\n"
+  "  addl  $4, %esp\n"
+  "\n"
+  "  testl %eax, %eax\n"
+  "  setne __afl_prefork_mode\n"
+  "\n"
   "__afl_fork_wait_loop:\n"
   "\n"
+  "  /* With pre-forking, the next child is created while afl-fuzz is still busy\n"
+  "     with the results of the previous one, and parked on a socket until we\n"
+  "     get the go-ahead. */\n"
+  "\n"
+  "  cmpb  $0, __afl_prefork_mode\n"
+  "  je    __afl_fork_wait_go\n"
+  "\n"
+  "  cmpl  $0, __afl_parked_pid\n"
+  "  jne   __afl_fork_wait_go\n"
+  "\n"
+  "  pushl $__afl_rel_fds /* fds       */\n"
+  "  pushl $0             /* protocol  */\n"
+  "  pushl $" STRINGIFY(AS_SOCK_STREAM) "             /* type      */\n"
+  "  pushl $" STRINGIFY(AS_AF_UNIX) "             /* domain    */\n"
+  "  call  socketpair\n"
+  "  addl  $16, %esp\n"
+  "\n"
+  "  testl %eax, %eax\n"
+  "  je    __afl_fork_park\n"
+  "\n"
+  "  movb  $0, __afl_prefork_mode\n"
+  "  jmp   __afl_fork_wait_go\n"
+  "\n"
+  "__afl_fork_park:\n"
+  "\n"
+  "  call fork\n"
+  "\n"
+  "  cmpl $0, %eax\n"
+  "  jl   __afl_die\n"
+  "  je   __afl_fork_parked\n"
+  "\n"
+  "  movl  %eax, __afl_parked_pid\n"
+  "\n"
+  "  pushl __afl_rel_fds+4\n"
+  "  call  close\n"
+  "  addl  $4, %esp\n"
+  "\n"
+  "__afl_fork_wait_go:\n"
+  "\n"
   "  /* Wait for parent by reading from the pipe. Abort if read fails. */\n"
   "\n"
   "  pushl $4          /* length    */\n"
@@ -274,6 +395,43 @@ static const u8* main_payload_32 =
   "  cmpl  $4, %eax\n"
   "  jne   __afl_die\n"
   "\n"
+  "  cmpl  $0, __afl_parked_pid\n"
+  "  je    __afl_fork_new\n"
+  "\n"
+  "  /* Release the parked child. If it's gone in the meantime, reap it and\n"
+  "     fall back to a regular fork(). Its PID goes out only afterwards, so\n"
+  "     that we don't report a child that no longer exists; this is safe, as\n"
+  "     the child only writes to the status pipe in persistent mode, and then\n"
+  "     sends its PID on its own. */\n"
+  "\n"
+  "  pushl $" STRINGIFY(AS_MSG_NOSIGNAL) "        /* flags     */\n"
+  "  pushl $1          /* length    */\n"
+  "  pushl $__afl_temp /* data      */\n"
+  "  pushl __afl_rel_fds /* socket  */\n"
+  "  call  send\n"
+  "  addl  $16, %esp\n"
+  "\n"
+  "  movl  %eax, __afl_temp\n"
+  "\n"
+  "  pushl __afl_rel_fds\n"
+  "  call  close\n"
+  "  addl  $4, %esp\n"
+  "\n"
+  "  movl  __afl_parked_pid, %eax\n"
+  "  movl  %eax, __afl_fork_pid\n"
+  "  movl  $0, __afl_parked_pid\n"
+  "\n"
+  "  cmpl  $1, __afl_temp\n"
+  "  je    __afl_fork_report\n"
+  "\n"
+  "  pushl $0             /* no flags  */\n"
+  "  pushl $0             /* status    */\n"
+  "  pushl __afl_fork_pid /* PID       */\n"
+  "  call  waitpid\n"
+  "  addl  $12, %esp\n"
+  "\n"
+  "__afl_fork_new:\n"
+  "\n"
   "  /* Once woken up, create a clone of our process. This is an excellent use\n"
   "     case for syscall(__NR_clone, 0, CLONE_PARENT), but glibc boneheadedly\n"
   "     caches getpid() results and offers no way to update the value, breaking\n"
@@ -285,16 +443,26 @@ static const u8* main_payload_32 =
   "  jl   __afl_die\n"
   "  je   __afl_fork_resume\n"
   "\n"
-  "  /* In parent process: write PID to pipe, then wait for child. */\n"
-  "\n"
   "  movl  %eax, __afl_fork_pid\n"
   "\n"
+  "__afl_fork_report:\n"
+  "\n"
+  "  /* In parent process: write PID to pipe, then wait for child. A persistent\n"
+  "     mode child reports finished inputs to afl-fuzz on its own, so we only\n"
+  "     hear back once it's gone. It also sends its own PID first, as we could\n"
+  "     not otherwise keep ours from arriving after its first report. */\n"
+  "\n"
+  "  cmpb  $0, __afl_persist_mode\n"
+  "  jne   __afl_fork_wait_child\n"
+  "\n"
   "  pushl $4              /* length    */\n"
   "  pushl $__afl_fork_pid /* data      */\n"
   "  pushl $" STRINGIFY((FORKSRV_FD + 1)) "      /* file desc */\n"
   "  call  write\n"
   "  addl  $12, %esp\n"
   "\n"
+  "__afl_fork_wait_child:\n"
+  "\n"
   "  pushl $0             /* no flags  */\n"
   "  pushl $__afl_temp    /* status    */\n"
   "  pushl __afl_fork_pid /* PID       */\n"
@@ -316,7 +484,27 @@ static const u8* main_payload_32 =
   "\n"
   "__afl_fork_resume:\n"
   "\n"
-  "  /* In child process: close fds, resume execution. */\n"
+  "  /* In child process: close fds, resume execution. In persistent mode,\n"
+  "     the child keeps them, because it talks to afl-fuzz directly. */\n"
+  "\n"
+  "  cmpb  $0, __afl_persist_mode\n"
+  "  je    __afl_fork_close\n"
+  "\n"
+  "  call  getpid\n"
+  "  movl  %eax, __afl_temp\n"
+  "\n"
+  "  pushl $4          /* length    */\n"
+  "  pushl $__afl_temp /* data      */\n"
+  "  pushl $" STRINGIFY((FORKSRV_FD + 1)) "  /* file desc */\n"
+  "  call  write\n"
+  "  addl  $12, %esp\n"
+  "\n"
+  "  cmpl  $4, %eax\n"
+  "  jne   __afl_die\n"
+  "\n"
+  "  jmp   __afl_fork_leave\n"
+  "\n"
+  "__afl_fork_close:\n"
   "\n"
   "  pushl $" STRINGIFY(FORKSRV_FD) "\n"
   "  call  close\n"
@@ -326,10 +514,38 @@ static const u8* main_payload_32 =
   "\n"
   "  addl  $8, %esp\n"
   "\n"
-  "  popl %edx\n"
-  "  popl %ecx\n"
-  "  popl %eax\n"
-  "  jmp  __afl_store\n"
+  "__afl_fork_leave:\n"
+  "\n"
+  "  ret\n"
+  "\n"
+  "__afl_fork_parked:\n"
+  "\n"
+  "  /* In the parked child: wait to be released. If the fork server goes away\n"
+  "     instead, so do we. */\n"
+  "\n"
+  "  pushl __afl_rel_fds\n"
+  "  call  close\n"
+  "  addl  $4, %esp\n"
+  "\n"
+  "  pushl $1            /* length    */\n"
+  "  pushl $__afl_temp   /* data      */\n"
+  "  pushl __afl_rel_fds+4 /* socket  */\n"
+  "  call  read\n"
+  "  addl  $12, %esp\n"
+  "\n"
+  "  cmpl  $1, %eax\n"
+  "  je    __afl_fork_released\n"
+  "\n"
+  "  pushl $0\n"
+  "  call  _exit\n"
+  "\n"
+  "__afl_fork_released:\n"
+  "\n"
+  "  pushl __afl_rel_fds+4\n"
+  "  call  close\n"
+  "  addl  $4, %esp\n"
+  "\n"
+  "  jmp   __afl_fork_resume\n"
   "\n"
   "__afl_die:\n"
   "\n"
@@ -346,6 +562,114 @@ static const u8* main_payload_32 =
   "  popl %eax\n"
   "  jmp __afl_return\n"
   "\n"
+  "/* Persistent and deferred mode entry points, as used by __AFL_LOOP() and\n"
+  "   __AFL_INIT(). Every object file carries a copy, hence the weak linkage.\n"
+  "   See llvm_mode/README.llvm for the semantics. */\n"
+  "\n"
+  ".weak __afl_persistent_loop\n"
+  ".type __afl_persistent_loop, @function\n"
+  "\n"
+  "__afl_persistent_loop:\n"
+  "\n"
+  "  /* On the first pass, just remember the iteration count. */\n"
+  "\n"
+  "  cmpb  $0, __afl_loop_started\n"
+  "  jne   __afl_loop_next\n"
+  "\n"
+  "  movb  $1, __afl_loop_started\n"
+  "  movl  4(%esp), %eax\n"
+  "  movl  %eax, __afl_loop_cnt\n"
+  "\n"
+  "  movl  $1, %eax\n"
+  "  ret\n"
+  "\n"
+  "__afl_loop_next:\n"
+  "\n"
+  "  /* Otherwise, unless the iteration count is exhausted, tell afl-fuzz that\n"
+  "     the input went through fine, wait for the next one, and hand back our\n"
+  "     PID, just like the fork server would do for a new child. */\n"
+  "\n"
+  "  cmpb  $0, __afl_persist_mode\n"
+  "  je    __afl_loop_done\n"
+  "\n"
+  "  decl  __afl_loop_cnt\n"
+  "  je    __afl_loop_done\n"
+  "\n"
+  "  movl  $" STRINGIFY(FORKSRV_PERSIST_TAG) ", __afl_temp\n"
+  "\n"
+  "  pushl $4          /* length    */\n"
+  "  pushl $__afl_temp /* data      */\n"
+  "  pushl $" STRINGIFY((FORKSRV_FD + 1)) "  /* file desc */\n"
+  "  call  write\n"
+  "  addl  $12, %esp\n"
+  "\n"
+  "  cmpl  $4, %eax\n"
+  "  jne   __afl_die\n"
+  "\n"
+  "  pushl $4          /* length    */\n"
+  "  pushl $__afl_temp /* data      */\n"
+  "  pushl $" STRINGIFY(FORKSRV_FD) "        /* file desc */\n"
+  "  call  read\n"
+  "  addl  $12, %esp\n"
+  "\n"
+  "  cmpl  $4, %eax\n"
+  "  jne   __afl_die\n"
+  "\n"
+  "  call  getpid\n"
+  "  movl  %eax, __afl_temp\n"
+  "\n"
+  "  pushl $4          /* length    */\n"
+  "  pushl $__afl_temp /* data      */\n"
+  "  pushl $" STRINGIFY((FORKSRV_FD + 1)) "  /* file desc */\n"
+  "  call  write\n"
+  "  addl  $12, %esp\n"
+  "\n"
+  "  cmpl  $4, %eax\n"
+  "  jne   __afl_die\n"
+  "\n"
+#ifndef COVERAGE_ONLY
+  "  movl  $0, __afl_prev_loc\n"
+#endif /* !COVERAGE_ONLY */
+  "\n"
+  "  movl  $1, %eax\n"
+  "  ret\n"
+  "\n"
+  "__afl_loop_done:\n"
+  "\n"
+  "  xorl  %eax, %eax\n"
+  "  ret\n"
+  "\n"
+  ".weak __afl_manual_init\n"
+  ".type __afl_manual_init, @function\n"
+  "\n"
+  "__afl_manual_init:\n"
+  "\n"
+  "  cmpb  $0, __afl_init_done\n"
+  "  jne   __afl_init_return\n"
+  "\n"
+  "  movb  $1, __afl_init_done\n"
+  "\n"
+  "  /* Make sure that the SHM region is mapped; this is a no-op (well, one\n"
+  "     extra hit in the bitmap) if an instrumented block got to it first.\n"
+  "     The logging code clobbers edi, which is callee-saved for us. */\n"
+  "\n"
+  "  pushl %edi\n"
+  "  xorl  %ecx, %ecx\n"
+  "  xorl  %edi, %edi\n"
+  "  call  __afl_maybe_log\n"
+  "  popl  %edi\n"
+  "\n"
+  "  /* Start the fork server, unless we're not running under afl-fuzz. */\n"
+  "\n"
+  "  cmpl  $0, __afl_area_ptr\n"
+  "  je    __afl_init_return\n"
+  "\n"
+  "  call  __afl_forkserver\n"
+  "\n"
+  "__afl_init_return:\n"
+  "\n"
+  "  ret\n"
+  "\n"
   ".AFL_VARS:\n"
   "\n"
   "  .comm   __afl_area_ptr, 4, 32\n"
@@ -355,10 +679,30 @@ static const u8* main_payload_32 =
 #endif /* !COVERAGE_ONLY */
   "  .comm   __afl_fork_pid, 4, 32\n"
   "  .comm   __afl_temp, 4, 32\n"
+  "  .comm   __afl_fuzz_ptr, 4, 32\n"
+  "  .comm   __afl_persist_mode, 1, 32\n"
+  "  .comm   __afl_loop_cnt, 4, 32\n"
+  "  .comm   __afl_loop_started, 1, 32\n"
+  "  .comm   __afl_init_done, 1, 32\n"
+  "  .comm   __afl_prefork_mode, 1, 32\n"
+  "  .comm   __afl_parked_pid, 4, 32\n"
+  "  .comm   __afl_rel_fds, 8, 32\n"
   "\n"
   ".AFL_SHM_ENV:\n"
   "  .asciz \"" SHM_ENV_VAR "\"\n"
   "\n"
+  ".AFL_SHM_FUZZ_ENV:\n"
+  "  .asciz \"" SHM_FUZZ_ENV_VAR "\"\n"
+  "\n"
+  ".AFL_PERSIST_ENV:\n"
+  "  .asciz \"" PERSIST_ENV_VAR "\"\n"
+  "\n"
+  ".AFL_DEFER_ENV:\n"
+  "  .asciz \"" DEFER_ENV_VAR "\"\n"
+  "\n"
+  ".AFL_PREFORK_ENV:\n"
+  "  .asciz \"" PREFORK_ENV_VAR "\"\n"
+  "\n"
   "/* --- END --- */\n"
   "\n";
 
@@ -521,15 +865,108 @@ static const u8* main_payload_64 =
   "  movq __afl_global_area_ptr@GOTPCREL(%rip), %rdx\n"
   "  movq %rax, (%rdx)\n"
 #endif /* ^__APPLE__ */
-  "  movq %rax, %rdx\n"
+  "\n"
+  "  /* Map the test case SHM region, if afl-fuzz set one up. This one is\n"
+  "     optional, so failures just leave __afl_fuzz_ptr at NULL. */\n"
+  "\n"
+  "  leaq .AFL_SHM_FUZZ_ENV(%rip), %rdi\n"
+  CALL_L64("getenv")
+  "\n"
+  "  testq %rax, %rax\n"
+  "  je    __afl_setup_no_fuzz\n"
+  "\n"
+  "  movq  %rax, %rdi\n"
+  CALL_L64("atoi")
+  "\n"
+  "  xorq %rdx, %rdx   /* shmat flags    */\n"
+  "  xorq %rsi, %rsi   /* requested addr */\n"
+  "  movq %rax, %rdi   /* SHM ID         */\n"
+  CALL_L64("shmat")
+  "\n"
+  "  cmpq $-1, %rax\n"
+  "  je   __afl_setup_no_fuzz\n"
+  "\n"
+#ifdef __APPLE__
+  "  movq %rax, __afl_fuzz_ptr(%rip)\n"
+#else
+  "  movq __afl_fuzz_ptr@GOTPCREL(%rip), %rdx\n"
+  "  movq %rax, (%rdx)\n"
+#endif /* ^__APPLE__ */
+  "\n"
+  "__afl_setup_no_fuzz:\n"
+  "\n"
+  "  /* In deferred mode, the fork server is started later on, when the\n"
+  "     program calls __afl_manual_init(). */\n"
+  "\n"
+  "  leaq .AFL_DEFER_ENV(%rip), %rdi\n"
+  CALL_L64("getenv")
+  "\n"
+  "  testq %rax, %rax\n"
+  "  jne   __afl_setup_done\n"
+  "\n"
+  "  call  __afl_forkserver\n"
+  "\n"
+  "__afl_setup_done:\n"
+  "\n"
+  "  movq __afl_area_ptr(%rip), %rdx\n"
+  "\n"
+  "  movq %r12, %rsp\n"
+  "  popq %r12\n"
+  "\n"
+  "  movq  0(%rsp), %rax\n"
+  "  movq  8(%rsp), %rcx\n"
+  "  movq 16(%rsp), %rdi\n"
+  "  movq 32(%rsp), %rsi\n"
+  "  movq 40(%rsp), %r8\n"
+  "  movq 48(%rsp), %r9\n"
+  "  movq 56(%rsp), %r10\n"
+  "  movq 64(%rsp), %r11\n"
+  "\n"
+  "  movq  96(%rsp), %xmm0\n"
+  "  movq 112(%rsp), %xmm1\n"
+  "  movq 128(%rsp), %xmm2\n"
+  "  movq 144(%rsp), %xmm3\n"
+  "  movq 160(%rsp), %xmm4\n"
+  "  movq 176(%rsp), %xmm5\n"
+  "  movq 192(%rsp), %xmm6\n"
+  "  movq 208(%rsp), %xmm7\n"
+  "  movq 224(%rsp), %xmm8\n"
+  "  movq 240(%rsp), %xmm9\n"
+  "  movq 256(%rsp), %xmm10\n"
+  "  movq 272(%rsp), %xmm11\n"
+  "  movq 288(%rsp), %xmm12\n"
+  "  movq 304(%rsp), %xmm13\n"
+  "  movq 320(%rsp), %xmm14\n"
+  "  movq 336(%rsp), %xmm15\n"
+  "\n"
+  "  leaq 352(%rsp), %rsp\n"
+  "\n"
+  "  jmp  __afl_store\n"
   "\n"
   "__afl_forkserver:\n"
   "\n"
-  "  /* Enter the fork server mode to avoid the overhead of execve() calls. We\n"
-  "     push rdx (area ptr) twice to keep stack alignment neat. */\n"
+  "  /* Enter the fork server mode to avoid the overhead of execve() calls.\n"
+  "     This is a normal function; it returns in the child, and never in the\n"
+  "     parent. We push r12 to keep stack alignment neat. */\n"
+  "\n"
+  "  pushq %r12\n"
+  "\n"
+  "  /* Let the parent know if the test case SHM region is mapped. */\n"
+  "\n"
+  "  movl $0, __afl_temp(%rip)\n"
+  "\n"
+#ifdef __APPLE__
+  "  movq __afl_fuzz_ptr(%rip), %rax\n"
+#else
+  "  movq __afl_fuzz_ptr@GOTPCREL(%rip), %rax\n"
+  "  movq (%rax), %rax\n"
+#endif /* ^__APPLE__ */
+  "  testq %rax, %rax\n"
+  "  je    __afl_fork_phone_home\n"
   "\n"
-  "  pushq %rdx\n"
-  "  pushq %rdx\n"
+  "  movl $" STRINGIFY(FORKSRV_OPT_SHM_FUZZ) ", __afl_temp(%rip)\n"
+  "\n"
+  "__afl_fork_phone_home:\n"
   "\n"
   "  /* Phone home and tell the parent that we're OK. (Note that signals with\n"
   "     no SA_RESTART will mess it up). If this fails, assume that the fd is\n"
@@ -544,8 +981,66 @@ static const u8* main_payload_64 =
   "  cmpq $4, %rax\n"
   "  jne  __afl_fork_resume\n"
   "\n"
+  "  /* Persistent mode only makes sense with somebody to talk to. */\n"
+  "\n"
+  "  leaq .AFL_PERSIST_ENV(%rip), %rdi\n"
+  CALL_L64("getenv")
+  "\n"
+  "  testq %rax, %rax\n"
+  "  je    __afl_fork_check_prefork\n"
+  "\n"
+#ifdef __APPLE__
+  "  movb $1, __afl_persist_mode(%rip)\n"
+#else
+  "  movq __afl_persist_mode@GOTPCREL(%rip), %rax\n"
+  "  movb $1, (%rax)\n"
+#endif /* ^__APPLE__ */
+  "\n"
+  "__afl_fork_check_prefork:\n"
+  "\n"
+  "  leaq .AFL_PREFORK_ENV(%rip), %rdi\n"
+  CALL_L64("getenv")
+  "\n"
+  "  testq %rax, %rax\n"
+  "  setne __afl_prefork_mode(%rip)\n"
+  "\n"
   "__afl_fork_wait_loop:\n"
   "\n"
+  "  /* With pre-forking, the next child is created while afl-fuzz is still busy\n"
+  "     with the results of the previous one, and parked on a socket until we\n"
+  "     get the go-ahead. */\n"
+  "\n"
+  "  cmpb $0, __afl_prefork_mode(%rip)\n"
+  "  je   __afl_fork_wait_go\n"
+  "\n"
+  "  cmpl $0, __afl_parked_pid(%rip)\n"
+  "  jne  __afl_fork_wait_go\n"
+  "\n"
+  "  leaq __afl_rel_fds(%rip), %rcx /* fds       */\n"
+  "  movq $0, %rdx                  /* protocol  */\n"
+  "  movq $" STRINGIFY(AS_SOCK_STREAM) ", %rsi                  /* type      */\n"
+  "  movq $" STRINGIFY(AS_AF_UNIX) ", %rdi                  /* domain    */\n"
+  CALL_L64("socketpair")
+  "  testl %eax, %eax\n"
+  "  je    __afl_fork_park\n"
+  "\n"
+  "  movb $0, __afl_prefork_mode(%rip)\n"
+  "  jmp  __afl_fork_wait_go\n"
+  "\n"
+  "__afl_fork_park:\n"
+  "\n"
+  CALL_L64("fork")
+  "  cmpl $0, %eax\n"
+  "  jl   __afl_die\n"
+  "  je   __afl_fork_parked\n"
+  "\n"
+  "  movl %eax, __afl_parked_pid(%rip)\n"
+  "\n"
+  "  movl __afl_rel_fds+4(%rip), %edi\n"
+  CALL_L64("close")
+  "\n"
+  "__afl_fork_wait_go:\n"
+  "\n"
   "  /* Wait for parent by reading from the pipe. Abort if read fails. */\n"
   "\n"
   "  movq $4, %rdx               /* length    */\n"
@@ -555,6 +1050,39 @@ static const u8* main_payload_64 =
   "  cmpq $4, %rax\n"
   "  jne  __afl_die\n"
   "\n"
+  "  cmpl $0, __afl_parked_pid(%rip)\n"
+  "  je   __afl_fork_new\n"
+  "\n"
+  "  /* Release the parked child. If it's gone in the meantime, reap it and\n"
+  "     fall back to a regular fork(). Its PID goes out only afterwards, so\n"
+  "     that we don't report a child that no longer exists; this is safe, as\n"
+  "     the child only writes to the status pipe in persistent mode, and then\n"
+  "     sends its PID on its own. */\n"
+  "\n"
+  "  movq $" STRINGIFY(AS_MSG_NOSIGNAL) ", %rcx            /* flags     */\n"
+  "  movq $1, %rdx                 /* length    */\n"
+  "  leaq __afl_temp(%rip), %rsi   /* data      */\n"
+  "  movl __afl_rel_fds(%rip), %edi /* socket   */\n"
+  CALL_L64("send")
+  "  movl %eax, __afl_temp(%rip)\n"
+  "\n"
+  "  movl __afl_rel_fds(%rip), %edi\n"
+  CALL_L64("close")
+  "\n"
+  "  movl __afl_parked_pid(%rip), %eax\n"
+  "  movl %eax, __afl_fork_pid(%rip)\n"
+  "  movl $0, __afl_parked_pid(%rip)\n"
+  "\n"
+  "  cmpl $1, __afl_temp(%rip)\n"
+  "  je   __afl_fork_report\n"
+  "\n"
+  "  movq $0, %rdx                   /* no flags  */\n"
+  "  movq $0, %rsi                   /* status    */\n"
+  "  movl __afl_fork_pid(%rip), %edi /* PID       */\n"
+  CALL_L64("waitpid")
+  "\n"
+  "__afl_fork_new:\n"
+  "\n"
   "  /* Once woken up, create a clone of our process. This is an excellent use\n"
   "     case for syscall(__NR_clone, 0, CLONE_PARENT), but glibc boneheadedly\n"
   "     caches getpid() results and offers no way to update the value, breaking\n"
@@ -565,20 +1093,36 @@ static const u8* main_payload_64 =
   "  jl   __afl_die\n"
   "  je   __afl_fork_resume\n"
   "\n"
-  "  /* In parent process: write PID to pipe, then wait for child. */\n"
-  "\n"
   "  movl %eax, __afl_fork_pid(%rip)\n"
   "\n"
+  "__afl_fork_report:\n"
+  "\n"
+  "  /* In parent process: write PID to pipe, then wait for child. A persistent\n"
+  "     mode child reports finished inputs to afl-fuzz on its own, so we only\n"
+  "     hear back once it's gone. It also sends its own PID first, as we could\n"
+  "     not otherwise keep ours from arriving after its first report. */\n"
+  "\n"
+#ifdef __APPLE__
+  "  movb __afl_persist_mode(%rip), %al\n"
+#else
+  "  movq __afl_persist_mode@GOTPCREL(%rip), %rax\n"
+  "  movb (%rax), %al\n"
+#endif /* ^__APPLE__ */
+  "  testb %al, %al\n"
+  "  jne   __afl_fork_wait_child\n"
+  "\n"
   "  movq $4, %rdx                   /* length    */\n"
   "  leaq __afl_fork_pid(%rip), %rsi /* data      */\n"
   "  movq $" STRINGIFY((FORKSRV_FD + 1)) ", %rdi             /* file desc */\n"
   CALL_L64("write")
   "\n"
+  "__afl_fork_wait_child:\n"
+  "\n"
   "  movq $0, %rdx                   /* no flags  */\n"
   "  leaq __afl_temp(%rip), %rsi     /* status    */\n"
-  "  movq __afl_fork_pid(%rip), %rdi /* PID       */\n"
+  "  movl __afl_fork_pid(%rip), %edi /* PID       */\n"
   CALL_L64("waitpid")
-  "  cmpq $0, %rax\n"
+  "  cmpl $0, %eax\n"
   "  jle  __afl_die\n"
   "\n"
   "  /* Relay wait status to pipe, then loop back. */\n"
@@ -592,7 +1136,31 @@ static const u8* main_payload_64 =
   "\n"
   "__afl_fork_resume:\n"
   "\n"
-  "  /* In child process: close fds, resume execution. */\n"
+  "  /* In child process: close fds, resume execution. In persistent mode,\n"
+  "     the child keeps them, because it talks to afl-fuzz directly. */\n"
+  "\n"
+#ifdef __APPLE__
+  "  movb __afl_persist_mode(%rip), %al\n"
+#else
+  "  movq __afl_persist_mode@GOTPCREL(%rip), %rax\n"
+  "  movb (%rax), %al\n"
+#endif /* ^__APPLE__ */
+  "  testb %al, %al\n"
+  "  je    __afl_fork_close\n"
+  "\n"
+  CALL_L64("getpid")
+  "  movl %eax, __afl_temp(%rip)\n"
+  "\n"
+  "  movq $4, %rdx               /* length    */\n"
+  "  leaq __afl_temp(%rip), %rsi /* data      */\n"
+  "  movq $" STRINGIFY((FORKSRV_FD + 1)) ", %rdi       /* file desc */\n"
+  CALL_L64("write")
+  "  cmpq $4, %rax\n"
+  "  jne  __afl_die\n"
+  "\n"
+  "  jmp   __afl_fork_leave\n"
+  "\n"
+  "__afl_fork_close:\n"
   "\n"
   "  movq $" STRINGIFY(FORKSRV_FD) ", %rdi\n"
   CALL_L64("close")
@@ -600,41 +1168,35 @@ static const u8* main_payload_64 =
   "  movq $" STRINGIFY((FORKSRV_FD + 1)) ", %rdi\n"
   CALL_L64("close")
   "\n"
-  "  popq %rdx\n"
-  "  popq %rdx\n"
+  "__afl_fork_leave:\n"
   "\n"
-  "  movq %r12, %rsp\n"
   "  popq %r12\n"
+  "  ret\n"
   "\n"
-  "  movq  0(%rsp), %rax\n"
-  "  movq  8(%rsp), %rcx\n"
-  "  movq 16(%rsp), %rdi\n"
-  "  movq 32(%rsp), %rsi\n"
-  "  movq 40(%rsp), %r8\n"
-  "  movq 48(%rsp), %r9\n"
-  "  movq 56(%rsp), %r10\n"
-  "  movq 64(%rsp), %r11\n"
+  "__afl_fork_parked:\n"
   "\n"
-  "  movq  96(%rsp), %xmm0\n"
-  "  movq 112(%rsp), %xmm1\n"
-  "  movq 128(%rsp), %xmm2\n"
-  "  movq 144(%rsp), %xmm3\n"
-  "  movq 160(%rsp), %xmm4\n"
-  "  movq 176(%rsp), %xmm5\n"
-  "  movq 192(%rsp), %xmm6\n"
-  "  movq 208(%rsp), %xmm7\n"
-  "  movq 224(%rsp), %xmm8\n"
-  "  movq 240(%rsp), %xmm9\n"
-  "  movq 256(%rsp), %xmm10\n"
-  "  movq 272(%rsp), %xmm11\n"
-  "  movq 288(%rsp), %xmm12\n"
-  "  movq 304(%rsp), %xmm13\n"
-  "  movq 320(%rsp), %xmm14\n"
-  "  movq 336(%rsp), %xmm15\n"
+  "  /* In the parked child: wait to be released. If the fork server goes away\n"
+  "     instead, so do we. */\n"
   "\n"
-  "  leaq 352(%rsp), %rsp\n"
+  "  movl __afl_rel_fds(%rip), %edi\n"
+  CALL_L64("close")
   "\n"
-  "  jmp  __afl_store\n"
+  "  movq $1, %rdx                    /* length    */\n"
+  "  leaq __afl_temp(%rip), %rsi      /* data      */\n"
+  "  movl __afl_rel_fds+4(%rip), %edi /* socket    */\n"
+  CALL_L64("read")
+  "  cmpq $1, %rax\n"
+  "  je   __afl_fork_released\n"
+  "\n"
+  "  xorq %rdi, %rdi\n"
+  CALL_L64("_exit")
+  "\n"
+  "__afl_fork_released:\n"
+  "\n"
+  "  movl __afl_rel_fds+4(%rip), %edi\n"
+  CALL_L64("close")
+  "\n"
+  "  jmp  __afl_fork_resume\n"
   "\n"
   "__afl_die:\n"
   "\n"
@@ -681,6 +1243,135 @@ static const u8* main_payload_64 =
   "\n"
   "  jmp __afl_return\n"
   "\n"
+  "/* Persistent and deferred mode entry points, as used by __AFL_LOOP() and\n"
+  "   __AFL_INIT(). Every object file carries a copy, hence the weak linkage.\n"
+  "   See llvm_mode/README.llvm for the semantics. */\n"
+  "\n"
+#ifdef __APPLE__
+  ".globl __afl_persistent_loop\n"
+  ".weak_definition __afl_persistent_loop\n"
+#else
+  ".weak __afl_persistent_loop\n"
+  ".type __afl_persistent_loop, @function\n"
+#endif /* ^__APPLE__ */
+  "\n"
+  "__afl_persistent_loop:\n"
+  "\n"
+  "  /* On the first pass, just remember the iteration count. */\n"
+  "\n"
+  "  cmpb $0, __afl_loop_started(%rip)\n"
+  "  jne  __afl_loop_next\n"
+  "\n"
+  "  movb $1, __afl_loop_started(%rip)\n"
+  "  movl %edi, __afl_loop_cnt(%rip)\n"
+  "\n"
+  "  movl $1, %eax\n"
+  "  ret\n"
+  "\n"
+  "__afl_loop_next:\n"
+  "\n"
+  "  /* Otherwise, unless the iteration count is exhausted, tell afl-fuzz that\n"
+  "     the input went through fine, wait for the next one, and hand back our\n"
+  "     PID, just like the fork server would do for a new child. */\n"
+  "\n"
+#ifdef __APPLE__
+  "  movb __afl_persist_mode(%rip), %al\n"
+#else
+  "  movq __afl_persist_mode@GOTPCREL(%rip), %rax\n"
+  "  movb (%rax), %al\n"
+#endif /* ^__APPLE__ */
+  "  testb %al, %al\n"
+  "  je    __afl_loop_done\n"
+  "\n"
+  "  decl __afl_loop_cnt(%rip)\n"
+  "  je   __afl_loop_done\n"
+  "\n"
+  "  subq $8, %rsp\n"
+  "\n"
+  "  movl $" STRINGIFY(FORKSRV_PERSIST_TAG) ", __afl_temp(%rip)\n"
+  "\n"
+  "  movq $4, %rdx               /* length    */\n"
+  "  leaq __afl_temp(%rip), %rsi /* data      */\n"
+  "  movq $" STRINGIFY((FORKSRV_FD + 1)) ", %rdi       /* file desc */\n"
+  CALL_L64("write")
+  "  cmpq $4, %rax\n"
+  "  jne  __afl_die\n"
+  "\n"
+  "  movq $4, %rdx               /* length    */\n"
+  "  leaq __afl_temp(%rip), %rsi /* data      */\n"
+  "  movq $" STRINGIFY(FORKSRV_FD) ", %rdi             /* file desc */\n"
+  CALL_L64("read")
+  "  cmpq $4, %rax\n"
+  "  jne  __afl_die\n"
+  "\n"
+  CALL_L64("getpid")
+  "  movl %eax, __afl_temp(%rip)\n"
+  "\n"
+  "  movq $4, %rdx               /* length    */\n"
+  "  leaq __afl_temp(%rip), %rsi /* data      */\n"
+  "  movq $" STRINGIFY((FORKSRV_FD + 1)) ", %rdi       /* file desc */\n"
+  CALL_L64("write")
+  "  cmpq $4, %rax\n"
+  "  jne  __afl_die\n"
+  "\n"
+  "  addq $8, %rsp\n"
+  "\n"
+#ifndef COVERAGE_ONLY
+  "  movq $0, __afl_prev_loc(%rip)\n"
+#endif /* !COVERAGE_ONLY */
+  "\n"
+  "  movl $1, %eax\n"
+  "  ret\n"
+  "\n"
+  "__afl_loop_done:\n"
+  "\n"
+  "  xorl %eax, %eax\n"
+  "  ret\n"
+  "\n"
+#ifdef __APPLE__
+  ".globl __afl_manual_init\n"
+  ".weak_definition __afl_manual_init\n"
+#else
+  ".weak __afl_manual_init\n"
+  ".type __afl_manual_init, @function\n"
+#endif /* ^__APPLE__ */
+  "\n"
+  "__afl_manual_init:\n"
+  "\n"
+  "  cmpb $0, __afl_init_done(%rip)\n"
+  "  jne  __afl_init_return\n"
+  "\n"
+  "  movb $1, __afl_init_done(%rip)\n"
+  "\n"
+  "  pushq %r12\n"
+  "\n"
+  "  /* Make sure that the SHM region is mapped; this is a no-op (well, one\n"
+  "     extra hit in the bitmap) if an instrumented block got to it first. */\n"
+  "\n"
+  "  xorq %rcx, %rcx\n"
+  "  call __afl_maybe_log\n"
+  "\n"
+  "  /* Start the fork server, unless we're not running under afl-fuzz. */\n"
+  "\n"
+#ifdef __APPLE__
+  "  movq __afl_global_area_ptr(%rip), %rax\n"
+#else
+  "  movq __afl_global_area_ptr@GOTPCREL(%rip), %rax\n"
+  "  movq (%rax), %rax\n"
+#endif /* ^__APPLE__ */
+  "  testq %rax, %rax\n"
+  "  je    __afl_init_skip\n"
+  "\n"
+  "  call  __afl_forkserver\n"
+  "\n"
+  "__afl_init_skip:\n"
+  "\n"
+  "  popq %r12\n"
+  "\n"
+  "__afl_init_return:\n"
+  "\n"
+  "  ret\n"
+  "\n"
   ".AFL_VARS:\n"
   "\n"
 
@@ -693,6 +1384,12 @@ static const u8* main_payload_64 =
   "  .comm   __afl_fork_pid, 4\n"
   "  .comm   __afl_temp, 4\n"
   "  .comm   __afl_setup_failure, 1\n"
+  "  .comm   __afl_loop_cnt, 4\n"
+  "  .comm   __afl_loop_started, 1\n"
+  "  .comm   __afl_init_done, 1\n"
+  "  .comm   __afl_prefork_mode, 1\n"
+  "  .comm   __afl_parked_pid, 4\n"
+  "  .comm   __afl_rel_fds, 8\n"
 
 #else
 
@@ -703,14 +1400,34 @@ static const u8* main_payload_64 =
   "  .lcomm   __afl_fork_pid, 4\n"
   "  .lcomm   __afl_temp, 4\n"
   "  .lcomm   __afl_setup_failure, 1\n"
+  "  .lcomm   __afl_loop_cnt, 4\n"
+  "  .lcomm   __afl_loop_started, 1\n"
+  "  .lcomm   __afl_init_done, 1\n"
+  "  .lcomm   __afl_prefork_mode, 1\n"
+  "  .lcomm   __afl_parked_pid, 4\n"
+  "  .lcomm   __afl_rel_fds, 8\n"
 
 #endif /* ^__APPLE__ */
 
   "  .comm    __afl_global_area_ptr, 8, 8\n"
+  "  .comm    __afl_fuzz_ptr, 8, 8\n"
+  "  .comm    __afl_persist_mode, 1, 1\n"
   "\n"
   ".AFL_SHM_ENV:\n"
   "  .asciz \"" SHM_ENV_VAR "\"\n"
   "\n"
+  ".AFL_SHM_FUZZ_ENV:\n"
+  "  .asciz \"" SHM_FUZZ_ENV_VAR "\"\n"
+  "\n"
+  ".AFL_PERSIST_ENV:\n"
+  "  .asciz \"" PERSIST_ENV_VAR "\"\n"
+  "\n"
+  ".AFL_DEFER_ENV:\n"
+  "  .asciz \"" DEFER_ENV_VAR "\"\n"
+  "\n"
+  ".AFL_PREFORK_ENV:\n"
+  "  .asciz \"" PREFORK_ENV_VAR "\"\n"
+  "\n"
   "/* --- END --- */\n"
   "\n";
 
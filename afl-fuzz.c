@@ -56,8 +56,22 @@
 #include <sys/ioctl.h>
 #include <sys/file.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
-#include <sys/sendfile.h>
+#include <netinet/tcp.h>
+#include <net/if.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <poll.h>
+#include <stddef.h>
+
+/* The bitmap scans done after every exec have AVX2 and AVX-512 variants,
+ picked at run time by setup_simd(). */
+
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ >= 5)
+#  define HAVE_SIMD_MAP
+#  include <immintrin.h>
+#endif /* __x86_64__ && (__clang__ || __GNUC__ >= 5) */
 
 #ifdef XIAOSA
 
@@ -88,6 +102,8 @@ static u64 mem_limit = MEM_LIMIT; /* Memory cap for child (MB)        */
 
 static u32 stats_update_freq = 1; /* Stats update frequency (execs)   */
 
+static u8 simd_mode; /* Bitmap scans: 0 = scalar, 1 = AVX2, 2 = AVX-512 */
+
 static u8 	skip_deterministic , /* Skip deterministic stages?       */
 			force_deterministic , /* Force deterministic stages?      */
 			use_splicing , /* Recombine input files?           */
@@ -108,13 +124,15 @@ static u8 	skip_deterministic , /* Skip deterministic stages?       */
 			bitmap_changed = 1 , /* Time to update bitmap?           */
 			qemu_mode , /* Running in QEMU mode?            */
 			skip_requested , /* Skip request, via SIGUSR1        */
-			run_over10m; /* Run time over 10 minutes?        */
+			run_over10m , /* Run time over 10 minutes?        */
+			out_memfd; /* out_file backed by a memfd?      */
 
 static s32 	out_fd , /* Persistent fd for out_file       */
 			dev_urandom_fd = -1 , /* Persistent fd for /dev/urandom   */  //随机数文件
 			dev_null_fd = -1 , /* Persistent fd for /dev/null      */
 			fsrv_ctl_fd , /* Fork server control pipe (write) */
-			fsrv_st_fd; /* Fork server status pipe (read)   */
+			fsrv_st_fd , /* Fork server status pipe (read)   */
+			memfd_link_owner; /* Process that made the -f symlink */
 
 static s32 forksrv_pid , /* PID of the fork server           */
 			child_pid = -1 , /* PID of the fuzzed program        */
@@ -127,7 +145,12 @@ static	u32* virgin_counts;    /*SHM to save the execution number of the each tup
 
 static 	u8 	virgin_bits [ MAP_SIZE ] , /* Regions yet untouched by fuzzing */ //包含滚筒值
 			virgin_hang [ MAP_SIZE ] , /* Bits we haven't seen in hangs    */
-			virgin_crash [ MAP_SIZE ]; /* Bits we haven't seen in crashes  */
+			virgin_crash [ MAP_SIZE ] , /* Bits we haven't seen in crashes  */
+			virgin_oom [ MAP_SIZE ]; /* Bits we haven't seen in OOMs     */
+
+static 	u8 	var_bytes [ MAP_SIZE ]; /* Map bytes seen varying in calib. */
+static 	u32 var_idx [ MAP_SIZE ] , /* Indices of var_bytes[] set       */
+			var_byte_count; /* Number of var_bytes[] set        */
 
 static 	s32	shm_id; /* ID of the SHM region             */
 
@@ -135,6 +158,18 @@ static 	s32	shm_id; /* ID of the SHM region             */
 static	s32	shm_id_virgin_counts;    /* id of SHM, to save the execution number of the each tuple*/
 #endif
 
+static 	s32	shm_fuzz_id = -1; /* ID of the test case SHM region   */
+static 	u8* shm_fuzz_buf; /* Test case SHM (length + data)    */
+static 	u8 	shm_fuzz_mode , /* Binary asks for SHM test cases?  */
+			shm_fuzz_live; /* Fork server confirmed the map?   */
+
+static 	u8*	cgroup_path; /* Per-instance cgroup (AFL_CGROUP) */
+static 	s32	cgroup_owner , /* Process that created the cgroup  */
+			cgroup_procs_fd = -1 , /* cgroup.procs of the above       */
+			cgroup_events_fd = -1; /* memory.events of the above      */
+static 	u64	cgroup_ooms; /* oom_kill count seen so far       */
+static 	u8 	oom_killed; /* Last crash was an OOM kill?     */
+
 static volatile u8 stop_soon , /* Ctrl-C pressed?                  */
 clear_screen = 1 , /* Window resized?                  */
 child_timed_out; /* Traced process timed out?        */  //判断子进程是否超时,1为超时
@@ -168,6 +203,8 @@ static u64 	total_crashes , 	/* Total number of crashes          */
 			unique_crashes , 	/* Crashes with unique signatures   */
 			total_hangs , 		/* Total number of hangs            */
 			unique_hangs , 		/* Hangs with unique signatures     */
+			total_ooms , 		/* Children killed by cgroup OOM   */
+			unique_ooms , 		/* OOM kills with unique signatures */
 			total_execs , 		/* Total execve() calls             */
 			start_time , 		/* Unix start time (ms)             */
 			last_path_time , 	/* Time for most recent path (ms)   */
@@ -222,6 +259,10 @@ static struct sockaddr_storage N_server_addr; /* and server (send side)   */
 static socklen_t N_myaddrlen = sizeof(struct sockaddr_storage);
 /* and length of both               */
 
+static struct sockaddr_un N_unix_addr; /* unix:// address, and a stand-in */
+static struct addrinfo N_unix_ai; /* for getaddrinfo() results      */
+static s32 N_unix_owner = 0; /* pid that bound a -L socket file */
+
 static u32 N_option_specified = 0; /* 1 if a -N option is present      */
 static u8* N_option_string = 0; /* points to copy of -N option str  */
 static u32 N_slen = 0; /* length of the -N option string   */
@@ -230,9 +271,51 @@ static u32 N_fuzz_client = 0; /* 1 if target is a network client  */
 static u32 N_myaddr_valid = 0; /* use established conn or addr     */
 static s32 N_fd; /* for network file descriptor      */
 
-static u32 N_timeout_given = 0; /* use delay before network I/O     */
-static u32 N_exec_tmout = 0; /* network I/O delay in msec        */
-static struct timespec N_it; /* structure for nanosleep() call   */
+static u32 N_timeout_given = 0; /* -D given                         */
+static u32 N_exec_tmout = 0; /* -D startup estimate in msec      */
+static u64 N_ready_us = 0; /* learned target startup latency   */
+
+static u8 N_done_close = 0 , /* -E close: peer closed its side    */
+N_done_response = 0 , /* -E response: the target replied  */
+N_done_cpu = 0; /* -E cpu: the child went CPU-idle  */
+static u32 N_idle_ms = 0 , /* -E idle: quiet interval in msec  */
+N_cpu_ms = 0; /* -E cpu: CPU sampling interval    */
+static s32 N_conn_fd = -1; /* connection watched by -E         */
+static u8 N_desock = 0; /* AFL_DESOCK: no real network I/O  */
+static u32 N_persist = 0 , /* -R: requests per server instance */
+N_srv_reqs = 0; /* requests handled by N_srv_pid   */
+static s32 N_srv_pid = 0; /* server kept up between runs      */
+static u8 N_session = 0; /* AFL_NET_SESSION: 1 = separated, */
+/* 2 = framed (length-prefixed)     */
+static u32 N_pace_ms = 0 , /* delay between session messages   */
+N_reply_ms = 0; /* max wait for a reply in between  */
+static u8 N_done; /* a -E detector fired in this run  */
+static u8 N_resp_on = 0 , /* AFL_NET_RESPONSES: hash replies   */
+N_resp_digits = 0; /* mask: digit runs count as one    */
+static u8 N_resp_buf [ NET_RESP_MAX + 8 ]; /* replies to the current run */
+static u32 N_resp_len = 0 , /* bytes kept in N_resp_buf         */
+N_resp_hash = 0 , /* normalized hash of those         */
+N_resp_states = 0 , /* distinct response states seen    */
+N_resp_flaky = 0 , /* new responses not seen again     */
+N_mask_cnt = 0; /* AFL_NET_RESP_MASK byte ranges    */
+static u32 N_mask_beg [ NET_RESP_MAX_MASKS ] , N_mask_end [ NET_RESP_MAX_MASKS ];
+static u8 N_resp_seen [ NET_RESP_MAP_SIZE >> 3 ]; /* response states so far  */
+static u8 N_req_buf [ NET_HARVEST_MAX + 8 ]; /* request from a -L target  */
+static u32 N_req_len = 0; /* bytes kept in N_req_buf          */
+static u8 N_req_seen [ NET_RESP_MAP_SIZE >> 3 ]; /* requests harvested     */
+static struct iovec N_iov [ 2 ]; /* test case, as left by write_*() */
+static u32 N_iov_cnt = 0; /* pieces in N_iov (2 when trimming) */
+static u64 N_try_us , /* delivery attempt that worked    */
+N_conn_us , /* connection up, sending started  */
+N_sent_us; /* test case out (0 = not sent)    */
+static u64 N_lat_runs = 0 , /* -N runs in the breakdown below   */
+N_lat_tmouts = 0 , /* ...of which timed out            */
+N_lat_fsrv = 0 , /* us getting a child to run        */
+N_lat_wait = 0 , /* ...waiting for it to get ready   */
+N_lat_connect = 0 , /* ...connecting or accepting       */
+N_lat_send = 0 , /* ...sending the test case         */
+N_lat_target = 0 , /* ...until the target was done     */
+N_lat_tmout = 0; /* ...in runs that timed out        */
 
 struct queue_entry
 {
@@ -245,12 +328,14 @@ struct queue_entry
 	was_fuzzed , /* Had any fuzzing done yet?        */
 	passed_det , /* Deterministic stages passed?     */
 	has_new_cov , /* Triggers new coverage?           */ //表示该测试用例变异后生成新的元组关系
+			resp_state , /* Reached a new response state?   */
 			var_behavior , /* Variable behavior?               */
 			favored , /* Currently favored?               */ //判断当前测试用例的受欢迎程度
 			fs_redundant; /* Marked as redundant in the fs?   */
 
 	u32 bitmap_size , /* Number of bits set in bitmap     */ //表示有多少元组跳跃关系
-			exec_cksum; /* Checksum of the execution trace  */
+			exec_cksum , /* Checksum of the execution trace  */
+			cksum_vars; /* var_byte_count for exec_cksum    */
 
 	u64 exec_us , /* Execution time (us)              */  //每一个测试的平均时间
 			handicap , /* Number of queue cycles behind    */
@@ -824,6 +909,212 @@ static void read_bitmap(u8* fname)
 
 }
 
+#ifdef HAVE_SIMD_MAP
+
+/* Vector versions of has_new_bits(), simplify_trace() and classify_counts()
+ below, 32 or 64 map bytes at a time. They give the same results as the
+ scalar code; all-zero chunks are skipped just the same.
+
+ For classify_counts(), count_class_lookup[] is split on the two nibbles:
+ any count with the high nibble set maps to 32 or more, and the low nibble
+ alone to 16 or less, so the larger of the two lookups is the answer. */
+
+#define CLASS_LO 0, 1, 2, 4, 8, 8, 8, 8, 16, 16, 16, 16, 16, 16, 16, 16
+#define CLASS_HI 0, 32, 64, 64, 64, 64, 64, 64, \
+	128, 128, 128, 128, 128, 128, 128, 128
+
+__attribute__((target("avx2")))
+static u8 has_new_bits_avx2(u8* virgin_map)
+{
+
+	__m256i ff = _mm256_set1_epi8(-1) , zero = _mm256_setzero_si256();
+	u32 i;
+	u8 ret = 0;
+
+	for (i = 0; i < MAP_SIZE; i += 32)
+	{
+
+		__m256i cur = _mm256_loadu_si256((__m256i *) (trace_bits + i));
+		__m256i vir = _mm256_loadu_si256((__m256i *) (virgin_map + i));
+
+		if (_mm256_testz_si256(cur,vir))
+			continue;
+
+		if (ret < 2)
+		{
+
+			/* Any byte hit for the first time, i.e., where virgin is 0xff? */
+
+			__m256i fresh = _mm256_andnot_si256(_mm256_cmpeq_epi8(cur,zero),
+					_mm256_cmpeq_epi8(vir,ff));
+
+			ret = _mm256_testz_si256(fresh,fresh) ? 1 : 2;
+
+		}
+
+		_mm256_storeu_si256((__m256i *) (virgin_map + i),
+				_mm256_andnot_si256(cur,vir));
+
+	}
+
+	return ret;
+
+}
+
+__attribute__((target("avx2")))
+static void simplify_trace_avx2(u8* mem)
+{
+
+	__m256i one = _mm256_set1_epi8(1) , hit = _mm256_set1_epi8(0x80) ,
+			zero = _mm256_setzero_si256();
+	u32 i;
+
+	for (i = 0; i < MAP_SIZE; i += 32)
+	{
+
+		__m256i v = _mm256_loadu_si256((__m256i *) (mem + i));
+
+		_mm256_storeu_si256((__m256i *) (mem + i),
+				_mm256_blendv_epi8(hit,one,_mm256_cmpeq_epi8(v,zero)));
+
+	}
+
+}
+
+__attribute__((target("avx2")))
+static void classify_counts_avx2(u8* mem)
+{
+
+	__m256i lut_lo = _mm256_setr_epi8(CLASS_LO,CLASS_LO) ,
+			lut_hi = _mm256_setr_epi8(CLASS_HI,CLASS_HI) ,
+			nib = _mm256_set1_epi8(0x0f);
+	u32 i;
+
+	for (i = 0; i < MAP_SIZE; i += 32)
+	{
+
+		__m256i v = _mm256_loadu_si256((__m256i *) (mem + i));
+
+		/* Optimize for sparse bitmaps. */
+
+		if (_mm256_testz_si256(v,v))
+			continue;
+
+		v = _mm256_max_epu8(
+				_mm256_shuffle_epi8(lut_lo,_mm256_and_si256(v,nib)),
+				_mm256_shuffle_epi8(lut_hi,
+						_mm256_and_si256(_mm256_srli_epi16(v,4),nib)));
+
+		_mm256_storeu_si256((__m256i *) (mem + i),v);
+
+	}
+
+}
+
+__attribute__((target("avx512bw")))
+static u8 has_new_bits_avx512(u8* virgin_map)
+{
+
+	__m512i ff = _mm512_set1_epi8(-1);
+	u32 i;
+	u8 ret = 0;
+
+	for (i = 0; i < MAP_SIZE; i += 64)
+	{
+
+		__m512i cur = _mm512_loadu_si512(trace_bits + i);
+		__m512i vir = _mm512_loadu_si512(virgin_map + i);
+
+		if (!_mm512_test_epi64_mask(cur,vir))
+			continue;
+
+		if (ret < 2)
+			ret = (_mm512_test_epi8_mask(cur,cur)
+					& _mm512_cmpeq_epi8_mask(vir,ff)) ? 2 : 1;
+
+		_mm512_storeu_si512(virgin_map + i,_mm512_andnot_si512(cur,vir));
+
+	}
+
+	return ret;
+
+}
+
+__attribute__((target("avx512bw")))
+static void simplify_trace_avx512(u8* mem)
+{
+
+	__m512i one = _mm512_set1_epi8(1) , hit = _mm512_set1_epi8(0x80);
+	u32 i;
+
+	for (i = 0; i < MAP_SIZE; i += 64)
+	{
+
+		__m512i v = _mm512_loadu_si512(mem + i);
+
+		_mm512_storeu_si512(mem + i,
+				_mm512_mask_blend_epi8(_mm512_test_epi8_mask(v,v),one,hit));
+
+	}
+
+}
+
+__attribute__((target("avx512bw")))
+static void classify_counts_avx512(u8* mem)
+{
+
+	__m512i lut_lo = _mm512_broadcast_i32x4(_mm_setr_epi8(CLASS_LO)) ,
+			lut_hi = _mm512_broadcast_i32x4(_mm_setr_epi8(CLASS_HI)) ,
+			nib = _mm512_set1_epi8(0x0f);
+	u32 i;
+
+	for (i = 0; i < MAP_SIZE; i += 64)
+	{
+
+		__m512i v = _mm512_loadu_si512(mem + i);
+
+		/* Optimize for sparse bitmaps. */
+
+		if (!_mm512_test_epi64_mask(v,v))
+			continue;
+
+		v = _mm512_max_epu8(
+				_mm512_shuffle_epi8(lut_lo,_mm512_and_si512(v,nib)),
+				_mm512_shuffle_epi8(lut_hi,
+						_mm512_and_si512(_mm512_srli_epi16(v,4),nib)));
+
+		_mm512_storeu_si512(mem + i,v);
+
+	}
+
+}
+
+#endif /* HAVE_SIMD_MAP */
+
+/* Pick the widest bitmap scans the CPU can do, unless AFL_NO_SIMD is set. */
+
+static void setup_simd(void)
+{
+
+#ifdef HAVE_SIMD_MAP
+
+	if (getenv("AFL_NO_SIMD"))
+		return;
+
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512bw"))
+		simd_mode = 2;
+	else if (__builtin_cpu_supports("avx2"))
+		simd_mode = 1;
+
+	if (simd_mode)
+		OKF("Using %s for bitmap scans.",simd_mode == 2 ? "AVX-512" : "AVX2");
+
+#endif /* HAVE_SIMD_MAP */
+
+}
+
 /* Check if the current execution path brings anything new to the table.
  Update virgin bits to reflect the finds. Returns 1 if the only change is
  the hit-count for a particular tuple; 2 if there are new tuples seen.
@@ -856,6 +1147,23 @@ static inline u8 has_new_bits(u8* virgin_map)
 
 	u8 ret = 0;
 
+#ifdef HAVE_SIMD_MAP
+
+	if (simd_mode)
+	{
+
+		ret = simd_mode == 2 ?
+				has_new_bits_avx512(virgin_map) : has_new_bits_avx2(virgin_map);
+
+		if (ret && virgin_map == virgin_bits)
+			bitmap_changed = 1;
+
+		return ret;
+
+	}
+
+#endif /* HAVE_SIMD_MAP */
+
 	while (i--)
 	{
 
@@ -932,6 +1240,33 @@ static inline u8 has_new_bits(u8* virgin_map)
 
 }
 
+/* Checksum a trace with the first 'masked' entries of var_idx[] read as
+ zero. The list only ever grows, so a checksum taken with a given count
+ stays comparable to later traces hashed with the same count, however many
+ variable bytes have turned up since. */
+
+static u32 hash_trace(u8* mem, u32 masked)
+{
+
+	static u8 saved [ MAP_SIZE ];
+	u32 i , cksum;
+
+	for (i = 0; i < masked; i++)
+	{
+		saved [ i ] = mem [ var_idx [ i ] ];
+		mem [ var_idx [ i ] ] = 0;
+	}
+
+	cksum = hash32(mem,MAP_SIZE,HASH_CONST);
+
+	for (i = 0; i < masked; i++)
+		mem [ var_idx [ i ] ] = saved [ i ];
+
+	return cksum;
+
+}
+
+
 /* Count the number of bits set in the provided bitmap. Used for the status
  screen several times every second, does not have to be fast. */
 
@@ -1063,6 +1398,22 @@ static void simplify_trace(u64* mem)
 
 	u32 i = MAP_SIZE >> 3;
 
+#ifdef HAVE_SIMD_MAP
+
+	if (simd_mode)
+	{
+
+		if (simd_mode == 2)
+			simplify_trace_avx512((u8*)mem);
+		else
+			simplify_trace_avx2((u8*)mem);
+
+		return;
+
+	}
+
+#endif /* HAVE_SIMD_MAP */
+
 	while (i--)
 	{
 
@@ -1147,6 +1498,22 @@ static inline void classify_counts(u64* mem)
 
 	u32 i = MAP_SIZE >> 3;//每次操作8个字节,64位,共操作8192次,即65536个元组关系
 
+#ifdef HAVE_SIMD_MAP
+
+	if (simd_mode)
+	{
+
+		if (simd_mode == 2)
+			classify_counts_avx512((u8*)mem);
+		else
+			classify_counts_avx2((u8*)mem);
+
+		return;
+
+	}
+
+#endif /* HAVE_SIMD_MAP */
+
 	while (i--)
 	{
 
@@ -1215,6 +1582,8 @@ static void remove_shm(void)
 #ifdef XIAOSA
 	shmctl(shm_id_virgin_counts,IPC_RMID,NULL);
 #endif
+	if (shm_fuzz_id >= 0)
+		shmctl(shm_fuzz_id,IPC_RMID,NULL);
 
 }
 
@@ -1400,6 +1769,7 @@ static void setup_shm(void)
 
 	memset(virgin_hang,255,MAP_SIZE);  //所有都赋值1
 	memset(virgin_crash,255,MAP_SIZE);
+	memset(virgin_oom,255,MAP_SIZE);
 
 	shm_id = shmget(IPC_PRIVATE,MAP_SIZE,IPC_CREAT | IPC_EXCL | 0600); //IPC_PRIVATE也是一种方法,便于父子进程通信
 
@@ -1466,113 +1836,317 @@ static void setup_shm(void)
 
 }
 
-/* Load postprocessor, if available. */
+/* Set up the region used to hand test cases to the target through memory
+ rather than through out_file. Called after check_binary() and setup_desock(),
+ and only if the binary (or AFL_DESOCK in QEMU mode) asked for it; the fork
+ server confirms the mapping in its hello. */
 
-static void setup_post(void)
+static void setup_shm_fuzz(void)
 {
 
-	void* dh;
-	u8* fn = getenv("AFL_POST_LIBRARY");
-	u32 tlen = 6;
+	u8* shm_str;
 
-	if (!fn)
+	if (!shm_fuzz_mode)
 		return;
 
-	ACTF("Loading postprocessor from '%s'...",fn);
-
-	dh = dlopen(fn,RTLD_NOW);
-	if (!dh)
-		FATAL("%s",dlerror());
+	shm_fuzz_id = shmget(IPC_PRIVATE,SHM_FUZZ_MAP_SIZE,IPC_CREAT | IPC_EXCL | 0600);
 
-	post_handler = dlsym(dh,"afl_postprocess");
-	if (!post_handler)
-		FATAL("Symbol 'afl_postprocess' not found.");
+	if (shm_fuzz_id < 0)
+		PFATAL("shmget() failed");
 
-	/* Do a quick test. It's better to segfault now than later =) */
+	shm_str = alloc_printf("%d",shm_fuzz_id);
+	setenv(SHM_FUZZ_ENV_VAR,shm_str,1);
+	ck_free(shm_str);
 
-	post_handler("hello",&tlen);
+	shm_fuzz_buf = shmat(shm_fuzz_id,NULL,0);
 
-	OKF("Postprocessor installed successfully.");
+	if (shm_fuzz_buf == (void*) -1)
+		PFATAL("test case shmat() failed");
 
 }
 
-/* Read all testcases from the input directory, then queue them for testing.
- Called at startup. */
+/* Write a short value to a cgroup control file. Returns 0 on success. */
 
-static void read_testcases(void)
+static s32 write_cgroup_file(u8* dir, u8* name, u8* val)
 {
 
-	struct dirent **nl; //namelist
-	s32 nl_cnt;
-	u32 i;
-	u8* fn;
+	u8* fn = alloc_printf("%s/%s",dir,name);
+	s32 fd = open(fn,O_WRONLY), ret = -1;
 
-	/* Auto-detect non-in-place resumption attempts. */
+	ck_free(fn);
 
-	fn = alloc_printf("%s/queue",in_dir);
-	if (!access(fn,F_OK))
-		in_dir = fn; //F_OK判断是否存在
-	else
-		ck_free(fn);
+	if (fd < 0)
+		return -1;
 
-	ACTF("Scanning '%s'...",in_dir);
+	if (write(fd,val,strlen(val)) == strlen(val))
+		ret = 0;
 
-	/* We use scandir() + alphasort() rather than readdir() because otherwise,
-	 the ordering  of test cases would vary somewhat randomly and would be
-	 difficult to control. */
+	close(fd);
+	return ret;
 
-	nl_cnt = scandir(in_dir,&nl,NULL,alphasort); //扫描in_dir下满足过滤条件的,alphasort是一种排序函数
-	//这里还包括 . 和.. 两个目录
-	if (nl_cnt < 0)
-	{
+}
 
-		if (errno == ENOENT || errno == ENOTDIR)
+/* Remove the per-instance cgroup (atexit handler). The directory can only go
+ away once it's empty, so kill whatever is still lingering there first. */
 
-			SAYF(
-					"\n" cLRD "[-] " cRST "The input directory does not seem to be valid - try again. The fuzzer needs\n" "    one or more test case to start with - ideally, a small file under 1 kB\n" "    or so. The cases must be stored as regular files directly in the input\n" "    directory.\n");
+static void remove_cgroup(void)
+{
 
-		PFATAL("Unable to open '%s'",in_dir);
+	u32 i;
 
-	}
+	/* Children that exit() after a failed execv() end up here, too. */
 
-	for (i = 0; i < nl_cnt; i++)
+	if (getpid() != cgroup_owner)
+		return;
+
+	write_cgroup_file(cgroup_path,"cgroup.kill","1"); /* Ignore errors */
+
+	for (i = 0; i < 50; i++)
 	{
+		if (!rmdir(cgroup_path) || errno != EBUSY)
+			return;
+		usleep(10000);
+	}
 
-		struct stat st;
+}
 
-		u8* fn = alloc_printf("%s/%s",in_dir,nl [ i ]->d_name);
-		u8* dfn = alloc_printf("%s/.state/deterministic_done/%s",in_dir,
-				nl [ i ]->d_name);
+/* Read the oom_kill counter from memory.events of our cgroup. */
 
-		u8 passed_det = 0;
+static u64 read_cgroup_ooms(void)
+{
 
-		free(nl [ i ]); /* not tracked */
+	u8 buf [ 512 ], *off;
+	s32 len = pread(cgroup_events_fd,buf,sizeof(buf) - 1,0);
 
-		if (lstat(fn,&st) || access(fn,R_OK))
-			PFATAL("Unable to access '%s'",fn);
+	if (len <= 0)
+		return 0;
+	buf [ len ] = 0;
 
-		/* This also takes care of . and .. */
+	off = strstr(buf,"oom_kill ");
+	return off ? strtoull(off + 9,NULL,10) : 0;
 
-		if (!S_ISREG(st.st_mode) || !st.st_size || strstr(fn,"/README.txt"))
-		{
-			//.  和 .. 目录进入
-			ck_free(fn);
-			ck_free(dfn);
-			continue;
+}
 
-		}
+/* See if the child we just lost to SIGKILL was taken out by the cgroup OOM
+ killer rather than by us. */
 
-		if (st.st_size > MAX_FILE)
-			FATAL("Test case '%s' is too big (%s, limit is %s)",fn,
-					DMS(st.st_size),DMS(MAX_FILE));
+static u8 check_cgroup_oom(void)
+{
 
-		/* Check for metadata that indicates that deterministic fuzzing
-		 is complete for this entry. We don't want to repeat deterministic
-		 fuzzing when resuming aborted scans, because it would be pointless
-		 and probably very time-consuming. */
+	u64 ooms;
 
-		if (!access(dfn,F_OK))
-			passed_det = 1;
+	if (cgroup_events_fd < 0)
+		return 0;
+
+	ooms = read_cgroup_ooms();
+
+	if (ooms == cgroup_ooms)
+		return 0;
+
+	cgroup_ooms = ooms;
+	total_ooms++;
+	return 1;
+
+}
+
+/* Enforce -m through a cgroup v2 memory controller instead of setrlimit()
+ if AFL_CGROUP points to a delegated subtree. RLIMIT_AS counts virtual memory
+ and is unusable with ASAN / MSAN; memory.max caps what the target actually
+ touches. We create a subgroup per instance, and the fork server (or every
+ child, without it) moves itself there before execv(). */
+
+static void setup_cgroup(void)
+{
+
+	u8* parent = getenv("AFL_CGROUP");
+	u8* fn;
+	u8 tmp [ 32 ];
+	s32 pid, st;
+
+	if (!parent)
+		return;
+
+	cgroup_path = alloc_printf("%s/afl-fuzz-%u",parent,getpid());
+
+	if (mkdir(cgroup_path,0700) && errno != EEXIST)
+		PFATAL("Unable to create cgroup '%s'",cgroup_path);
+
+	cgroup_owner = getpid();
+	atexit(remove_cgroup);
+
+	fn = alloc_printf("%s/memory.max",cgroup_path);
+
+	if (access(fn,W_OK))
+	{
+
+		/* The memory controller may just not be enabled for the children of
+		 the delegated group yet. */
+
+		write_cgroup_file(parent,"cgroup.subtree_control","+memory"); /* Ignore errors */
+
+		if (access(fn,W_OK))
+			FATAL("No memory controller in '%s' - is it a delegated cgroup v2 subtree?",parent);
+
+	}
+
+	ck_free(fn);
+
+	if (mem_limit)
+		sprintf(tmp,"%llu",mem_limit << 20);
+	else
+		strcpy(tmp,"max");
+
+	if (write_cgroup_file(cgroup_path,"memory.max",tmp))
+		PFATAL("Unable to set memory.max in '%s'",cgroup_path);
+
+	/* Without this, the target would just get pushed out to swap instead of
+	 being killed. Not every kernel has swap accounting, though. */
+
+	if (write_cgroup_file(cgroup_path,"memory.swap.max","0") && errno != ENOENT)
+		PFATAL("Unable to set memory.swap.max in '%s'",cgroup_path);
+
+	fn = alloc_printf("%s/cgroup.procs",cgroup_path);
+	cgroup_procs_fd = open(fn,O_WRONLY | O_CLOEXEC);
+	if (cgroup_procs_fd < 0)
+		PFATAL("Unable to open '%s'",fn);
+	ck_free(fn);
+
+	fn = alloc_printf("%s/memory.events",cgroup_path);
+	cgroup_events_fd = open(fn,O_RDONLY | O_CLOEXEC);
+	if (cgroup_events_fd < 0)
+		PFATAL("Unable to open '%s'",fn);
+	ck_free(fn);
+
+	cgroup_ooms = read_cgroup_ooms();
+
+	/* Moving a process requires write access to cgroup.procs of the common
+	 ancestor, too; better find out now than from a silent child. */
+
+	pid = fork();
+
+	if (pid < 0)
+		PFATAL("fork() failed");
+
+	if (!pid)
+		_exit(write(cgroup_procs_fd,"0",1) != 1);
+
+	if (waitpid(pid,&st,0) <= 0)
+		PFATAL("waitpid() failed");
+
+	if (!WIFEXITED(st) || WEXITSTATUS(st))
+		FATAL("Unable to move processes into '%s' (check delegation)",cgroup_path);
+
+	OKF("Memory limit enforced through cgroup '%s'.",cgroup_path);
+
+}
+
+/* Load postprocessor, if available. */
+
+static void setup_post(void)
+{
+
+	void* dh;
+	u8* fn = getenv("AFL_POST_LIBRARY");
+	u32 tlen = 6;
+
+	if (!fn)
+		return;
+
+	ACTF("Loading postprocessor from '%s'...",fn);
+
+	dh = dlopen(fn,RTLD_NOW);
+	if (!dh)
+		FATAL("%s",dlerror());
+
+	post_handler = dlsym(dh,"afl_postprocess");
+	if (!post_handler)
+		FATAL("Symbol 'afl_postprocess' not found.");
+
+	/* Do a quick test. It's better to segfault now than later =) */
+
+	post_handler("hello",&tlen);
+
+	OKF("Postprocessor installed successfully.");
+
+}
+
+/* Read all testcases from the input directory, then queue them for testing.
+ Called at startup. */
+
+static void read_testcases(void)
+{
+
+	struct dirent **nl; //namelist
+	s32 nl_cnt;
+	u32 i;
+	u8* fn;
+
+	/* Auto-detect non-in-place resumption attempts. */
+
+	fn = alloc_printf("%s/queue",in_dir);
+	if (!access(fn,F_OK))
+		in_dir = fn; //F_OK判断是否存在
+	else
+		ck_free(fn);
+
+	ACTF("Scanning '%s'...",in_dir);
+
+	/* We use scandir() + alphasort() rather than readdir() because otherwise,
+	 the ordering  of test cases would vary somewhat randomly and would be
+	 difficult to control. */
+
+	nl_cnt = scandir(in_dir,&nl,NULL,alphasort); //扫描in_dir下满足过滤条件的,alphasort是一种排序函数
+	//这里还包括 . 和.. 两个目录
+	if (nl_cnt < 0)
+	{
+
+		if (errno == ENOENT || errno == ENOTDIR)
+
+			SAYF(
+					"\n" cLRD "[-] " cRST "The input directory does not seem to be valid - try again. The fuzzer needs\n" "    one or more test case to start with - ideally, a small file under 1 kB\n" "    or so. The cases must be stored as regular files directly in the input\n" "    directory.\n");
+
+		PFATAL("Unable to open '%s'",in_dir);
+
+	}
+
+	for (i = 0; i < nl_cnt; i++)
+	{
+
+		struct stat st;
+
+		u8* fn = alloc_printf("%s/%s",in_dir,nl [ i ]->d_name);
+		u8* dfn = alloc_printf("%s/.state/deterministic_done/%s",in_dir,
+				nl [ i ]->d_name);
+
+		u8 passed_det = 0;
+
+		free(nl [ i ]); /* not tracked */
+
+		if (lstat(fn,&st) || access(fn,R_OK))
+			PFATAL("Unable to access '%s'",fn);
+
+		/* This also takes care of . and .. */
+
+		if (!S_ISREG(st.st_mode) || !st.st_size || strstr(fn,"/README.txt"))
+		{
+			//.  和 .. 目录进入
+			ck_free(fn);
+			ck_free(dfn);
+			continue;
+
+		}
+
+		if (st.st_size > MAX_FILE)
+			FATAL("Test case '%s' is too big (%s, limit is %s)",fn,
+					DMS(st.st_size),DMS(MAX_FILE));
+
+		/* Check for metadata that indicates that deterministic fuzzing
+		 is complete for this entry. We don't want to repeat deterministic
+		 fuzzing when resuming aborted scans, because it would be pointless
+		 and probably very time-consuming. */
+
+		if (!access(dfn,F_OK))
+			passed_det = 1;
 		ck_free(dfn);
 		//前面的操作都是虚的,目前没有作用
 		add_to_queue(fn,st.st_size,passed_det);  //这个函数读取测试用例
@@ -2133,6 +2707,93 @@ static void destroy_extras(void)
  * 
  *  */
 
+/* Parse a unix:// (stream) or unixgram:// (datagram) -N URL. The rest of
+ the URL is a file system path, or, with a leading '@', a name in the
+ abstract namespace. The address is handed to the rest of the code as a
+ single addrinfo, just as getaddrinfo() would. Returns 0 if spec is not a
+ unix socket URL at all. */
+
+static u8 parse_unix_url(u8* spec)
+{
+
+	u8* path;
+	u32 len;
+
+	if (!strncasecmp((char*) spec,"unix://",7))
+	{
+		N_unix_ai.ai_socktype = SOCK_STREAM;
+		path = spec + 7;
+	}
+	else if (!strncasecmp((char*) spec,"unixgram://",11))
+	{
+		N_unix_ai.ai_socktype = SOCK_DGRAM;
+		path = spec + 11;
+	}
+	else
+		return 0;
+
+	len = strlen((char*) path);
+
+	if (!len || (path [ 0 ] == '@' && len == 1))
+		FATAL("-N: no socket path specified");
+
+	if (len >= sizeof(N_unix_addr.sun_path))
+		FATAL("-N: socket path too long");
+
+	N_unix_addr.sun_family = AF_UNIX;
+	memcpy(N_unix_addr.sun_path,path,len);
+
+	/* Abstract names start with a NUL and are not NUL-terminated. */
+
+	if (path [ 0 ] == '@')
+		N_unix_addr.sun_path [ 0 ] = 0;
+	else
+		len++;
+
+	N_unix_ai.ai_family = AF_UNIX;
+	N_unix_ai.ai_addr = (struct sockaddr *) &N_unix_addr;
+	N_unix_ai.ai_addrlen = offsetof(struct sockaddr_un, sun_path) + len;
+
+	N_results = &N_unix_ai;
+
+	return 1;
+
+}
+
+/* Remove the socket file bound for -L on exit. */
+
+static void remove_unix_sock(void)
+{
+
+	if (N_unix_owner == getpid())
+		unlink(N_unix_addr.sun_path);
+
+}
+
+/* Bind N_fd to a unix:// path for -L, replacing a socket file left over
+ from an earlier session (but nothing else). */
+
+static s32 bind_unix_sock(void)
+{
+
+	struct stat st;
+
+	if (!N_unix_addr.sun_path [ 0 ])
+		return bind(N_fd,N_rp->ai_addr,N_rp->ai_addrlen);
+
+	if (!lstat(N_unix_addr.sun_path,&st) && S_ISSOCK(st.st_mode))
+		unlink(N_unix_addr.sun_path);
+
+	if (bind(N_fd,N_rp->ai_addr,N_rp->ai_addrlen))
+		return -1;
+
+	N_unix_owner = getpid();
+	atexit(remove_unix_sock);
+
+	return 0;
+
+}
+
 void network_setup_listener(void)
 {
 	/* exit if getaddrinfo() did not return address information structures
@@ -2169,14 +2830,16 @@ void network_setup_listener(void)
 						continue;
 					}
 					/* set the socket option to reuse both the address and port */
-					if (setsockopt(N_fd,SOL_SOCKET,SO_REUSEADDR | SO_REUSEPORT,
-							&optval,sizeof(optval)) == -1)
+					if (N_rp->ai_family != AF_UNIX
+							&& setsockopt(N_fd,SOL_SOCKET,SO_REUSEADDR | SO_REUSEPORT,
+									&optval,sizeof(optval)) == -1)
 					{
 						close(N_fd);
 						PFATAL("failed to set socket option (TCP case)");
 					}
 					/* if bind() succeeds, we have found an address that works */
-					if (bind(N_fd,N_rp->ai_addr,N_rp->ai_addrlen) != -1)
+					if ((N_rp->ai_family == AF_UNIX ? bind_unix_sock() :
+							bind(N_fd,N_rp->ai_addr,N_rp->ai_addrlen)) != -1)
 					{
 						break;
 					}
@@ -2229,14 +2892,16 @@ void network_setup_listener(void)
 						continue;
 					}
 					/* set the socket option to reuse both the address and port */
-					if (setsockopt(N_fd,SOL_SOCKET,SO_REUSEADDR | SO_REUSEPORT,
-							&optval,sizeof(optval)) == -1)
+					if (N_rp->ai_family != AF_UNIX
+							&& setsockopt(N_fd,SOL_SOCKET,SO_REUSEADDR | SO_REUSEPORT,
+									&optval,sizeof(optval)) == -1)
 					{
 						close(N_fd);
 						PFATAL("failed to set socket option (TCP case)");
 					}
 					/* if bind() succeeds, we have found an address that works */
-					if (bind(N_fd,N_rp->ai_addr,N_rp->ai_addrlen) != -1)
+					if ((N_rp->ai_family == AF_UNIX ? bind_unix_sock() :
+							bind(N_fd,N_rp->ai_addr,N_rp->ai_addrlen)) != -1)
 					{
 						break;
 					}
@@ -2261,67 +2926,558 @@ void network_setup_listener(void)
 	}
 }
 
-int network_listen(void)
+/* Split a session input (AFL_NET_SESSION) at NET_MSG_SEP. Fills in the
+ start and end offsets of up to NET_MAX_MSGS messages, not counting the
+ separators, and returns how many there are. If there are more, the last
+ one just takes up the rest of the buffer.
+
+ Framed sessions are a sequence of records instead, each a 16-bit, big
+ endian length, followed by that many bytes of message. A length running
+ past the end of the buffer is cut short, and a stray byte at the end is
+ a message of its own. Either way, the records are back to back, so
+ record i spans from end [ i - 1 ] (or 0) to end [ i ]. */
+
+static u32 split_session(u8* buf, u32 len, u32* beg, u32* end)
 {
-	/* This function receives data from the target process, and then sends
-	 * fuzzed data back to it.  There are two cases:
-	 *
-	 * (1) TCP (streams): a connection attempt from the target process is
-	 *     solicited.  When the connection has been established, all available
-	 *     data are read using non-blocking I/O, and then fuzzed data are
-	 *     written.
-	 *
-	 * (2) UDP (datagrams/packets): all available packets are read using
-	 *     non-blocking I/O, and then fuzzed data are written.
-	 *
-	 * In both cases, all data read are discarded.  Note that for UDP reads
-	 * any data in excess of the size of the read buffer are discarded by the
-	 * network stack.
-	 *
-	 * Note that non-blocking reads are attempted, and if they fail then the
-	 * calling process is expected to wait for a programmed interval of time
-	 * (specified by the -D command line argument) and retry the call to
-	 * network_listen(), for a programmed number of times (not user-selectable).
-	 *
-	 * Note that unlike the case where this code plays the role of a client to
-	 * the target process (using network_send()), we typically have no control
-	 * over the target's reuse (or not) of ephemeral port numbers.  Therefore,
-	 * we are at the mercy of the network stack's ability to scavenge available
-	 * port numbers.  A recent Linux kernel appears to do this quite well;
-	 * other operating systems may not.
-	 *
-	 * Local variables:
-	 */
-	u32 MAXRECVBUFSIZE = 512;
-	u8 recvbuf [ MAXRECVBUFSIZE ];
-	s32 currreadlen , client_fd , fd , o;
-	/* network_setup_listener() must be called first, and must succeed */
-	if (!N_myaddr_valid)
-		FATAL("error: network_listen() called before network_setup_listener()");
 
-	/* Two cases: SOCK_STREAM (for TCP) and SOCK_DGRAM (for UDP) */
-	if (N_rp->ai_socktype == SOCK_STREAM)
+	u32 cnt = 0 , pos = 0;
+	u8* sep;
+
+	if (N_session == 2)
 	{
-		/* TCP (stream) and connections are used. */
-		/* accept a connection if the client is ready, but don't block */
-		client_fd = accept4(N_fd,(struct sockaddr *) &N_myaddr,&N_myaddrlen,
-				SOCK_CLOEXEC | SOCK_NONBLOCK);
-		if (client_fd == -1)
+
+		while (cnt < NET_MAX_MSGS - 1 && len - pos >= 2)
 		{
-			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
-			{
-				return -1; /* return to calling program, which will delay before retrying */
-			}
-			else
-			{ /* a serous error occurred */
-				PFATAL(
-						"accept4() returned error other than EAGAIN or EWOULDBLOCK");
-			}
+
+			beg [ cnt ] = pos + 2;
+			end [ cnt ] = MIN(len,beg [ cnt ] + (buf [ pos ] << 8 | buf [ pos + 1 ]));
+			pos = end [ cnt++ ];
+
 		}
-		/* read whatever the client sends and throw it away, resetting
-		 * non-blocking mode first (because some UNIXs propagate it to
-		 * the returned client_fd) */
-		o = fcntl(client_fd,F_GETFL);
+
+		if (pos == len && cnt)
+			return cnt;
+
+		beg [ cnt ] = pos;
+		end [ cnt ] = len;
+
+		return cnt + 1;
+
+	}
+
+	while (cnt < NET_MAX_MSGS - 1
+			&& (sep = memmem(buf + pos,len - pos,NET_MSG_SEP,NET_MSG_SEP_LEN)))
+	{
+
+		beg [ cnt ] = pos;
+		end [ cnt ] = sep - buf;
+		pos = end [ cnt++ ] + NET_MSG_SEP_LEN;
+
+	}
+
+	beg [ cnt ] = pos;
+	end [ cnt ] = len;
+
+	return cnt + 1;
+
+}
+
+/* Parse AFL_NET_RESP_MASK: a comma-separated list of byte offsets or
+ inclusive ranges (e.g. "4-11,20") to ignore in replies, and/or "digits". */
+
+static void parse_resp_masks(u8* spec)
+{
+
+	u8 *tok , *copy = ck_strdup(spec) , *rest = copy;
+	u32 beg , end;
+	s32 res;
+
+	while ((tok = strsep((char**) &rest,",")))
+	{
+
+		if (!*tok)
+			continue;
+
+		if (!strcmp(tok,"digits"))
+		{
+			N_resp_digits = 1;
+			continue;
+		}
+
+		if (N_mask_cnt == NET_RESP_MAX_MASKS)
+			FATAL("Too many ranges in AFL_NET_RESP_MASK (max %u)",
+					NET_RESP_MAX_MASKS);
+
+		res = sscanf(tok,"%u-%u",&beg,&end);
+
+		if (res == 1)
+			end = beg;
+
+		if (res < 1 || end < beg)
+			FATAL("Bad range '%s' in AFL_NET_RESP_MASK",tok);
+
+		N_mask_beg [ N_mask_cnt ] = beg;
+		N_mask_end [ N_mask_cnt++ ] = end;
+
+	}
+
+	ck_free(copy);
+
+}
+
+/* Keep what a network target sends back (AFL_NET_RESPONSES), up to
+ NET_RESP_MAX bytes per run. */
+
+static void capture_reply(u8* data, s32 len)
+{
+
+	if (!N_resp_on || len <= 0)
+		return;
+
+	len = MIN(len,NET_RESP_MAX - N_resp_len);
+
+	memcpy(N_resp_buf + N_resp_len,data,len);
+	N_resp_len += len;
+
+}
+
+/* Pick up whatever replies are still queued on the connection once the
+ target is done, and hash them. Masked ranges are zeroed and, if asked,
+ runs of digits are squeezed into a single '0', so that timestamps, nonces
+ and counters don't make every run look like a new response. */
+
+static void hash_replies(void)
+{
+
+	u8 buf [ 512 ];
+	u32 i , j;
+	s32 len;
+
+	while (N_conn_fd >= 0
+			&& (len = recv(N_conn_fd,buf,sizeof(buf),MSG_DONTWAIT)) > 0)
+		capture_reply(buf,len);
+
+	for (i = 0; i < N_mask_cnt; i++)
+		for (j = N_mask_beg [ i ]; j <= N_mask_end [ i ] && j < N_resp_len; j++)
+			N_resp_buf [ j ] = 0;
+
+	if (N_resp_digits)
+	{
+
+		u8 in_num = 0;
+
+		for (i = j = 0; i < N_resp_len; i++)
+		{
+
+			if (!isdigit(N_resp_buf [ i ]))
+			{
+				N_resp_buf [ j++ ] = N_resp_buf [ i ];
+				in_num = 0;
+			}
+			else if (!in_num)
+			{
+				N_resp_buf [ j++ ] = '0';
+				in_num = 1;
+			}
+
+		}
+
+		N_resp_len = j;
+
+	}
+
+	/* hash32() works in 8-byte words. */
+
+	memset(N_resp_buf + N_resp_len,0,8);
+
+	N_resp_hash = hash32(N_resp_buf,(N_resp_len + 7) & ~7,HASH_CONST + N_resp_len);
+
+}
+
+/* Check if the response to the last run is one we haven't seen before, and
+ remember it if so. Like the coverage map, this is a bitmap indexed by
+ hash, so the odd collision just makes us miss a state. */
+
+static u8 has_new_response(void)
+{
+
+	u32 idx = N_resp_hash & (NET_RESP_MAP_SIZE - 1);
+
+	if (!N_resp_on || (N_resp_seen [ idx >> 3 ] & (1 << (idx & 7))))
+		return 0;
+
+	N_resp_seen [ idx >> 3 ] |= 1 << (idx & 7);
+	N_resp_states++;
+
+	return 1;
+
+}
+
+/* Undo has_new_response() for a reply that turned out not to be stable. */
+
+static void forget_response(u32 hash)
+{
+
+	u32 idx = hash & (NET_RESP_MAP_SIZE - 1);
+
+	N_resp_seen [ idx >> 3 ] &= ~(1 << (idx & 7));
+	N_resp_states--;
+
+}
+
+/* Send the current test case as a session: message by message, over one
+ connection (sock, with to == NULL) or as one datagram each. Before every
+ message but the first, wait up to N_reply_ms for the target to answer the
+ previous one, and then N_pace_ms more, if either is set. Replies are
+ discarded, unless AFL_NET_RESPONSES wants them. A target that hangs up
+ halfway just doesn't get the rest. Datagrams that don't need to wait for
+ anything go out in one sendmmsg(). */
+
+static void send_session(s32 sock, struct sockaddr* to, socklen_t tolen)
+{
+
+	static u32 beg [ NET_MAX_MSGS ] , end [ NET_MAX_MSGS ];
+	struct pollfd pfd;
+	u8 *buf = N_iov [ 0 ].iov_base , junk [ 512 ];
+	u32 len = N_iov [ 0 ].iov_len , cnt , i , off;
+	s32 res;
+
+	N_conn_us = get_cur_time_us();
+
+	/* Trimming leaves the test case in two pieces; splitting wants one. */
+
+	if (N_iov_cnt > 1)
+	{
+
+		len += N_iov [ 1 ].iov_len;
+		buf = ck_alloc_nozero(len);
+
+		memcpy(buf,N_iov [ 0 ].iov_base,N_iov [ 0 ].iov_len);
+		memcpy(buf + N_iov [ 0 ].iov_len,N_iov [ 1 ].iov_base,
+				N_iov [ 1 ].iov_len);
+
+	}
+
+	cnt = split_session(buf,len,beg,end);
+
+	if (to && !N_reply_ms && !N_pace_ms)
+	{
+
+		static struct mmsghdr msgs [ NET_MAX_MSGS ];
+		static struct iovec iovs [ NET_MAX_MSGS ];
+		u32 n = 0;
+
+		for (i = 0; i < cnt; i++)
+		{
+
+			if (beg [ i ] == end [ i ])
+				continue;
+
+			iovs [ n ].iov_base = buf + beg [ i ];
+			iovs [ n ].iov_len = end [ i ] - beg [ i ];
+
+			memset(&msgs [ n ],0,sizeof(struct mmsghdr));
+			msgs [ n ].msg_hdr.msg_name = to;
+			msgs [ n ].msg_hdr.msg_namelen = tolen;
+			msgs [ n ].msg_hdr.msg_iov = &iovs [ n ];
+			msgs [ n ].msg_hdr.msg_iovlen = 1;
+			n++;
+
+		}
+
+		/* The kernel may stop short of the whole batch; carry on from there. */
+
+		for (i = 0; i < n; i += res)
+		{
+
+			res = sendmmsg(sock,msgs + i,n - i,MSG_NOSIGNAL);
+
+			if (res < 0 && errno == EINTR)
+				res = 0;
+			else if (res <= 0)
+				PFATAL("partial or failed UDP write");
+
+		}
+
+		if (N_iov_cnt > 1)
+			ck_free(buf);
+
+		return;
+
+	}
+
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+
+	for (i = 0; i < cnt; i++)
+	{
+
+		if (beg [ i ] == end [ i ])
+			continue;
+
+		if (i && N_reply_ms && poll(&pfd,1,N_reply_ms) > 0)
+			while ((res = recv(sock,junk,sizeof(junk),MSG_DONTWAIT)) > 0)
+				capture_reply(junk,res);
+
+		if (i && N_pace_ms)
+			poll(NULL,0,N_pace_ms);
+
+		if (to)
+		{
+
+			if (sendto(sock,buf + beg [ i ],end [ i ] - beg [ i ],MSG_NOSIGNAL,
+					to,tolen) < 0)
+				PFATAL("partial or failed UDP write");
+
+			continue;
+
+		}
+
+		for (off = beg [ i ]; off < end [ i ]; off += res)
+		{
+
+			res = send(sock,buf + off,end [ i ] - off,MSG_NOSIGNAL);
+
+			if (res < 0 && errno == EINTR)
+				res = 0;
+			else if (res < 0)
+				break;
+
+		}
+
+		if (off < end [ i ])
+			break;
+
+	}
+
+	if (N_iov_cnt > 1)
+		ck_free(buf);
+
+}
+
+/* Send the test case to the target straight from memory, as one datagram
+ (to != NULL) or down a connected socket. A target that hangs up early is
+ not an error here; run_target() will see what became of it. */
+
+static void send_testcase(s32 sock, struct sockaddr* to, socklen_t tolen)
+{
+
+	struct iovec iov [ 2 ];
+	struct msghdr msg;
+	s32 res;
+
+	N_conn_us = get_cur_time_us();
+
+	memcpy(iov,N_iov,sizeof(iov));
+	memset(&msg,0,sizeof(msg));
+
+	msg.msg_name = to;
+	msg.msg_namelen = tolen;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = N_iov_cnt;
+
+	if (to)
+	{
+
+		/* This assumes that the test case fits in one datagram. If it does
+		 not (giant packet), the user may be doing something wrong. */
+
+		if (sendmsg(sock,&msg,MSG_NOSIGNAL) < 0)
+			PFATAL("partial or failed UDP write");
+
+		return;
+
+	}
+
+	while (msg.msg_iovlen)
+	{
+
+		res = sendmsg(sock,&msg,MSG_NOSIGNAL);
+
+		if (res < 0)
+		{
+
+			if (errno == EINTR)
+				continue;
+			if (errno == EPIPE || errno == ECONNRESET)
+				return;
+
+			PFATAL("write to network socket failed (TCP)");
+
+		}
+
+		/* Partial write: skip what went out and try again. */
+
+		while (msg.msg_iovlen && res >= msg.msg_iov [ 0 ].iov_len)
+		{
+			res -= msg.msg_iov [ 0 ].iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+
+		if (msg.msg_iovlen)
+		{
+			msg.msg_iov [ 0 ].iov_base += res;
+			msg.msg_iov [ 0 ].iov_len -= res;
+		}
+
+	}
+
+}
+
+/* Set up a fresh TCP connection to the target: no Nagle delay, so that
+ every write goes out at once (session messages in particular), and no
+ lingering on close, so that connections reset by run_target() leave no
+ TIME_WAIT entries behind to run out of ports with. Unix sockets have
+ neither problem. */
+
+static void setup_net_conn(s32 sock)
+{
+
+	struct linger lin =
+	{ 1, 0 };
+	s32 one = 1;
+
+	if (N_rp->ai_family == AF_UNIX)
+		return;
+
+	setsockopt(sock,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+	setsockopt(sock,SOL_SOCKET,SO_LINGER,&lin,sizeof(lin)); /* Ignore errors */
+
+}
+
+/* Collect the request a -L target sends before it gets its input. */
+
+static void add_request_bytes(u8* data, u32 len)
+{
+
+	len = MIN(len,NET_HARVEST_MAX - N_req_len);
+
+	memcpy(N_req_buf + N_req_len,data,len);
+	N_req_len += len;
+
+}
+
+/* Mine a -L target's request for dictionary tokens: every word (a run of
+ printable, non-blank characters) and every alphanumeric part of one,
+ within the auto extras size limits, and the first four bytes of binary
+ messages, which tend to be a magic value. They all go to maybe_add_auto(),
+ which takes care of the ranking. The same request tends to come in every
+ run, so each distinct one is only looked at once, and the tokens' hit
+ counts end up telling how many different requests they appeared in. */
+
+static void harvest_request(void)
+{
+
+	u8* buf = N_req_buf;
+	u32 len = N_req_len , binary = 0 , idx , i , j , k , e;
+
+	N_req_len = 0;
+
+	if (!len)
+		return;
+
+	memset(buf + len,0,8);
+
+	idx = hash32(buf,(len + 7) & ~7,HASH_CONST + len) & (NET_RESP_MAP_SIZE - 1);
+
+	if (N_req_seen [ idx >> 3 ] & (1 << (idx & 7)))
+		return;
+
+	N_req_seen [ idx >> 3 ] |= 1 << (idx & 7);
+
+	for (i = 0; i < len; i = j + 1)
+	{
+
+		for (j = i; j < len && isgraph(buf [ j ]); j++)
+			;
+
+		if (j < len && !isspace(buf [ j ]))
+			binary++;
+
+		if (j - i >= MIN_AUTO_EXTRA && j - i <= MAX_AUTO_EXTRA)
+			maybe_add_auto(buf + i,j - i);
+
+		for (k = i; k < j; k = e + 1)
+		{
+
+			for (e = k; e < j && (isalnum(buf [ e ]) || buf [ e ] == '_'); e++)
+				;
+
+			if (e - k >= MIN_AUTO_EXTRA && e - k <= MAX_AUTO_EXTRA
+					&& e - k != j - i)
+				maybe_add_auto(buf + k,e - k);
+
+		}
+
+	}
+
+	if (binary && len >= 4)
+		maybe_add_auto(buf,4);
+
+}
+
+int network_listen(void)
+{
+	/* This function receives data from the target process, and then sends
+	 * fuzzed data back to it.  There are two cases:
+	 *
+	 * (1) TCP (streams): a connection attempt from the target process is
+	 *     solicited.  When the connection has been established, all available
+	 *     data are read using non-blocking I/O, and then fuzzed data are
+	 *     written.
+	 *
+	 * (2) UDP (datagrams/packets): all available packets are read using
+	 *     non-blocking I/O, and then fuzzed data are written.
+	 *
+	 * In both cases, all data read are discarded.  Note that for UDP reads
+	 * any data in excess of the size of the read buffer are discarded by the
+	 * network stack.
+	 *
+	 * Note that non-blocking reads are attempted, and if they fail then the
+	 * calling process is expected to wait for a programmed interval of time
+	 * (specified by the -D command line argument) and retry the call to
+	 * network_listen(), for a programmed number of times (not user-selectable).
+	 *
+	 * Note that unlike the case where this code plays the role of a client to
+	 * the target process (using network_send()), we typically have no control
+	 * over the target's reuse (or not) of ephemeral port numbers.  Therefore,
+	 * we are at the mercy of the network stack's ability to scavenge available
+	 * port numbers.  A recent Linux kernel appears to do this quite well;
+	 * other operating systems may not.
+	 *
+	 * Local variables:
+	 */
+	u32 MAXRECVBUFSIZE = 512;
+	u8 recvbuf [ MAXRECVBUFSIZE ];
+	s32 currreadlen , client_fd , o;
+	/* network_setup_listener() must be called first, and must succeed */
+	if (!N_myaddr_valid)
+		FATAL("error: network_listen() called before network_setup_listener()");
+
+	/* Two cases: SOCK_STREAM (for TCP) and SOCK_DGRAM (for UDP) */
+	if (N_rp->ai_socktype == SOCK_STREAM)
+	{
+		/* TCP (stream) and connections are used. */
+		/* accept a connection if the client is ready, but don't block */
+		client_fd = accept4(N_fd,(struct sockaddr *) &N_myaddr,&N_myaddrlen,
+				SOCK_CLOEXEC | SOCK_NONBLOCK);
+		if (client_fd == -1)
+		{
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			{
+				return -1; /* return to calling program, which will delay before retrying */
+			}
+			else
+			{ /* a serous error occurred */
+				PFATAL(
+						"accept4() returned error other than EAGAIN or EWOULDBLOCK");
+			}
+		}
+		/* read whatever the client sends, keeping it only to look for
+		 * dictionary tokens, resetting non-blocking mode first (because
+		 * some UNIXs propagate it to the returned client_fd) */
+		o = fcntl(client_fd,F_GETFL);
 		if (o >= 0)
 		{
 			o = o & (~O_NONBLOCK);
@@ -2333,42 +3489,23 @@ int network_listen(void)
 		}
 		while ((currreadlen = recv(client_fd,recvbuf,MAXRECVBUFSIZE,
 				MSG_DONTWAIT)) > 0)
-			;
+			add_request_bytes(recvbuf,currreadlen);
+		harvest_request();
 		if ((currreadlen <= 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
 		{
-			PFATAL("read error");
-		}
-		/* duplicate the file descriptor used for the fuzzed data, and use the new
-		 * file descriptor to read that data and send it to the target process */
-		fd = dup(out_fd);
-		struct stat statbuf;
-		/* stat the file descriptor to obtain the size of the data to be sent */
-		if (fstat(fd,&statbuf) == -1)
-		{
-			PFATAL("failed to obtain stat for output file to target");
-		}
-		/* seek to the beginning of the file */
-		lseek(fd,0,SEEK_SET);
-		/* use sendfile() to transfer the data if possible because it is efficient */
-		if (sendfile(client_fd,fd,NULL,statbuf.st_size) == -1)
-		{
-			/* if sendfile() didn't work, use read() and write() via a buffer */
-			lseek(fd,0,SEEK_SET); /* reset to the beginning of the file */
-			u8 tempbuf [ 512 ];
-			u32 kread;
-			while ((kread = read(fd,tempbuf,512)) > 0)
-			{
-				if (write(client_fd,tempbuf,kread) != kread)
-				{
-					PFATAL("file copy to network socket failed (TCP)");
-				}
-			}
+			PFATAL("read error");
 		}
-		/* leave a clean campsite (as we found it) */
-		lseek(fd,0,SEEK_SET);
-		close(fd);
-		/* and close the file descriptor of the socket for the target */
-		close(client_fd);
+		setup_net_conn(client_fd);
+		/* send the fuzzed data from memory */
+		if (N_session)
+			send_session(client_fd,NULL,0);
+		else
+			send_testcase(client_fd,NULL,0);
+		/* and signal EOF to the target.  The connection itself is reset by
+		 * run_target() once the target is done (and -E may watch it until
+		 * then), so that no TIME_WAIT state is left behind */
+		shutdown(client_fd,SHUT_WR);
+		N_conn_fd = client_fd;
 
 	}
 	else if (N_rp->ai_socktype == SOCK_DGRAM)
@@ -2382,18 +3519,44 @@ int network_listen(void)
 		 *
 		 * Local variables:
 		 */
-		struct stat statbuf;
 		struct sockaddr_storage clientaddr;
 		u32 clientaddrlen = sizeof(struct sockaddr_storage);
-		/* read all available packets from the socket using non-blocking I/O */
+		/* read all available packets from the socket using non-blocking I/O,
+		 * NET_RECV_BATCH at a time.  Only the sender of the last one matters
+		 * for the reply; the contents are just searched for dictionary
+		 * tokens */
 		{
-			int received_one = 0;
-			while ((currreadlen = recvfrom(N_fd,recvbuf,MAXRECVBUFSIZE,
-					MSG_DONTWAIT,(struct sockaddr *) &clientaddr,&clientaddrlen))
-					> 0)
+			static struct mmsghdr msgs [ NET_RECV_BATCH ];
+			static struct sockaddr_storage addrs [ NET_RECV_BATCH ];
+			static struct iovec iovs [ NET_RECV_BATCH ];
+			static u8 bufs [ NET_RECV_BATCH ] [ 512 ];
+			int received_one = 0 , i;
+			for (i = 0; i < NET_RECV_BATCH; i++)
 			{
-				received_one = 1;
+				iovs [ i ].iov_base = bufs [ i ];
+				iovs [ i ].iov_len = sizeof(bufs [ i ]);
+				msgs [ i ].msg_hdr.msg_name = &addrs [ i ];
+				msgs [ i ].msg_hdr.msg_iov = &iovs [ i ];
+				msgs [ i ].msg_hdr.msg_iovlen = 1;
 			}
+			do
+			{
+				for (i = 0; i < NET_RECV_BATCH; i++)
+					msgs [ i ].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+				currreadlen = recvmmsg(N_fd,msgs,NET_RECV_BATCH,MSG_DONTWAIT,
+						NULL);
+				if (currreadlen > 0)
+				{
+					received_one = 1;
+					clientaddrlen = msgs [ currreadlen - 1 ].msg_hdr.msg_namelen;
+					memcpy(&clientaddr,&addrs [ currreadlen - 1 ],clientaddrlen);
+				}
+				for (i = 0; i < currreadlen; i++)
+				{
+					add_request_bytes(bufs [ i ],msgs [ i ].msg_len);
+					harvest_request();
+				}
+			} while (currreadlen == NET_RECV_BATCH);
 			/* at least one is necessary; otherwise, return & calling program may
 			 * wait and then try again */
 			if (!received_one)
@@ -2409,31 +3572,18 @@ int network_listen(void)
 				}
 			}
 		}
-		/* duplicate the file descriptor used for the fuzzed data, and use the new
-		 * file descriptor to read that data and send it to the target process */
-		fd = dup(out_fd);
-		/* stat the file descriptor to obtain the size of the data to be sent */
-		if (fstat(fd,&statbuf) == -1)
-			PFATAL("fstat()failed");
-		/* seek to the beginning of the file and create a temporary buffer to
-		 * hold all of the data in the file */
-		lseek(fd,0,SEEK_SET);
-		u8 tempbuf [ statbuf.st_size ];
-		/* read the entire file into the buffer */
-		if (read(fd,tempbuf,statbuf.st_size) != statbuf.st_size)
-			PFATAL(
-					"read of outfile's content failed to return expected # of bytes");
-		/* and send the buffer's content to the target process.  Note that this
-		 * code assumes that the entire buffer can be sent in a single packet.  If
-		 * it can not (giant packet), the user may be doing something wrong.  */
-		if (sendto(N_fd,tempbuf,statbuf.st_size,0,
-				(struct sockaddr *) &clientaddr,clientaddrlen) < 0)
-		{
-			PFATAL("partial or failed UDP write");
-		}
-		/* leave a clean campsite (as we found it) */
-		lseek(fd,0,SEEK_SET);
-		close(fd);
+		/* and send the fuzzed data back to whoever sent the last packet */
+		if (clientaddrlen <= sizeof(sa_family_t))
+			FATAL("the target's unix datagram socket is not bound, so there is "
+					"no way to reply to it");
+		if (N_session)
+			send_session(N_fd,(struct sockaddr *) &clientaddr,
+					clientaddrlen);
+		else
+			send_testcase(N_fd,(struct sockaddr *) &clientaddr,
+					clientaddrlen);
+		if (N_done_response || N_idle_ms || N_resp_on)
+			N_conn_fd = N_fd;
 	}
 	return 0;
 }
@@ -2495,8 +3645,9 @@ int network_send(void)
 						continue;
 					}
 					/* set the socket options to reuse both the address and port */
-					if (setsockopt(N_fd,SOL_SOCKET,SO_REUSEADDR | SO_REUSEPORT,
-							&optval,sizeof(optval)) == -1)
+					if (N_rp->ai_family != AF_UNIX
+							&& setsockopt(N_fd,SOL_SOCKET,SO_REUSEADDR | SO_REUSEPORT,
+									&optval,sizeof(optval)) == -1)
 					{
 						PFATAL("failed to set socket option (TCP case)");
 					}
@@ -2533,14 +3684,17 @@ int network_send(void)
 					PFATAL(
 							"Subsequent attempt to create socket failed (TCP case)");
 				}
-				if (setsockopt(N_fd,SOL_SOCKET,SO_REUSEADDR | SO_REUSEPORT,
-						&optval,sizeof(optval)) == -1)
+				if (N_rp->ai_family != AF_UNIX
+						&& setsockopt(N_fd,SOL_SOCKET,SO_REUSEADDR | SO_REUSEPORT,
+								&optval,sizeof(optval)) == -1)
 				{
 					PFATAL(
 							"Subsequent attempt to set socket option failed (TCP case)");
 				}
-				if (bind(N_fd,(struct sockaddr *) (&N_myaddr),N_myaddrlen)
-						== -1)
+				/* (unix sockets have no source port to reuse) */
+				if (N_rp->ai_family != AF_UNIX
+						&& bind(N_fd,(struct sockaddr *) (&N_myaddr),N_myaddrlen)
+								== -1)
 				{
 					PFATAL(
 							"Attempt to bind socket to source address & port failed (TCP case)");
@@ -2555,39 +3709,17 @@ int network_send(void)
 				}
 			}
 
-			{
-				/* duplicate the file descriptor used for the fuzzed data, and use
-				 * the new file descriptor to read that data and send it to the
-				 * target process */
-				s32 fd = dup(out_fd);
-				/* stat the file descriptor to obtain the size of the data to be sent */
-				struct stat statbuf;
-				if (fstat(fd,&statbuf) == -1)
-					PFATAL("fstat()failed");
-				/* seek to the beginning of the file */
-				lseek(fd,0,SEEK_SET);
-				/* use sendfile() to transfer the data if possible because it is efficient */
-				if (sendfile(N_fd,fd,NULL,statbuf.st_size) == -1)
-				{
-					/* if sendfile() didn't work, use read() and write() via a buffer */
-					lseek(fd,0,SEEK_SET); /* reset to the beginning of the file */
-					/* create a temporary buffer to hold all of the data in the file */
-					u8 tempbuf [ 512 ];
-					u32 kread;
-					while ((kread = read(fd,tempbuf,512)) > 0)
-					{
-						if (write(N_fd,tempbuf,kread) != kread)
-						{
-							PFATAL("file copy to network socket failed (TCP)");
-						}
-					}
-				}
-				/* leave a clean campsite (as we found it) */
-				lseek(fd,0,SEEK_SET);
-				close(fd);
-			}
-			/* and close the connection to the target process, signaling EOF */
-			close(N_fd);
+			setup_net_conn(N_fd);
+			/* send the fuzzed data from memory */
+			if (N_session)
+				send_session(N_fd,NULL,0);
+			else
+				send_testcase(N_fd,NULL,0);
+			/* and signal EOF to the target process.  The connection is reset
+			 * by run_target() once the target is done (-E may watch it until
+			 * then), so the source port is free again right away. */
+			shutdown(N_fd,SHUT_WR);
+			N_conn_fd = N_fd;
 
 		}
 		else if (N_results->ai_socktype == SOCK_DGRAM)
@@ -2610,13 +3742,23 @@ int network_send(void)
 				 * socket. */
 				for (N_rp = N_results; N_rp != NULL; N_rp = N_rp->ai_next)
 				{
+					socklen_t N_server_addrlen = sizeof(struct sockaddr_storage);
 					if (!((N_rp->ai_family == AF_INET)
-							|| (N_rp->ai_family == AF_INET6)))
+							|| (N_rp->ai_family == AF_INET6)
+							|| (N_rp->ai_family == AF_UNIX)))
 					{
 						continue;
 					}
 					/* create appropriate struct sockaddr according to ai_family */
-					if (N_rp->ai_family == AF_INET6)
+					if (N_rp->ai_family == AF_UNIX)
+					{
+						/* an address of just the family autobinds the socket to
+						 * a unique abstract name, so that replies can reach it */
+						memset(&N_server_addr,0,sizeof(struct sockaddr_storage));
+						N_server_addr.ss_family = AF_UNIX;
+						N_server_addrlen = sizeof(sa_family_t);
+					}
+					else if (N_rp->ai_family == AF_INET6)
 					{
 						memset(&N_server_addr,0,sizeof(struct sockaddr_in6));
 						N_server_addr.ss_family = AF_INET6;
@@ -2649,7 +3791,7 @@ int network_send(void)
 					}
 					/* bind to the address using an ephemeral port number */
 					if (bind(N_fd,(struct sockaddr *) &N_server_addr,
-							sizeof(struct sockaddr_storage)) < 0)
+							N_server_addrlen) < 0)
 					{
 						PFATAL("bind failed (UDP case)");
 					}
@@ -2669,67 +3811,511 @@ int network_send(void)
 					}
 					close(N_fd);
 				}
-				N_myaddr_valid = 1;
+				N_myaddr_valid = 1;
+			}
+			if (N_rp == NULL)
+			{
+				return -1; /* failed to connect on any address (UDP case) */
+			}
+			if (N_done_response || N_idle_ms || N_resp_on)
+			{
+				/* throw away replies left over from the previous run, so that
+				 * they don't count as a response to this one */
+				u8 junk [ 512 ];
+				while (recv(N_fd,junk,sizeof(junk),MSG_DONTWAIT) >= 0)
+					;
+				N_conn_fd = N_fd;
+			}
+			if (N_session)
+				send_session(N_fd,N_rp->ai_addr,N_rp->ai_addrlen);
+			else
+				send_testcase(N_fd,N_rp->ai_addr,N_rp->ai_addrlen);
+		}
+	}
+	else
+	{
+		/* this should never be executed */
+		FATAL(
+				"no address information structures match command line network spec");
+	}
+
+	return 0;
+}
+
+/* Check /proc/net/udp{,6} for a socket bound to the port of a UDP target.
+ Unlike connect() for TCP, sendto() succeeds whether anybody is listening
+ or not, so this is the only way to tell that the target is ready. If the
+ tables can't be read at all, assume it is. unixgram:// targets are easier:
+ their socket can be connected to once it is there. */
+
+static u8 udp_port_bound(void)
+{
+
+	static const char* tables [ ] =
+	{ "/proc/net/udp", "/proc/net/udp6" };
+
+	u8 line [ 512 ] , opened = 0;
+	u32 port , lport , i;
+	FILE* f;
+
+	/* A unix datagram socket can be connected to as soon as it is bound. */
+
+	if (N_results->ai_family == AF_UNIX)
+	{
+
+		s32 fd = socket(AF_UNIX,SOCK_DGRAM | SOCK_CLOEXEC,0) , res;
+
+		if (fd < 0)
+			PFATAL("socket() failed");
+
+		res = connect(fd,N_results->ai_addr,N_results->ai_addrlen);
+		close(fd);
+
+		return !res;
+
+	}
+
+	if (N_results->ai_family == AF_INET6)
+		port = ntohs(((struct sockaddr_in6 *) N_results->ai_addr)->sin6_port);
+	else
+		port = ntohs(((struct sockaddr_in *) N_results->ai_addr)->sin_port);
+
+	for (i = 0; i < 2; i++)
+	{
+
+		f = fopen(tables [ i ],"r");
+		if (!f)
+			continue;
+
+		opened = 1;
+
+		while (fgets((char*) line,sizeof(line),f))
+		{
+
+			if (sscanf((char*) line,"%*u: %*[0-9A-Fa-f]:%x",&lport) == 1
+					&& lport == port)
+			{
+				fclose(f);
+				return 1;
+			}
+
+		}
+
+		fclose(f);
+
+	}
+
+	return !opened;
+
+}
+
+/* Deliver the test case to a network target as soon as it is ready for it.
+ Instead of sleeping for a fixed -D delay and trying three times, wait for
+ NET_READY_FRAC percent of the startup latency learned so far, and then
+ keep probing at exponentially growing intervals until the data is out,
+ the child dies (watch_fd becomes readable), or exec_tmout runs out. For
+ -L, the listening socket itself tells us when the target shows up. */
+
+static void network_deliver(s32 watch_fd)
+{
+
+	struct pollfd pfd [ 2 ];
+	struct timespec ts;
+	u64 start , now , end , wait_us , probe_us = NET_PROBE_MIN_US;
+	s32 res;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	start = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+	end = start + exec_tmout * 1000ULL;
+
+	pfd [ 0 ].fd = watch_fd;
+	pfd [ 0 ].events = POLLIN;
+	pfd [ 1 ].fd = N_fuzz_client ? N_fd : -1;
+	pfd [ 1 ].events = POLLIN;
+
+	/* A server kept up by -R is ready right away. */
+
+	wait_us = (N_fuzz_client || N_srv_pid) ? 0 :
+			N_ready_us * NET_READY_FRAC / 100;
+
+	while (1)
+	{
+
+		if (wait_us)
+		{
+
+			ts.tv_sec = wait_us / 1000000;
+			ts.tv_nsec = (wait_us % 1000000) * 1000;
+
+			res = ppoll(pfd,2,&ts,NULL);
+
+			if (res < 0 && errno != EINTR)
+				PFATAL("ppoll() failed");
+
+			if (stop_soon || (res > 0 && pfd [ 0 ].revents))
+				return;
+
+		}
+
+		if (N_fuzz_client || N_results->ai_socktype == SOCK_STREAM
+				|| udp_port_bound())
+		{
+
+			N_try_us = get_cur_time_us();
+
+			if (!(N_fuzz_client ? network_listen() : network_send()))
+				break;
+
+		}
+
+		clock_gettime(CLOCK_MONOTONIC,&ts);
+		now = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+
+		if (now >= end)
+			return;
+
+		if (N_fuzz_client)
+			wait_us = end - now;
+		else
+		{
+			wait_us = MIN(probe_us,end - now);
+			probe_us = MIN(probe_us * 2,NET_PROBE_MAX_US);
+		}
+
+	}
+
+	N_sent_us = get_cur_time_us();
+
+	/* Moving average, so that the occasional slow start doesn't throw off
+	 the first probe for all runs that follow. */
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	now = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000 - start;
+
+	if (!N_srv_pid)
+		N_ready_us = N_ready_us ? (N_ready_us * 7 + now) / 8 : now;
+
+}
+
+/* Wait for fd to become readable, for up to timeout_ms (0 = no limit). The
+ deadline is taken from the monotonic clock and enforced with ppoll(), so we
+ don't need an interval timer and SIGALRM for every exec. Returns 1 if the fd
+ is readable (or if we are being told to stop), 0 on timeout. */
+
+static u8 wait_readable(s32 fd, u32 timeout_ms)
+{
+
+	struct pollfd pfd;
+	struct timespec now , end , left;
+	s32 res;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	clock_gettime(CLOCK_MONOTONIC,&end);
+
+	end.tv_sec += timeout_ms / 1000;
+	end.tv_nsec += (timeout_ms % 1000) * 1000000;
+
+	if (end.tv_nsec >= 1000000000)
+	{
+		end.tv_sec++;
+		end.tv_nsec -= 1000000000;
+	}
+
+	while (1)
+	{
+
+		if (timeout_ms)
+		{
+
+			clock_gettime(CLOCK_MONOTONIC,&now);
+
+			left.tv_sec = end.tv_sec - now.tv_sec;
+			left.tv_nsec = end.tv_nsec - now.tv_nsec;
+
+			if (left.tv_nsec < 0)
+			{
+				left.tv_sec--;
+				left.tv_nsec += 1000000000;
+			}
+
+			if (left.tv_sec < 0)
+				return 0;
+
+		}
+
+		res = ppoll(&pfd,1,timeout_ms ? &left : NULL,NULL);
+
+		if (res > 0)
+			return 1;
+		if (!res)
+			return 0;
+
+		if (errno != EINTR)
+			PFATAL("ppoll() failed");
+
+		/* Ctrl-C kills the child, so the subsequent read() won't block. */
+
+		if (stop_soon)
+			return 1;
+
+	}
+
+}
+
+/* Read the scheduler state and the total (user + system) CPU time, in clock
+ ticks, of a process from /proc. Returns 0 if that's not possible, e.g.
+ because the process is already gone. */
+
+static u8 read_proc_cpu(s32 pid, u8* state, u64* ticks)
+{
+
+	u8 tmp [ 512 ] , *p;
+	unsigned long ut , st;
+	s32 fd , len;
+
+	sprintf((char*) tmp,"/proc/%d/stat",pid);
+
+	fd = open((char*) tmp,O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	len = read(fd,tmp,sizeof(tmp) - 1);
+	close(fd);
+
+	if (len <= 0)
+		return 0;
+	tmp [ len ] = 0;
+
+	/* comm can contain spaces and parens; the rest starts after the last ')'.
+	 We want fields 3 (state), 14 (utime) and 15 (stime). */
+
+	p = (u8*) strrchr((char*) tmp,')');
+
+	if (!p
+			|| sscanf((char*) p + 2,
+					"%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+					(char*) state,&ut,&st) != 3)
+		return 0;
+
+	*ticks = ut + st;
+	return 1;
+
+}
+
+/* With -R, make sure that a server that is to be kept for another request
+ is really done with this one. If it died right after replying, its status
+ must be read now, or it would be blamed on the next input; and if it is
+ still running the tail of the request, that coverage would end up with
+ the next input, racing with classify_counts() on the way. Returns 0 once
+ the server sleeps, 1 if the fork server has reported it gone, and 2 if it
+ doesn't settle within NET_KEEP_SETTLE_MS. */
+
+static u8 wait_srv_settled(s32 pid)
+{
+
+	struct pollfd pfd;
+	struct timespec nap = { 0 , NET_PROBE_MIN_US * 1000 };
+	u64 end = get_cur_time_us() + NET_KEEP_SETTLE_MS * 1000ULL , ticks;
+	u8 state;
+
+	pfd.fd = fsrv_st_fd;
+	pfd.events = POLLIN;
+
+	while (1)
+	{
+
+		if (poll(&pfd,1,0) > 0)
+			return 1;
+
+		/* Zombies, or processes already gone from /proc, are about to be
+		 reported; anything but R and D is waiting for something. */
+
+		if (read_proc_cpu(pid,&state,&ticks) && state != 'R' && state != 'D'
+				&& state != 'Z' && state != 'X')
+			return 0;
+
+		if (get_cur_time_us() >= end)
+			return 2;
+
+		/* Sleep a bit, but wake up right away if the status comes in. */
+
+		ppoll(&pfd,1,&nap,NULL);
+
+	}
+
+}
+
+/* The same as wait_readable(), but for network targets with -E. Besides fd,
+ this watches the connection to the target (N_conn_fd) and the CPU usage of
+ child_pid, and stops waiting as soon as one of the requested detectors
+ says the input has been handled. Returns 1 if fd is readable, 2 if a
+ detector fired, 0 on timeout. */
+
+static u8 wait_net_done(s32 fd, u32 timeout_ms)
+{
+
+	struct pollfd pfd [ 2 ];
+	struct timespec ts , left;
+	u64 now , end , wake , last_act , next_cpu , ticks , last_ticks = 0;
+	u8 state , have_ticks = 0 , buf [ 512 ];
+	u8 is_stream = N_rp->ai_socktype == SOCK_STREAM;
+	s32 res , len;
+
+	pfd [ 0 ].fd = fd;
+	pfd [ 0 ].events = POLLIN;
+
+	/* Negative fds are ignored by ppoll(). */
+
+	pfd [ 1 ].fd = N_conn_fd;
+	pfd [ 1 ].events = POLLIN | POLLRDHUP;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	now = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+
+	end = now + timeout_ms * 1000ULL;
+	last_act = next_cpu = now;
+
+	while (1)
+	{
+
+		clock_gettime(CLOCK_MONOTONIC,&ts);
+		now = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+
+		if (timeout_ms && now >= end)
+			return 0;
+
+		if (N_idle_ms && now >= last_act + N_idle_ms * 1000ULL)
+			return 2;
+
+		/* CPU time only moves in whole ticks, so a child that is still busy
+		 may look idle for a sample or two; requiring it not to be runnable
+		 as well keeps that from ending the run early. */
+
+		if (N_done_cpu && now >= next_cpu)
+		{
+
+			if (read_proc_cpu(child_pid,&state,&ticks))
+			{
+
+				if (have_ticks && ticks == last_ticks && state != 'R')
+					return 2;
+
+				last_ticks = ticks;
+				have_ticks = 1;
+
+			}
+
+			next_cpu = now + N_cpu_ms * 1000ULL;
+
+		}
+
+		wake = timeout_ms ? end : (u64) -1;
+
+		if (N_idle_ms && last_act + N_idle_ms * 1000ULL < wake)
+			wake = last_act + N_idle_ms * 1000ULL;
+
+		if (N_done_cpu && next_cpu < wake)
+			wake = next_cpu;
+
+		left.tv_sec = (wake - now) / 1000000;
+		left.tv_nsec = ((wake - now) % 1000000) * 1000;
+
+		res = ppoll(pfd,2,wake == (u64) -1 ? NULL : &left,NULL);
+
+		if (res < 0)
+		{
+
+			if (errno != EINTR)
+				PFATAL("ppoll() failed");
+
+			if (stop_soon)
+				return 1;
+
+			continue;
+
+		}
+
+		if (pfd [ 0 ].revents)
+			return 1;
+
+		if (pfd [ 1 ].revents)
+		{
+
+			u8 got_data = 0 , got_eof = 0;
+
+			/* Whatever the target sent is of no interest beyond the fact that
+			 it was sent (and maybe for AFL_NET_RESPONSES). Empty datagrams
+			 count, too. */
+
+			while (1)
+			{
+
+				len = recv(N_conn_fd,buf,sizeof(buf),MSG_DONTWAIT);
+
+				if (len > 0 || (!len && !is_stream))
+				{
+					capture_reply(buf,len);
+					got_data = 1;
+					continue;
+				}
+
+				if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+					break;
+
+				if (len < 0 && errno == EINTR)
+					continue;
+
+				got_eof = 1;
+				break;
+
 			}
-			if (N_rp == NULL)
+
+			if (got_data)
 			{
-				return -1; /* failed to connect on any address (UDP case) */
+
+				if (N_done_response)
+					return 2;
+
+				clock_gettime(CLOCK_MONOTONIC,&ts);
+				last_act = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+
 			}
+
+			/* Once the peer is gone, there's nothing left to watch on the
+			 socket; don't let it keep waking us up. */
+
+			if (got_eof)
 			{
-				/* duplicate the file descriptor used for the fuzzed data, and use
-				 * the new file descriptor to read that data and send it to the
-				 * target process */
-				s32 fd = dup(out_fd);
-				/* stat the file descriptor to obtain the size of the data to be sent */
-				struct stat statbuf;
-				if (fstat(fd,&statbuf) == -1)
-					PFATAL("fstat()failed");
-				/* seek to the beginning of the file */
-				lseek(fd,0,SEEK_SET);
-				/* create a temporary buffer to hold all of the data in the file */
-				u8 tempbuf [ statbuf.st_size ];
-				/* read the entire file into the buffer */
-				if (read(fd,tempbuf,statbuf.st_size) != statbuf.st_size)
-				{
-					PFATAL(
-							"read of outfile's content failed to return expected # of bytes");
-				}
-				if (N_rp->ai_family == AF_INET)
-				{
-					/* and send the buffer's content to the target process.  Note that
-					 * this code assumes that the entire buffer can be sent in a single
-					 * packet.  If it can not (giant packet), the user may be doing
-					 * something wrong.  */
-					if (sendto(N_fd,tempbuf,statbuf.st_size,0,
-							(struct sockaddr *) ((N_rp)->ai_addr),
-							sizeof(struct sockaddr_in)) < 0)
-					{
-						PFATAL("partial or failed UDP write (IPv4)");
-					}
-				}
-				else if (N_rp->ai_family == AF_INET6)
-				{
-					if (sendto(N_fd,tempbuf,statbuf.st_size,0,
-							(struct sockaddr *) ((N_rp)->ai_addr),
-							sizeof(struct sockaddr_in6)) < 0)
-					{
-						PFATAL("partial or failed UDP write (IPv6)");
-					}
-				}
-				/* leave a clean campsite (as we found it) */
-				lseek(fd,0,SEEK_SET);
-				close(fd);
+
+				if (N_done_close && is_stream)
+					return 2;
+
+				pfd [ 1 ].fd = -1;
+
 			}
+
 		}
-	}
-	else
-	{
-		/* this should never be executed */
-		FATAL(
-				"no address information structures match command line network spec");
+
 	}
 
-	return 0;
+}
+
+/* Get a descriptor that becomes readable when the process exits, so that
+ we can wait for non-forkserver children with a timeout, too. Returns -1
+ if the kernel (or libc) doesn't support pidfd_open(). */
+
+static s32 open_pidfd(s32 pid)
+{
+
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open,pid,0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif /* ^SYS_pidfd_open */
+
 }
 
 /* Spin up fork server (instrumented mode only). The idea is explained here:
@@ -2743,7 +4329,6 @@ int network_send(void)
 static void init_forkserver(char** argv)
 {
 
-	static struct itimerval it;
 	int st_pipe [ 2 ] , ctl_pipe [ 2 ];
 	int status;
 	s32 rlen;
@@ -2774,7 +4359,15 @@ static void init_forkserver(char** argv)
 
 		}
 
-		if (mem_limit)
+		/* With a cgroup, the limit applies to the fork server and everything
+		 it spawns; setup_cgroup() already checked that the move works. */
+
+		if (cgroup_procs_fd >= 0)
+		{
+			if (write(cgroup_procs_fd,"0",1) != 1)
+				_exit(1);
+		}
+		else if (mem_limit)
 		{
 
 			r.rlim_max = r.rlim_cur = ((rlim_t) mem_limit) << 20;
@@ -2810,8 +4403,8 @@ static void init_forkserver(char** argv)
 		dup2(dev_null_fd,1);
 		dup2(dev_null_fd,2);
 
-		if (out_file || N_valid == 1)
-		{ /* no stdin for file or network input */
+		if (out_file || (N_valid == 1 && !N_desock))
+		{ /* no stdin for file or network input (libdesock reads it) */
 
 			dup2(dev_null_fd,0);
 
@@ -2879,23 +4472,39 @@ static void init_forkserver(char** argv)
 
 	/* Wait for the fork server to come up, but don't wait too long. */
 
-	it.it_value.tv_sec = ((exec_tmout * FORK_WAIT_MULT) / 1000);
-	it.it_value.tv_usec = ((exec_tmout * FORK_WAIT_MULT) % 1000) * 1000;
-
-	setitimer(ITIMER_REAL,&it,NULL);
-
-	rlen = read(fsrv_st_fd,&status,4);  //从fsrv_st_fd管道读取4个字节的内容
+	if (wait_readable(fsrv_st_fd,exec_tmout * FORK_WAIT_MULT))
+		rlen = read(fsrv_st_fd,&status,4);  //从fsrv_st_fd管道读取4个字节的内容
+	else
+	{
 
-	it.it_value.tv_sec = 0;
-	it.it_value.tv_usec = 0;
+		child_timed_out = 1;
+		kill(forksrv_pid,SIGKILL);
+		rlen = 0;
 
-	setitimer(ITIMER_REAL,&it,NULL);
+	}
 
 	/* If we have a four-byte "hello" message from the server, we're all set.
 	 Otherwise, try to figure out what went wrong. */
 
 	if (rlen == 4)
 	{
+
+		/* The target tells us whether it managed to map the test case region;
+		 if it didn't, we keep writing out_file as usual. */
+
+		if (shm_fuzz_mode && (status & FORKSRV_OPT_SHM_FUZZ))
+		{
+			shm_fuzz_live = 1;
+			OKF("Test cases will be delivered through shared memory.");
+		}
+
+		/* An older afl-qemu-trace would leave the target on the real port,
+		 with nobody sending it anything. */
+
+		if (shm_fuzz_mode && qemu_mode && N_desock && !shm_fuzz_live)
+			FATAL("afl-qemu-trace doesn't support AFL_DESOCK; rebuild it with "
+					"qemu_mode/build_qemu_support.sh");
+
 		OKF("All right - fork server is up.");
 		return;
 	}
@@ -2909,7 +4518,17 @@ static void init_forkserver(char** argv)
 	if (WIFSIGNALED(status))
 	{
 
-		if (mem_limit && mem_limit < 500 && uses_asan)
+		if (WTERMSIG(status) == SIGKILL && check_cgroup_oom())
+		{
+
+			SAYF(
+					"\n" cLRD "[-] " cRST "Whoops, the target binary was killed by the kernel for going over the\n"
+					"    cgroup memory limit (%s) before receiving any input from the fuzzer.\n"
+					"    Try bumping it up with the -m setting in the command line.\n",
+					mem_limit ? DMS(mem_limit << 20) : (u8*) "none");
+
+		}
+		else if (cgroup_procs_fd < 0 && mem_limit && mem_limit < 500 && uses_asan)
 		{
 
 			SAYF(
@@ -2917,7 +4536,7 @@ static void init_forkserver(char** argv)
 					doc_path);
 
 		}
-		else if (!mem_limit)
+		else if (!mem_limit || cgroup_procs_fd >= 0)
 		{
 
 			SAYF(
@@ -2974,7 +4593,7 @@ static void init_forkserver(char** argv)
 	if (*(u32*) trace_bits == EXEC_FAIL_SIG)
 		FATAL("Unable to execute target application ('%s')",argv [ 0 ]);
 
-	if (mem_limit && mem_limit < 500 && uses_asan)
+	if (cgroup_procs_fd < 0 && mem_limit && mem_limit < 500 && uses_asan)
 	{
 
 		SAYF(
@@ -2982,7 +4601,7 @@ static void init_forkserver(char** argv)
 				doc_path);
 
 	}
-	else if (!mem_limit)
+	else if (!mem_limit || cgroup_procs_fd >= 0)
 	{
 
 		SAYF(
@@ -3016,120 +4635,194 @@ static void init_forkserver(char** argv)
 
 }
 
-/* Execute target application, monitoring for timeouts. Return status
- information. The called program will update trace_bits[]. */
+/* Launch the target directly, for dumb mode and AFL_NO_FORKSRV. We use
+ vfork(), so the child borrows our (rather large) address space instead of
+ getting a copy of its page tables. Everything the child would otherwise do
+ by hand is prepared in advance: our own fds are O_CLOEXEC, and the ASAN /
+ MSAN defaults are put in the environment once. */
 
-static u8 run_target(char** argv)
+static void spawn_target(char** argv)
 {
 
-	static struct itimerval it;
-	static u32 prev_timed_out = 0;
-
-	int status = 0;
-	u32 tb4;
+	static struct rlimit r_mem , r_core;
+	static u8 spawn_ready;
 
-	child_timed_out = 0;
+	sigset_t all , old;
 
-	/* check to ensure that network listener has executed if doing network
-	 * fuzzing of a client target (where the target writes to a socket first */
-	if (N_fuzz_client && !N_myaddr_valid)
+	if (!spawn_ready)
 	{
-		network_setup_listener();
-	}
 
-	/* After this memset, trace_bits[] are effectively volatile, so we
-	 must prevent any earlier operations from venturing into that
-	 territory. */
+		/* Set sane defaults for ASAN if nothing else specified. */
 
-	memset(trace_bits,0,MAP_SIZE);//每次都把trace_bits赋值为0.
-	MEM_BARRIER();
+		setenv("ASAN_OPTIONS","abort_on_error=1:"
+				"detect_leaks=0:"
+				"allocator_may_return_null=1",0);
 
-	/* If we're running in "dumb" mode, we can't rely on the fork server
-	 logic compiled into the target program, so we will just keep calling
-	 execve(). There is a bit of code duplication between here and
-	 init_forkserver(), but c'est la vie. */
+		setenv("MSAN_OPTIONS","exit_code=" STRINGIFY(MSAN_ERROR) ":"
+		"msan_track_origins=0",0);
 
-	if (dumb_mode == 1 || no_forkserver)
-	{
+		r_mem.rlim_max = r_mem.rlim_cur = ((rlim_t) mem_limit) << 20;
 
-		child_pid = fork(); //自己fork,不利用qemu
+		spawn_ready = 1;
 
-		if (child_pid < 0)
-			PFATAL("fork() failed");
+	}
 
-		if (!child_pid)
-		{ //子进程
+	/* Until execv(), the child runs on our memory; make sure that none of our
+	 signal handlers gets to run there. */
 
-			struct rlimit r;
+	sigfillset(&all);
+	sigprocmask(SIG_SETMASK,&all,&old);
 
-			if (mem_limit)
-			{
+	child_pid = vfork();
 
-				r.rlim_max = r.rlim_cur = ((rlim_t) mem_limit) << 20;
+	if (!child_pid)
+	{
+
+		signal(SIGHUP,SIG_DFL);
+		signal(SIGINT,SIG_DFL);
+		signal(SIGTERM,SIG_DFL);
+		signal(SIGALRM,SIG_DFL);
+		signal(SIGWINCH,SIG_DFL);
+		signal(SIGUSR1,SIG_DFL);
+
+		if (cgroup_procs_fd >= 0)
+		{
+			if (write(cgroup_procs_fd,"0",1) != 1)
+				_exit(1);
+		}
+		else if (mem_limit)
+		{
 
 #ifdef RLIMIT_AS
 
-				setrlimit(RLIMIT_AS, &r); /* Ignore errors */
+			setrlimit(RLIMIT_AS, &r_mem); /* Ignore errors */
 
 #else
 
-				setrlimit(RLIMIT_DATA,&r); /* Ignore errors */
+			setrlimit(RLIMIT_DATA,&r_mem); /* Ignore errors */
 
 #endif /* ^RLIMIT_AS */
 
-			}
+		}
 
-			r.rlim_max = r.rlim_cur = 0;
+		setrlimit(RLIMIT_CORE,&r_core); /* Ignore errors */
 
-			setrlimit(RLIMIT_CORE,&r); /* Ignore errors */
+		/* Isolate the process and configure standard descriptors. If out_file is
+		 specified, stdin is /dev/null; otherwise, out_fd is cloned instead. */
 
-			/* Isolate the process and configure standard descriptors. If out_file is
-			 specified, stdin is /dev/null; otherwise, out_fd is cloned instead. */
+		setsid();
 
-			setsid();
+		dup2(dev_null_fd,1);
+		dup2(dev_null_fd,2);
+		dup2((out_file || (N_valid == 1 && !N_desock)) ? dev_null_fd : out_fd,0);
 
-			dup2(dev_null_fd,1);
-			dup2(dev_null_fd,2);
+		sigprocmask(SIG_SETMASK,&old,NULL);
 
-			if (out_file || N_valid == 1)
-			{ /* no stdin for file or network input */
+		execv(target_path,argv);
 
-				dup2(dev_null_fd,0);
+		/* Use a distinctive bitmap value to tell the parent about execv()
+		 falling through. */
 
-			}
-			else
-			{
+		*(u32*) trace_bits = EXEC_FAIL_SIG;
+		_exit(0);
+
+	}
 
-				dup2(out_fd,0);
-				close(out_fd);
+	sigprocmask(SIG_SETMASK,&old,NULL);
 
-			}
+	if (child_pid < 0)
+		PFATAL("vfork() failed");
+
+}
+
+/* Execute target application, monitoring for timeouts. Return status
+ information. The called program will update trace_bits[]. */
+
+/* Add the run that just finished to the -N latency breakdown in
+ fuzzer_stats. start_us is when run_target() was entered, child_us when it
+ had a child to run. Runs that time out are only counted as a whole, since
+ they tell us nothing about where the time would have gone otherwise. */
+
+static void account_net_latency(u64 start_us, u64 child_us)
+{
 
-			/* On Linux, would be faster to use O_CLOEXEC. Maybe TODO. */
+	u64 now_us = get_cur_time_us();
 
-			close(dev_null_fd);
-			close(out_dir_fd);
-			close(dev_urandom_fd);
-			close(fileno(plot_file));
+	N_lat_runs++;
 
-			/* Set sane defaults for ASAN if nothing else specified. */
+	if (child_timed_out)
+	{
+		N_lat_tmouts++;
+		N_lat_tmout += now_us - start_us;
+		return;
+	}
 
-			setenv("ASAN_OPTIONS","abort_on_error=1:"
-					"detect_leaks=0:"
-					"allocator_may_return_null=1",0);
+	N_lat_fsrv += child_us - start_us;
 
-			setenv("MSAN_OPTIONS","exit_code=" STRINGIFY(MSAN_ERROR) ":"
-			"msan_track_origins=0",0);
+	if (N_sent_us)
+	{
+		N_lat_wait += N_try_us - child_us;
+		N_lat_connect += N_conn_us - N_try_us;
+		N_lat_send += N_sent_us - N_conn_us;
+		child_us = N_sent_us;
+	}
 
-			execv(target_path,argv);
+	N_lat_target += now_us - child_us;
 
-			/* Use a distinctive bitmap value to tell the parent about execv()
-			 falling through. */
+}
 
-			*(u32*) trace_bits = EXEC_FAIL_SIG;
-			exit(0);
+static u8 run_target(char** argv)
+{
 
-		}
+	static struct itimerval it;
+	static u32 prev_timed_out = 0;
+
+	int status = 0;
+	s32 pidfd = -1;
+	u32 tb4;
+	u8 net_detect = N_valid
+			&& (N_done_close || N_done_response || N_idle_ms || N_done_cpu);
+	u64 lat_start_us = N_valid ? get_cur_time_us() : 0 , lat_child_us = 0;
+
+	child_timed_out = 0;
+	N_done = 0;
+
+	/* check to ensure that network listener has executed if doing network
+	 * fuzzing of a client target (where the target writes to a socket first */
+	if (N_fuzz_client && !N_myaddr_valid && !N_desock)
+	{
+		network_setup_listener();
+	}
+
+	/* After this memset, trace_bits[] are effectively volatile, so we
+	 must prevent any earlier operations from venturing into that
+	 territory. With AFL_PREFORK, the next child may already be waiting
+	 in the fork server at this point, but it does not touch the map
+	 until released by the write to fsrv_ctl_fd below - so the barrier
+	 has to keep the memset ahead of that write. */
+
+	memset(trace_bits,0,MAP_SIZE);//每次都把trace_bits赋值为0.
+	MEM_BARRIER();
+
+	/* If we're running in "dumb" mode, we can't rely on the fork server
+	 logic compiled into the target program, so we will just keep calling
+	 execve(). There is a bit of code duplication between here and
+	 init_forkserver(), but c'est la vie. */
+
+	if (dumb_mode == 1 || no_forkserver)
+	{
+
+		spawn_target(argv);
+		pidfd = open_pidfd(child_pid);
+
+	}
+	else if (N_srv_pid)
+	{
+
+		/* With -R, the server that handled the previous request is still up
+		 and waiting for the next one. */
+
+		child_pid = N_srv_pid;
 
 	}
 	else
@@ -3165,76 +4858,175 @@ static u8 run_target(char** argv)
 
 	}
 
-	/* Write fuzzed data set to target using network if -N option is specified */
-
 	if (N_valid)
 	{
-		if (N_timeout_given)
+		lat_child_us = get_cur_time_us();
+		N_sent_us = 0;
+	}
+
+	/* Write fuzzed data set to target using network if -N option is specified.
+	 If the target never gets ready, the run simply times out below. */
+
+	if (N_valid && !N_desock)
+	{
+		N_resp_len = 0;
+		network_deliver(
+				(dumb_mode == 1 || no_forkserver) ? pidfd : fsrv_st_fd);
+	}
+
+	/* Wait for the child to terminate, killing it if it takes longer than
+	 exec_tmout. With the fork server, this is a ppoll() on the status pipe;
+	 for direct children, on a pidfd. Only if the latter isn't available do
+	 we fall back to ITIMER_REAL and handle_timeout(). */
+
+	if (dumb_mode == 1 || no_forkserver)
+	{
+
+		if (pidfd >= 0)
 		{
-			/* Network output to target process after specified delay, and try
-			 * up to three times (hard-coded) */
-			N_it.tv_sec = (N_exec_tmout / 1000);
-			N_it.tv_nsec = (N_exec_tmout % 1000) * 1000000;
-			/* ignore errors & accept possibility that delay can be shorter */
+
+			u8 done = net_detect ?
+					wait_net_done(pidfd,exec_tmout) : wait_readable(pidfd,exec_tmout);
+
+			if (done != 1)
 			{
-				u32 N_tries = 3;
-				nanosleep(&N_it,NULL);
-				/* attempt to send up to 3 times (because of target process startup time) */
-				while (N_tries--
-						&& ((N_fuzz_client ? network_listen() : network_send())
-								== -1))
-					;
+				child_timed_out = !done;
+				N_done = done == 2;
+				kill(child_pid,SIGKILL);
 			}
+
+			close(pidfd);
+
 		}
 		else
 		{
-			/* Network output to target process - no delay.  This usual won't work. */
-			if ((N_fuzz_client ? network_listen() : network_send()) == -1)
-			{
-				FATAL(
-						"Network: failed to connect or send; specify a network delay time");
-			}
-		}
-	}
 
-	/* Configure timeout, as requested by user, then wait for child to terminate. */
+			it.it_value.tv_sec = (exec_tmout / 1000);
+			it.it_value.tv_usec = (exec_tmout % 1000) * 1000;
 
-	it.it_value.tv_sec = (exec_tmout / 1000);
-	it.it_value.tv_usec = (exec_tmout % 1000) * 1000;
+			setitimer(ITIMER_REAL,&it,NULL);
 
-	setitimer(ITIMER_REAL,&it,NULL); //设置超时设置,启动定时器
-
-	/* The SIGALRM handler simply kills the child_pid and sets child_timed_out. */ //注册了handle_timeout函数
-
-	if (dumb_mode == 1 || no_forkserver)
-	{
+		}
 
 		if (waitpid(child_pid,&status,0) <= 0)
 			PFATAL("waitpid() failed");
 
+		if (pidfd < 0)
+		{
+
+			it.it_value.tv_sec = 0;
+			it.it_value.tv_usec = 0;
+
+			setitimer(ITIMER_REAL,&it,NULL);
+
+		}
+
 	}
 	else
 	{
 
 		s32 res;
+		u8 done = net_detect ?
+				wait_net_done(fsrv_st_fd,exec_tmout) :
+				wait_readable(fsrv_st_fd,exec_tmout);
+		u8 keep = 0;
+
+		if (done != 1)
+		{
+
+			child_timed_out = !done;
+			N_done = done == 2;
+
+			/* A server that got through the request can take another one, up
+			 to -R of them, once it has settled. Crashes and hangs always get
+			 it restarted; so does a server that died right after replying -
+			 its status is read below and goes with this input - or one that
+			 stays busy for too long. */
+
+			if (N_done && N_persist && ++N_srv_reqs < N_persist)
+			{
+
+				u8 settled = wait_srv_settled(child_pid);
+
+				if (!settled)
+					keep = 1;
+				else if (settled == 2)
+					kill(child_pid,SIGKILL);
+
+			}
+			else
+				kill(child_pid,SIGKILL);
+
+		}
+
+		if (keep)
+		{
+
+			N_srv_pid = child_pid;
+			status = 0;
+
+		}
+		else
+		{
+
+			N_srv_pid = 0;
+			N_srv_reqs = 0;
+
+			if ((res = read(fsrv_st_fd,&status,4)) != 4)
+			{ //从qemu中读取状态信息
+
+				if (stop_soon)
+					return 0;
+				RPFATAL(res,"Unable to communicate with fork server");
+
+			}
+
+		}
+
+		/* A persistent mode child reports finished iterations on its own. If
+		 it managed to do that just as we killed it, the fork server is also
+		 going to tell us about its death; read that too, to stay in sync. */
+
+		if (status & FORKSRV_PERSIST_TAG)
+		{
+
+			if ((child_timed_out || N_done)
+					&& (res = read(fsrv_st_fd,&status,4)) != 4)
+			{
+
+				if (stop_soon)
+					return 0;
+				RPFATAL(res,"Unable to communicate with fork server");
+
+			}
+
+			status &= ~FORKSRV_PERSIST_TAG;
+
+		}
+
+	}
+
+	child_pid = 0;
+
+	if (N_valid)
+		account_net_latency(lat_start_us,lat_child_us);
+
+	if (N_resp_on)
+		hash_replies();
+
+	if (N_conn_fd >= 0)
+	{
 
-		if ((res = read(fsrv_st_fd,&status,4)) != 4)
-		{ //从qemu中读取状态信息
+		/* UDP keeps using the same socket; TCP connections are per run, and
+		 are reset rather than closed (see setup_net_conn()). */
 
-			if (stop_soon)
-				return 0;
-			RPFATAL(res,"Unable to communicate with fork server");
+		if (N_rp->ai_socktype == SOCK_STREAM)
+			close(N_conn_fd);
 
-		}
+		N_conn_fd = -1;
 
 	}
 
-	child_pid = 0;
-	it.it_value.tv_sec = 0;
-	it.it_value.tv_usec = 0;
-
-	setitimer(ITIMER_REAL,&it,NULL); //清除定时器
-
 	total_execs++; //execve函数的调用次数 ,这个也是记录的测试用例的次数
 
 	/* Any subsequent operations on trace_bits must not be moved by the
@@ -3252,7 +5044,7 @@ static u8 run_target(char** argv)
 	classify_counts((u32*) trace_bits); //对tracer_bit进行记录操作,归一到滚筒关系
 #endif /* ^__x86_64__ */
 
-	prev_timed_out = child_timed_out;
+	prev_timed_out = child_timed_out || N_done;
 
 #ifdef XIAOSA
 	int i=0;
@@ -3285,9 +5077,16 @@ static u8 run_target(char** argv)
 	if (child_timed_out)  //判断子进程是否超时
 		return FAULT_HANG; //时间太长,挂起
 
+	/* If a -E detector fired, the SIGKILL was ours and the run is considered
+	 to have ended normally. Any other signal means it crashed first. */
+
+	if (N_done && WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL)
+		status = 0;
+
 	if (WIFSIGNALED(status) && !stop_soon)
 	{ //判断测试进程是否异常退出,即由信号中止 这里所有信号都是crash吗
 		kill_signal = WTERMSIG(status); //得知中止进程的信号值,和kill -l是对应的
+		oom_killed = kill_signal == SIGKILL && check_cgroup_oom();
 		return FAULT_CRASH;
 	}
 
@@ -3297,6 +5096,7 @@ static u8 run_target(char** argv)
 	if (uses_asan && WEXITSTATUS(status) == MSAN_ERROR)
 	{
 		kill_signal = 0;
+		oom_killed = 0;
 		return FAULT_CRASH;
 	}
 
@@ -3316,6 +5116,43 @@ static void write_to_testcase(void* mem, u32 len)
 
 	s32 fd = out_fd;
 
+	/* Network targets get the test case straight from here. */
+
+	N_iov [ 0 ].iov_base = mem;
+	N_iov [ 0 ].iov_len = len;
+	N_iov_cnt = 1;
+
+	/* If the target maps the test case region, skip the file altogether.
+	 The same goes for network targets, unless they read a file, too. */
+
+	if (shm_fuzz_live)
+	{
+
+		*(u32*) shm_fuzz_buf = len;
+		memcpy(shm_fuzz_buf + 4,mem,len);
+		return;
+
+	}
+
+	if (N_valid == 1 && !N_desock && !out_file)
+		return;
+
+	/* A memfd just gets overwritten in place; the target opens its own
+	 description of it through /proc, so there's no offset to rewind. */
+
+	if (out_memfd)
+	{
+
+		if (pwrite(out_fd,mem,len,0) != len)
+			PFATAL("pwrite() to memfd failed");
+
+		if (ftruncate(out_fd,len))
+			PFATAL("ftruncate() failed");
+
+		return;
+
+	}
+
 	if (out_file)
 	{
 
@@ -3353,6 +5190,40 @@ static void write_with_gap(void* mem, u32 len, u32 skip_at, u32 skip_len)
 	s32 fd = out_fd;
 	u32 tail_len = len - skip_at - skip_len; //末尾保留的,可能为0.
 
+	N_iov [ 0 ].iov_base = mem;
+	N_iov [ 0 ].iov_len = skip_at;
+	N_iov [ 1 ].iov_base = mem + skip_at + skip_len;
+	N_iov [ 1 ].iov_len = tail_len;
+	N_iov_cnt = 2;
+
+	if (shm_fuzz_live)
+	{
+
+		*(u32*) shm_fuzz_buf = len - skip_len;
+		memcpy(shm_fuzz_buf + 4,mem,skip_at);
+		memcpy(shm_fuzz_buf + 4 + skip_at,mem + skip_at + skip_len,tail_len);
+		return;
+
+	}
+
+	if (N_valid == 1 && !N_desock && !out_file)
+		return;
+
+	if (out_memfd)
+	{
+
+		if (pwrite(out_fd,mem,skip_at,0) != skip_at
+				|| pwrite(out_fd,mem + skip_at + skip_len,tail_len,skip_at)
+						!= tail_len)
+			PFATAL("pwrite() to memfd failed");
+
+		if (ftruncate(out_fd,len - skip_len))
+			PFATAL("ftruncate() failed");
+
+		return;
+
+	}
+
 	if (out_file)
 	{
 
@@ -3388,6 +5259,25 @@ static void write_with_gap(void* mem, u32 len, u32 skip_at, u32 skip_len)
 
 static void show_stats(void);
 
+/* Number of runs in a row in which a map byte that flips with CAL_FLAKY_RATE
+ percent odds per run stays hidden with at most miss_perc percent odds. */
+
+static u32 quiet_runs_for(u32 miss_perc)
+{
+
+	double miss = 1;
+	u32 runs = 0;
+
+	while (miss * 100 > miss_perc)
+	{
+		miss *= (100 - CAL_FLAKY_RATE) / 100.0;
+		runs++;
+	}
+
+	return runs;
+
+}
+
 /* Calibrate a new test case. This is done when processing the input directory
  to warn about flaky or otherwise problematic test cases early on; and when
  new paths are discovered to detect variable behavior and so on. */
@@ -3396,9 +5286,14 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
 		u32 handicap, u8 from_queue)
 {
 
+	static u8 first_trace [ MAP_SIZE ];
+
 	u8 fault = 0 , new_bits = 0 , var_detected = 0 , first_run = (q->exec_cksum
 			== 0);
-	u64 start_us , stop_us;
+	u64 start_us , stop_us , run_us;
+	u32 quiet_runs = 0 , cal_runs = 0 , quiet_min;
+	static u32 quiet_min_find , quiet_min_seed;
+	double mean_us = 0 , m2_us = 0;
 
 	s32 old_sc = stage_cur , old_sm = stage_max , old_tmout = exec_tmout;
 	u8* old_sn = stage_name;
@@ -3416,26 +5311,50 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
 	stage_name = "calibration";
 	stage_max = no_var_check ? CAL_CYCLES_NO_VAR : CAL_CYCLES; //循环次数 多次calibration的意义
 
+	/* Quiet runs needed so that a byte flipping with CAL_FLAKY_RATE % odds
+	 per run stays hidden with at most CAL_MISS_PERC % odds (or
+	 CAL_SEED_MISS_PERC %, for the seeds). The first run only sets the
+	 reference, hence the extra one. */
+
+	if (!quiet_min_find)
+	{
+
+		quiet_min_find = quiet_runs_for(CAL_MISS_PERC) + 1;
+		quiet_min_seed = quiet_runs_for(CAL_SEED_MISS_PERC) + 1;
+
+	}
+
+	quiet_min = from_queue ? quiet_min_seed : quiet_min_find;
+
 	/* Make sure the forkserver is up before we do anything, and let's not
 	 count its spin-up time toward binary calibration. */
 
 	if (dumb_mode != 1 && !no_forkserver && !forksrv_pid)
 		init_forkserver(argv); //setup forkserver  一种argv是启动qemu的参数 这里启动qemu
 
+	if (first_run)
+		q->cksum_vars = var_byte_count;
+
 	start_us = get_cur_time_us();
 
 	for (stage_cur = 0; stage_cur < stage_max; stage_cur++)
 	{
 
 		u32 cksum;
+		u8 new_var = 0;
 
 		if (!first_run && !(stage_cur % stats_update_freq))
 			show_stats();
 
 		write_to_testcase(use_mem,q->len); //将测试用例的值保存到/output/.cur_input下
 
+		run_us = get_cur_time_us();
+
 		fault = run_target(argv); //argv指向目标程序
 
+		run_us = get_cur_time_us() - run_us;
+		cal_runs++;
+
 		/* stop_soon is set by the handler for Ctrl+C. When it's pressed,
 		 we want to bail out quickly. */
 
@@ -3449,7 +5368,19 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
 			//该测试用例不行? 还有时间限制,调试的时候容易hang住
 		}
 
-		cksum = hash32(trace_bits,MAP_SIZE,HASH_CONST);  //求哈希值
+		if (!stage_cur)
+		{
+
+			memcpy(first_trace,trace_bits,MAP_SIZE);
+
+			/* Make the response a known one, so that the first input to
+			 provoke it again doesn't look new. */
+
+			has_new_response();
+
+		}
+
+		cksum = hash_trace(trace_bits,q->cksum_vars);  //求哈希值
 
 		if (q->exec_cksum != cksum)
 		{ //判断是否是新的轨迹 只在calibration过程中
@@ -3461,26 +5392,74 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
 			if (!no_var_check && q->exec_cksum)
 			{
 
+				u32 i;
+
 				var_detected = 1; //表示同一个测试用例,不同次测试,路径不一致,即有随机路径
 				stage_max = CAL_CYCLES_LONG;
 
+				/* Note exactly which map bytes differ from the first run. From
+				 now on, they no longer count toward new checksums, and they are
+				 marked as seen in the virgin maps, so that has_new_bits() never
+				 reports them again. */
+
+				for (i = 0; i < MAP_SIZE; i++)
+				{
+
+					if (!var_bytes [ i ] && first_trace [ i ] != trace_bits [ i ])
+					{
+						var_bytes [ i ] = 1;
+						var_idx [ var_byte_count++ ] = i;
+						virgin_bits [ i ] = virgin_hang [ i ] = 0;
+						virgin_crash [ i ] = virgin_oom [ i ] = 0;
+						new_var = 1;
+					}
+
+				}
+
+				/* Compare further runs against the first one, with the
+				 unstable bytes masked out. */
+
+				q->exec_cksum = hash_trace(first_trace,var_byte_count);
+				q->cksum_vars = var_byte_count;
+
 			}
 			else
 				q->exec_cksum = cksum; //该测试用例第一次测试
 
 		}
 
+		/* Keep a running mean and variance of the exec time (Welford). */
+
+		{
+			double delta = run_us - mean_us;
+			mean_us += delta / cal_runs;
+			m2_us += delta * (run_us - mean_us);
+		}
+
+		quiet_runs = new_var ? 0 : quiet_runs + 1;
+
+		/* Stop early once the last few runs have not shown anything new, and
+		 the relative standard error of the mean exec time is low enough -
+		 i.e., sd / sqrt(n) / mean <= CAL_TIME_RSE %. */
+
+		if (quiet_runs >= (var_detected ? CAL_STABLE_RUNS : quiet_min)
+				&& (!mean_us
+						|| m2_us / (cal_runs - 1) * 10000
+								<= CAL_TIME_RSE * CAL_TIME_RSE * cal_runs
+										* mean_us * mean_us))
+			break;
+
 	}
 
 	stop_us = get_cur_time_us();
 
 	total_cal_us += stop_us - start_us;
-	total_cal_cycles += stage_max;
+	total_cal_cycles += cal_runs;
 
 	/* OK, let's collect some stats about the performance of this test case.
 	 This is used for fuzzing air time calculations in calculate_score(). */
 
-	q->exec_us = (stop_us - start_us) / stage_max;
+	q->exec_us = (stop_us - start_us) / cal_runs;
 	q->bitmap_size = count_bytes(trace_bits); //统计有多少个元组关系
 	q->handicap = handicap;
 	q->cal_failed = 0;
@@ -3649,7 +5628,17 @@ static void perform_dry_run(char** argv)
 					break;
 				}
 
-				if (mem_limit)
+				if (oom_killed)
+				{
+
+					SAYF(
+							"\n" cLRD "[-] " cRST "Oops, the program ran out of memory with one of the test cases provided\n"
+							"    and was killed by the kernel: the cgroup memory limit (%s) is too low\n"
+							"    for it. Either remove the test case or bump the limit up with -m.\n",
+							mem_limit ? DMS(mem_limit << 20) : (u8*) "none");
+
+				}
+				else if (mem_limit && cgroup_procs_fd < 0)
 				{
 
 					SAYF(
@@ -4014,7 +6003,7 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault)
 	u16 ylen;
 #endif
 
-	u8 hnb;
+	u8 hnb , new_resp;
 	s32 fd;
 	u8 keeping = 0 , res;
 
@@ -4022,9 +6011,36 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault)
 	{//根据模式决定记录哪些测试用例
 	 //如果crash_mode=0,这里不会收集crash的执行轨迹
 
-		/* Keep only if there are new bits in the map, add to queue for
-		 future fuzzing, etc. */
-		if (!(hnb = has_new_bits(virgin_bits))) //这里根据有滚筒策略的trace_bit比较.
+		/* Keep only if there are new bits in the map, or if a network target
+		 answered in a way it never did before, add to queue for future
+		 fuzzing, etc. */
+		hnb = has_new_bits(virgin_bits);
+		new_resp = has_new_response();
+
+		/* A reply that looks new may just carry a nonce that the mask
+		 doesn't cover. Believe it only if running the input again gets the
+		 same one; otherwise, every exec could end up in the queue. */
+
+		if (new_resp)
+		{
+
+			u32 resp_hash = N_resp_hash;
+
+			write_to_testcase(mem,len);
+
+			if (run_target(argv) != fault || N_resp_hash != resp_hash)
+			{
+				forget_response(resp_hash);
+				N_resp_flaky++;
+				new_resp = 0;
+			}
+
+			if (stop_soon)
+				return 0;
+
+		}
+
+		if (!hnb && !new_resp) //这里根据有滚筒策略的trace_bit比较.
 		{ //没有新的元组关系被执行
 			if (crash_mode)
 				total_crashes++;
@@ -4033,20 +6049,22 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault)
 
 #ifndef SIMPLE_FILES
 		//发现新的元组关系
-		fn = alloc_printf("%s/queue/id:%06u,%s",out_dir,queued_paths,
-				describe_op(hnb));
+		fn = alloc_printf("%s/queue/id:%06u,%s%s",out_dir,queued_paths,
+				describe_op(hnb),new_resp ? ",+resp" : "");
 #else
 		fn = alloc_printf("%s/queue/id_%06u", out_dir, queued_paths);
 
 #endif /* ^!SIMPLE_FILES */
 
 		add_to_queue(fn,len,0); //添加到变量 ,配置了queue_top.crash的测试用例不用添加到这里,除非是crash模式
+		queue_top->resp_state = new_resp;
 		if (hnb == 2)
 		{
 			queue_top->has_new_cov = 1;
 			queued_with_cov++; //没有考虑滚筒的变换
 		}
-		queue_top->exec_cksum = hash32(trace_bits,MAP_SIZE,HASH_CONST);
+		queue_top->exec_cksum = hash_trace(trace_bits,var_byte_count);
+		queue_top->cksum_vars = var_byte_count;
 
 		/* Try to calibrate inline; this also calls update_bitmap_score() when
 		 successful. */
@@ -4188,6 +6206,45 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault)
 
 		case FAULT_CRASH :
 
+			/* Running out of the cgroup memory limit is not a bug in itself;
+			 keep a handful of such inputs apart, same as hangs. */
+
+			if (oom_killed)
+			{
+
+				if (unique_ooms >= KEEP_UNIQUE_HANG)
+					return keeping;
+
+				if (!dumb_mode)
+				{
+
+#ifdef __x86_64__
+					simplify_trace((u64*)trace_bits);
+#else
+					simplify_trace((u32*) trace_bits);
+#endif /* ^__x86_64__ */
+
+					if (!has_new_bits(virgin_oom))
+						return keeping;
+
+				}
+
+#ifndef SIMPLE_FILES
+
+				fn = alloc_printf("%s/ooms/id:%06llu,%s",out_dir,unique_ooms,
+						describe_op(0));
+
+#else
+
+				fn = alloc_printf("%s/ooms/id_%06llu", out_dir, unique_ooms);
+
+#endif /* ^!SIMPLE_FILES */
+
+				unique_ooms++;
+				break;
+
+			}
+
 			/* This is handled in a manner roughly similar to hangs,
 			 except for slightly different limits. */
 
@@ -4436,6 +6493,9 @@ static void write_stats_file(double bitmap_cvg, double eps)
 	static double last_bcvg , last_eps;
 
 	u8* fn = alloc_printf("%s/fuzzer_stats",out_dir);
+	u32 t_bytes = count_non_255_bytes(virgin_bits);
+	u64 lat_runs = N_lat_runs ? N_lat_runs : 1;
+	double stability = 100;
 	s32 fd;
 	FILE* f;
 
@@ -4465,6 +6525,13 @@ static void write_stats_file(double bitmap_cvg, double eps)
 		last_eps = eps;
 	}
 
+	/* Share of the map bytes seen so far that behave deterministically. */
+
+	if (t_bytes > var_byte_count)
+		stability = 100 - ((double) var_byte_count) * 100 / t_bytes;
+	else if (t_bytes)
+		stability = 0;
+
 	fprintf(f, "start_time     : %llu\n"
 			"last_update    : %llu\n"
 			"fuzzer_pid     : %u\n"
@@ -4480,13 +6547,26 @@ static void write_stats_file(double bitmap_cvg, double eps)
 			"pending_favs   : %u\n"
 			"pending_total  : %u\n"
 			"variable_paths : %u\n"
+			"stability      : %0.02f%%\n"
 			"bitmap_cvg     : %0.02f%%\n"
 			"unique_crashes : %llu\n"
 			"unique_hangs   : %llu\n"
+			"oom_kills      : %llu\n"
+			"unique_ooms    : %llu\n"
 			"last_path      : %llu\n"
 			"last_crash     : %llu\n"
 			"last_hang      : %llu\n"
 			"exec_timeout   : %u\n"
+			"net_startup_us : %llu\n"
+			"net_resp_states: %u\n"
+			"net_resp_flaky : %u\n"
+			"net_fsrv_us    : %llu\n"
+			"net_wait_us    : %llu\n"
+			"net_connect_us : %llu\n"
+			"net_send_us    : %llu\n"
+			"net_target_us  : %llu\n"
+			"net_tmout_us   : %llu\n"
+			"net_tmouts     : %llu\n"
 			"afl_banner     : %s\n"
 			"afl_version    : " VERSION "\n"
 			"command_line   : %s\n",
@@ -4494,9 +6574,15 @@ static void write_stats_file(double bitmap_cvg, double eps)
 			queue_cycle ? (queue_cycle - 1) : 0, total_execs, eps,
 			queued_paths, queued_favored, queued_discovered, queued_imported,
 			max_depth, current_entry, pending_favored, pending_not_fuzzed,
-			queued_variable, bitmap_cvg, unique_crashes, unique_hangs,
-			last_path_time / 1000, last_crash_time / 1000,
-			last_hang_time / 1000, exec_tmout, use_banner, orig_cmdline);
+			queued_variable, stability, bitmap_cvg, unique_crashes, unique_hangs,
+			total_ooms, unique_ooms, last_path_time / 1000, last_crash_time / 1000,
+			last_hang_time / 1000, exec_tmout, N_ready_us, N_resp_states,
+			N_resp_flaky,
+			N_lat_fsrv / lat_runs, N_lat_wait / lat_runs,
+			N_lat_connect / lat_runs, N_lat_send / lat_runs,
+			N_lat_target / lat_runs, N_lat_tmout / lat_runs, N_lat_tmouts,
+			use_banner,
+			orig_cmdline);
 	/* ignore errors */
 
 	fclose(f);
@@ -4695,7 +6781,7 @@ static void maybe_delete_out_dir(void)
 	 create a lock that will persist for the lifetime of the process
 	 (this requires leaving the descriptor open).*/
 
-	out_dir_fd = open(out_dir,O_RDONLY);
+	out_dir_fd = open(out_dir,O_RDONLY | O_CLOEXEC);
 	if (out_dir_fd < 0)
 		PFATAL("Unable to open '%s'",out_dir);
 
@@ -4910,6 +6996,16 @@ static void maybe_delete_out_dir(void)
 		goto dir_cleanup_failed;
 	ck_free(fn);
 
+	/* Test cases that ran out of the cgroup memory limit are cheap to find
+	 again; no backup for those. */
+
+	fn = alloc_printf("%s/ooms",out_dir);
+	if (delete_files(fn,CASE_PREFIX))
+		goto dir_cleanup_failed;
+	if (rmdir(fn) && errno != ENOENT)
+		goto dir_cleanup_failed;
+	ck_free(fn);
+
 	/* And now, for some finishing touches. */
 
 	fn = alloc_printf("%s/.cur_input",out_dir);
@@ -5653,7 +7749,7 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf)
 
 			/* Note that we don't keep track of crashes or hangs here; maybe TODO? */
 
-			cksum = hash32(trace_bits,MAP_SIZE,HASH_CONST);
+			cksum = hash_trace(trace_bits,q->cksum_vars);
 
 			/* If the deletion had no impact on the trace, make it permanent. This
 			 isn't perfect for variable-path inputs, but we're just making a
@@ -5748,44 +7844,208 @@ static u8 common_fuzz_stuff(char** argv, u8* out_buf, u32 len)
 
 	write_to_testcase(out_buf,len);
 
-	fault = run_target(argv);
+	fault = run_target(argv);
+
+	if (stop_soon)
+		return 1;
+
+	if (fault == FAULT_HANG)
+	{
+
+		if (subseq_hangs++ > HANG_LIMIT)
+		{ //挂起有一个上限
+			cur_skipped_paths++;
+			return 1;
+		}
+
+	}
+	else
+		subseq_hangs = 0;
+
+	/* Users can hit us with SIGUSR1 to request the current input
+	 to be abandoned. */
+
+	if (skip_requested)
+	{
+
+		skip_requested = 0;
+		cur_skipped_paths++;
+		return 1;
+
+	}
+
+	/* This handles FAULT_ERROR for us: */
+
+	queued_discovered += save_if_interesting(argv,out_buf,len,fault);
+
+	if (!(stage_cur % stats_update_freq) || stage_cur + 1 == stage_max)
+		show_stats();
+
+	return 0;
+
+}
+
+/* Message-level havoc for session inputs: duplicate, drop, or swap whole
+ messages (or framed records), keeping the rest of the session intact. */
+
+static void mutate_session(u32 op, u8** buf, u32* len)
+{
+
+	static u32 beg [ NET_MAX_MSGS ] , end [ NET_MAX_MSGS ];
+	u32 cnt = split_session(*buf,*len,beg,end) , i , from , to , m1 , m2;
+	u8* new_buf;
+
+	/* Framed records carry their own length, so they're moved as a whole,
+	 with no separators to add or remove. */
+
+	if (N_session == 2)
+	{
+
+		switch (op)
+		{
+
+			case 0 :
+
+				i = UR(cnt);
+				from = i ? end [ i - 1 ] : 0;
+				to = end [ i ];
+
+				if (*len + to - from >= MAX_FILE)
+					break;
+
+				new_buf = ck_alloc_nozero(*len + to - from);
+
+				memcpy(new_buf,*buf,to);
+				memcpy(new_buf + to,*buf + from,*len - from);
+
+				ck_free(*buf);
+				*buf = new_buf;
+				*len += to - from;
+
+				break;
+
+			case 1 :
+
+				if (cnt < 2)
+					break;
+
+				i = UR(cnt);
+				from = i ? end [ i - 1 ] : 0;
+				to = end [ i ];
+
+				if (*len - (to - from) < 1)
+					break;
+
+				memmove(*buf + from,*buf + to,*len - to);
+				*len -= to - from;
+
+				break;
+
+			case 2 :
+
+				if (cnt < 2)
+					break;
+
+				i = UR(cnt - 1);
+				from = i ? end [ i - 1 ] : 0;
+				m1 = end [ i ] - from;
+				m2 = end [ i + 1 ] - end [ i ];
+
+				new_buf = ck_alloc_nozero(m1 + m2);
+
+				memcpy(new_buf,*buf + end [ i ],m2);
+				memcpy(new_buf + m2,*buf + from,m1);
+				memcpy(*buf + from,new_buf,m1 + m2);
+
+				ck_free(new_buf);
+
+				break;
+
+		}
+
+		return;
+
+	}
+
+	switch (op)
+	{
+
+		case 0 :
+
+			/* Duplicate a message. */
+
+			i = UR(cnt);
+			m1 = end [ i ] - beg [ i ];
+
+			if (*len + m1 + NET_MSG_SEP_LEN >= MAX_FILE)
+				break;
+
+			new_buf = ck_alloc_nozero(*len + m1 + NET_MSG_SEP_LEN);
+
+			memcpy(new_buf,*buf,end [ i ]);
+			memcpy(new_buf + end [ i ],NET_MSG_SEP,NET_MSG_SEP_LEN);
+			memcpy(new_buf + end [ i ] + NET_MSG_SEP_LEN,*buf + beg [ i ],
+					*len - beg [ i ]);
+
+			ck_free(*buf);
+			*buf = new_buf;
+			*len += m1 + NET_MSG_SEP_LEN;
+
+			break;
+
+		case 1 :
+
+			/* Drop a message, along with one of the separators next to it. */
+
+			if (cnt < 2)
+				break;
+
+			i = UR(cnt);
+
+			if (i < cnt - 1)
+			{
+				from = beg [ i ];
+				to = beg [ i + 1 ];
+			}
+			else
+			{
+				from = end [ i - 1 ];
+				to = *len;
+			}
+
+			/* Other havoc ops can't deal with an empty buffer. */
 
-	if (stop_soon)
-		return 1;
+			if (*len - (to - from) < 1)
+				break;
 
-	if (fault == FAULT_HANG)
-	{
+			memmove(*buf + from,*buf + to,*len - to);
+			*len -= to - from;
 
-		if (subseq_hangs++ > HANG_LIMIT)
-		{ //挂起有一个上限
-			cur_skipped_paths++;
-			return 1;
-		}
+			break;
 
-	}
-	else
-		subseq_hangs = 0;
+		case 2 :
 
-	/* Users can hit us with SIGUSR1 to request the current input
-	 to be abandoned. */
+			/* Swap two adjacent messages. */
 
-	if (skip_requested)
-	{
+			if (cnt < 2)
+				break;
 
-		skip_requested = 0;
-		cur_skipped_paths++;
-		return 1;
+			i = UR(cnt - 1);
+			m1 = end [ i ] - beg [ i ];
+			m2 = end [ i + 1 ] - beg [ i + 1 ];
 
-	}
+			new_buf = ck_alloc_nozero(m1 + m2 + NET_MSG_SEP_LEN);
 
-	/* This handles FAULT_ERROR for us: */
+			memcpy(new_buf,*buf + beg [ i + 1 ],m2);
+			memcpy(new_buf + m2,NET_MSG_SEP,NET_MSG_SEP_LEN);
+			memcpy(new_buf + m2 + NET_MSG_SEP_LEN,*buf + beg [ i ],m1);
+			memcpy(*buf + beg [ i ],new_buf,m1 + m2 + NET_MSG_SEP_LEN);
 
-	queued_discovered += save_if_interesting(argv,out_buf,len,fault);
+			ck_free(new_buf);
 
-	if (!(stage_cur % stats_update_freq) || stage_cur + 1 == stage_max)
-		show_stats();
+			break;
 
-	return 0;
+	}
 
 }
 
@@ -5892,6 +8152,12 @@ static u32 calculate_score(struct queue_entry* q)
 
 	}
 
+	/* Inputs that got a network target to answer in a new way are likely to
+	 have moved it into a different protocol state; explore them more. */
+
+	if (q->resp_state)
+		perf_score *= 2;
+
 	/* Final adjustment based on input depth, under the assumption that fuzzing
 	 deeper test cases is more likely to reveal stuff that can't be
 	 discovered with traditional fuzzers. */
@@ -6399,7 +8665,7 @@ static u8 fuzz_one(char** argv)
 		if (!dumb_mode && (stage_cur & 7) == 7)
 		{ //每进入一下, 处理字典方面的内容,待看
 
-			u32 cksum = hash32(trace_bits,MAP_SIZE,HASH_CONST); //计算最新的哈希值
+			u32 cksum = hash_trace(trace_bits,queue_cur->cksum_vars); //计算最新的哈希值
 
 			if (stage_cur == stage_max - 1 && cksum == prev_cksum)
 			{
@@ -6572,7 +8838,7 @@ static u8 fuzz_one(char** argv)
 			 without wasting time on checksums. */
 
 			if (!dumb_mode && len >= EFF_MIN_LEN)
-				cksum = hash32(trace_bits,MAP_SIZE,HASH_CONST); //输入很长的时候,判断是否有影响
+				cksum = hash_trace(trace_bits,queue_cur->cksum_vars); //输入很长的时候,判断是否有影响
 			else
 				cksum = ~queue_cur->exec_cksum; //输入很短的时候,认为都有影响,不插桩的话,也只能认为所有字段都是关键的
 
@@ -7465,7 +9731,18 @@ static u8 fuzz_one(char** argv)
 		for (i = 0; i < use_stacking; i++)
 		{ //随机选择
 
-			switch (UR(15 + ((extras_cnt + a_extras_cnt) ? 2 : 0)))
+			u32 ops = 15 + ((extras_cnt + a_extras_cnt) ? 2 : 0);
+			u32 op = UR(ops + (N_session ? 3 : 0));
+
+			/* Session inputs also get message-level operations. */
+
+			if (op >= ops)
+			{
+				mutate_session(op - ops,&out_buf,&temp_len);
+				continue;
+			}
+
+			switch (op)
 			{
 
 				case 0 :
@@ -8214,11 +10491,24 @@ static void handle_stop_sig(int sig)
 
 	if (child_pid > 0)
 		kill(child_pid,SIGKILL);
+	if (N_srv_pid > 0)
+		kill(N_srv_pid,SIGKILL);
 	if (forksrv_pid > 0)
 		kill(forksrv_pid,SIGKILL);
 
 }
 
+/* With -R, the fork server only sees its child go when that child exits, so
+ make sure a server kept up between runs doesn't outlive us. */
+
+static void kill_net_server(void)
+{
+
+	if (N_srv_pid > 0)
+		kill(N_srv_pid,SIGKILL);
+
+}
+
 /* Handle skip request (SIGUSR1). */
 
 static void handle_skipreq(int sig)
@@ -8424,6 +10714,18 @@ static void check_binary(u8* fname)
 
 	}
 
+	/* Test cases can only be handed over in memory when we talk to the fork
+	 server; in network mode, the data goes over the socket anyway. */
+
+	if (memmem(f_data,f_len,SHM_FUZZ_SIG,strlen(SHM_FUZZ_SIG) + 1)
+			&& !dumb_mode && !no_forkserver && !qemu_mode && !N_valid)
+	{
+
+		OKF(cPIN "Shared memory test case binary detected.");
+		shm_fuzz_mode = 1;
+
+	}
+
 	if (munmap(f_data,f_len))
 		PFATAL("unmap() failed");
 
@@ -8525,7 +10827,9 @@ static void usage(u8* argv0)
 					"  -N URL        - fuzzed program is to read from a network port.\n"
 					"                  The network is specified by URL = type://path:port\n"
 					"                  where type= {udp|tcp}, path={::1|127.0.0.1|localhost},\n"
-					"                  and port is a port number or service name.\n"
+					"                  and port is a port number or service name, or by\n"
+					"                  URL = {unix|unixgram}://path for a unix socket\n"
+					"                  (path may be @name, for the abstract namespace).\n"
 					"                  There are two cases, where the target program to be\n"
 					"                  fuzzed is either a server to afl-fuzz (the default)\n"
 					"                  or a client of afl-fuzz (using the -L option).  If the\n"
@@ -8537,15 +10841,23 @@ static void usage(u8* argv0)
 					"                  by the target.  Note that the '+' is likely to be\n"
 					"                  necessary after the -t delay option for network\n"
 					"                  fuzzing.\n"
-					"  -D msec       - for network fuzzing only: delay in msec before\n"
-					"                  a network read/write/connection is attempted;\n"
-					"                  Note that 3 attempts are made, with this\n"
-					"                  delay between each (-t is still in effect)\n"
+					"  -D msec       - for network fuzzing only: initial guess of how\n"
+					"                  long the target takes to start up; afl-fuzz\n"
+					"                  probes for readiness and learns the actual\n"
+					"                  value as it goes (-t is still in effect)\n"
 					"  -L            - specify this option if the fuzzed program is a\n"
 					"                  network client (meaning it writes to the network\n"
 					"                  before reading (a fuzzed input) from the network.\n"
 					"                  The port is the port number to which the network\n"
 					"                  client is expected to write.\n"
+					"  -R count      - for network fuzzing only: keep a server that has\n"
+					"                  handled a request (see -E) up for this many\n"
+					"                  requests before restarting it\n"
+					"  -E det,...    - for network fuzzing only: end each run as soon as\n"
+					"                  one of these fires, instead of waiting for -t:\n"
+					"                  close (peer shut down its side), response (data\n"
+					"                  received), idle=msec (no socket activity for that\n"
+					"                  long), cpu[=msec] (child used no CPU time)\n"
 					"  -t msec       - timeout for each run (auto-scaled, 50-%u ms)\n"
 					"  -m megs       - memory limit for child process (%u MB)\n"
 					"  -Q            - use binary-only instrumentation (QEMU mode)\n\n"
@@ -8598,7 +10910,7 @@ static void setup_dirs_fds(void)
 		if (in_place_resume)
 			FATAL("Resume attempted but old output directory not found");
 
-		out_dir_fd = open(out_dir,O_RDONLY);
+		out_dir_fd = open(out_dir,O_RDONLY | O_CLOEXEC);
 
 #ifndef __sun
 
@@ -8693,20 +11005,30 @@ static void setup_dirs_fds(void)
 		PFATAL("Unable to create '%s'",tmp);
 	ck_free(tmp);
 
+	/* Inputs that got the target OOM-killed, if using a cgroup. */
+
+	if (getenv("AFL_CGROUP"))
+	{
+		tmp = alloc_printf("%s/ooms",out_dir);
+		if (mkdir(tmp,0700))
+			PFATAL("Unable to create '%s'",tmp);
+		ck_free(tmp);
+	}
+
 	/* Generally useful file descriptors. */
 
-	dev_null_fd = open("/dev/null",O_RDWR);
+	dev_null_fd = open("/dev/null",O_RDWR | O_CLOEXEC);
 	if (dev_null_fd < 0)
 		PFATAL("Unable to open /dev/null");
 
-	dev_urandom_fd = open("/dev/urandom",O_RDONLY);
+	dev_urandom_fd = open("/dev/urandom",O_RDONLY | O_CLOEXEC);
 	if (dev_urandom_fd < 0)
 		PFATAL("Unable to open /dev/urandom");
 
 	/* Gnuplot output file. */
 
 	tmp = alloc_printf("%s/plot_data",out_dir);
-	fd = open(tmp,O_WRONLY | O_CREAT | O_EXCL,0600);
+	fd = open(tmp,O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,0600);
 	if (fd < 0)
 		PFATAL("Unable to create '%s'",tmp);
 	ck_free(tmp);
@@ -8731,7 +11053,7 @@ static void setup_stdio_file(void)
 
 	unlink(fn); /* Ignore errors */
 
-	out_fd = open(fn,O_RDWR | O_CREAT | O_EXCL,0600);
+	out_fd = open(fn,O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,0600);
 
 	if (out_fd < 0)
 		PFATAL("Unable to create '%s'",fn);
@@ -8740,6 +11062,79 @@ static void setup_stdio_file(void)
 
 }
 
+/* Remove the -f symlink to the memfd (atexit handler). Left behind, it
+ would point to whatever sits at that fd in the next process to look. */
+
+static void remove_memfd_link(void)
+{
+
+	if (getpid() == memfd_link_owner)
+		unlink(out_file);
+
+}
+
+/* If the target reads its input from a file (@@ or -f), keep that file in
+ memory: create a memfd, park it at MEMFD_FD, where every child inherits it,
+ and point @@ to /proc/self/fd/MEMFD_FD. A name given with -f becomes a
+ symlink to the same place, for targets that open a hardcoded path. Every
+ exec is then just a pwrite() and an ftruncate(), rather than unlink(),
+ open() and close() on a real file system. */
+
+static void setup_memfd(char** argv)
+{
+
+#ifdef SYS_memfd_create
+
+	u8 uses_file = !!out_file;
+	u32 i;
+	s32 fd;
+	u8* fn;
+
+	for (i = 0; argv [ i ] && !uses_file; i++)
+		if (strstr(argv [ i ],"@@"))
+			uses_file = 1;
+
+	if (!uses_file || getenv("AFL_NO_MEMFD"))
+		return;
+
+	fd = syscall(SYS_memfd_create,"afl-cur-input",0);
+
+	if (fd < 0)
+		return; /* Old kernel; just use the file system. */
+
+	if (fd != MEMFD_FD)
+	{
+		if (dup2(fd,MEMFD_FD) < 0)
+			PFATAL("dup2() failed");
+		close(fd);
+	}
+
+	fn = alloc_printf("/proc/self/fd/%u",MEMFD_FD);
+
+	if (out_file)
+	{
+
+		unlink(out_file); /* Ignore errors */
+
+		if (symlink(fn,out_file))
+			PFATAL("Unable to create '%s'",out_file);
+
+		memfd_link_owner = getpid();
+		atexit(remove_memfd_link);
+
+		ck_free(fn);
+
+	}
+	else
+		out_file = fn;
+
+	out_fd = MEMFD_FD;
+	out_memfd = 1;
+
+#endif /* SYS_memfd_create */
+
+}
+
 /* Make sure that core dumps don't go to a program. */
 
 static void check_crash_handling(void)
@@ -9120,6 +11515,201 @@ static void setup_signal_handlers(void)
 
 }
 
+/* Write a one-line mapping to /proc/self/{uid_map,gid_map,setgroups}. */
+
+static void write_ns_file(u8* name, u8* val)
+{
+
+	u8* fn = alloc_printf("/proc/self/%s",name);
+	s32 fd = open(fn,O_WRONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		PFATAL("Unable to open '%s'",fn);
+
+	ck_write(fd,val,strlen(val),fn);
+	close(fd);
+	ck_free(fn);
+
+}
+
+/* With AFL_NET_NS, move afl-fuzz into a network namespace of its own, with
+ nothing but a loopback interface; the fork server and every target end up
+ in there as well. Several instances can then fuzz the same daemon on the
+ same port (and abstract unix socket name) without getting in each other's
+ way. Unprivileged users get a user namespace to go with it, mapping just
+ their own uid and gid. */
+
+static void setup_net_ns(void)
+{
+
+	struct ifreq ifr;
+	uid_t uid = geteuid();
+	gid_t gid = getegid();
+	u8* tmp;
+	s32 fd;
+
+	if (!getenv("AFL_NET_NS"))
+		return;
+
+	if (!N_valid)
+		FATAL("AFL_NET_NS requires -N");
+
+	if (unshare(CLONE_NEWNET | (uid ? CLONE_NEWUSER : 0)))
+		PFATAL("Unable to create a network namespace (are unprivileged user "
+				"namespaces disabled?)");
+
+	if (uid)
+	{
+
+		/* gid_map can't be written before setgroups is denied. */
+
+		write_ns_file("setgroups","deny");
+
+		tmp = alloc_printf("%u %u 1",uid,uid);
+		write_ns_file("uid_map",tmp);
+		ck_free(tmp);
+
+		tmp = alloc_printf("%u %u 1",gid,gid);
+		write_ns_file("gid_map",tmp);
+		ck_free(tmp);
+
+	}
+
+	/* A new namespace has lo, but it starts out down. */
+
+	fd = socket(AF_INET,SOCK_DGRAM | SOCK_CLOEXEC,0);
+	if (fd < 0)
+		PFATAL("socket() failed");
+
+	memset(&ifr,0,sizeof(ifr));
+	strcpy(ifr.ifr_name,"lo");
+
+	if (ioctl(fd,SIOCGIFFLAGS,&ifr))
+		PFATAL("Unable to get flags of 'lo'");
+
+	ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+
+	if (ioctl(fd,SIOCSIFFLAGS,&ifr))
+		PFATAL("Unable to bring up 'lo'");
+
+	close(fd);
+
+	OKF("Running in a private network namespace.");
+
+}
+
+/* With AFL_DESOCK, preload libdesock into the target. It stands in for the
+ -N port with an AF_UNIX socket and serves the test case from stdin, so
+ that no data goes through the network stack at all. In QEMU mode, the
+ patched syscall layer does the same, and takes the test case from the
+ SHM region instead. */
+
+static void setup_desock(u8* own_loc)
+{
+
+	u8 *tmp , *lib = NULL , *own_copy , *rsl , *spec;
+	u16 port;
+
+	if (!getenv("AFL_DESOCK"))
+		return;
+
+	if (!N_valid)
+		FATAL("AFL_DESOCK requires -N");
+	if (out_file)
+		FATAL("AFL_DESOCK feeds the test case through stdin, so -f and @@ "
+				"can't be used");
+
+	if (N_results->ai_family == AF_UNIX)
+		FATAL("AFL_DESOCK only works with tcp:// and udp:// targets");
+
+	if (N_results->ai_family == AF_INET6)
+		port = ntohs(((struct sockaddr_in6 *) N_results->ai_addr)->sin6_port);
+	else
+		port = ntohs(((struct sockaddr_in *) N_results->ai_addr)->sin_port);
+
+	spec = alloc_printf("%s:%u",
+			N_results->ai_socktype == SOCK_STREAM ? "tcp" : "udp",port);
+	setenv(DESOCK_ENV_VAR,spec,1);
+
+	if (qemu_mode)
+	{
+
+		OKF("QEMU will emulate port %s from the test case.",spec);
+		ck_free(spec);
+
+		/* Without the fork server, it falls back to reading stdin. */
+
+		if (!dumb_mode && !no_forkserver)
+			shm_fuzz_mode = 1;
+
+		N_desock = 1;
+		return;
+
+	}
+
+	/* Same search order as for afl-qemu-trace. */
+
+	tmp = getenv("AFL_PATH");
+
+	if (tmp)
+	{
+
+		lib = alloc_printf("%s/libdesock.so",tmp);
+
+		if (access(lib,R_OK))
+			FATAL("Unable to find '%s'",lib);
+
+	}
+	else
+	{
+
+		own_copy = ck_strdup(own_loc);
+		rsl = strrchr(own_copy,'/');
+
+		if (rsl)
+		{
+
+			*rsl = 0;
+			lib = alloc_printf("%s/libdesock.so",own_copy);
+
+			if (access(lib,R_OK))
+			{
+				ck_free(lib);
+				lib = NULL;
+			}
+
+		}
+
+		ck_free(own_copy);
+
+		if (!lib && !access(AFL_PATH "/libdesock.so",R_OK))
+			lib = ck_strdup(AFL_PATH "/libdesock.so");
+
+		if (!lib)
+			FATAL("Unable to find 'libdesock.so' (build it in libdesock/, or "
+					"set AFL_PATH)");
+
+	}
+
+	OKF("Desocketing port %s with '%s'.",spec,lib);
+	ck_free(spec);
+
+	/* Go last, so that ASAN's runtime still gets to be first. */
+
+	if (getenv("LD_PRELOAD"))
+	{
+		tmp = alloc_printf("%s:%s",getenv("LD_PRELOAD"),lib);
+		setenv("LD_PRELOAD",tmp,1);
+		ck_free(tmp);
+	}
+	else
+		setenv("LD_PRELOAD",lib,1);
+
+	ck_free(lib);
+	N_desock = 1;
+
+}
+
 /* Rewrite argv for QEMU. */
 //argv是 aflout2  .cur_input 	 2个参数
 static char** get_qemu_argv(u8* own_loc, char** argv, int argc)
@@ -9246,7 +11836,7 @@ int main(int argc, char** argv)
 
 	doc_path = access(DOC_PATH,F_OK) ? "docs" : DOC_PATH; //doc_path is static variable
 
-	while ((opt = getopt(argc,argv,"+i:o:f:m:t:T:dnCB:S:M:x:QN:D:L")) > 0)
+	while ((opt = getopt(argc,argv,"+i:o:f:m:t:T:dnCB:S:M:x:QN:D:LE:R:")) > 0)
 	{ //getopt 系统调用
 
 		switch (opt)
@@ -9473,6 +12063,7 @@ int main(int argc, char** argv)
 						|| optarg [ 0 ] == '-')
 					FATAL("Bad syntax used for -D");
 				N_timeout_given = 1;
+				N_ready_us = N_exec_tmout * 1000ULL;
 				break;
 
 			case 'L' :
@@ -9482,6 +12073,68 @@ int main(int argc, char** argv)
 				N_fuzz_client = 1;
 				break;
 
+			case 'R' :
+
+				if (N_persist)
+					FATAL("Multiple -R options not supported");
+				if (sscanf(optarg,"%u",&N_persist) < 1 || optarg [ 0 ] == '-'
+						|| N_persist < 2)
+					FATAL("Bad syntax used for -R (need at least 2 requests)");
+				break;
+
+			case 'E' :
+
+				/* -E{detector,...} : stop waiting for a network target once it
+				 * has handled the input, rather than when exec_tmout expires.
+				 * Any of "close", "response", "idle=msec" and "cpu[=msec]". */
+
+				{
+					u8 *N_spec , *N_tok;
+
+					if (N_done_close || N_done_response || N_idle_ms || N_done_cpu)
+						FATAL("Multiple -E options not supported");
+
+					N_spec = ck_strdup(optarg);
+
+					for (N_tok = strtok(N_spec,","); N_tok; N_tok = strtok(NULL,","))
+					{
+
+						if (!strcmp(N_tok,"close"))
+							N_done_close = 1;
+						else if (!strcmp(N_tok,"response"))
+							N_done_response = 1;
+						else if (!strncmp(N_tok,"idle=",5))
+						{
+							if (sscanf(N_tok + 5,"%u",&N_idle_ms) < 1
+									|| N_tok [ 5 ] == '-' || !N_idle_ms)
+								FATAL("Bad value for -E idle=");
+						}
+						else if (!strcmp(N_tok,"cpu"))
+						{
+							N_done_cpu = 1;
+							N_cpu_ms = NET_CPU_IDLE_MS;
+						}
+						else if (!strncmp(N_tok,"cpu=",4))
+						{
+							N_done_cpu = 1;
+							if (sscanf(N_tok + 4,"%u",&N_cpu_ms) < 1
+									|| N_tok [ 4 ] == '-' || !N_cpu_ms)
+								FATAL("Bad value for -E cpu=");
+						}
+						else
+							FATAL("-E: unknown detector '%s'",N_tok);
+
+					}
+
+					ck_free(N_spec);
+
+					if (!(N_done_close || N_done_response || N_idle_ms || N_done_cpu))
+						FATAL("-E: no detector specified");
+
+				}
+
+				break;
+
 			default :
 
 				usage(argv [ 0 ]);
@@ -9494,6 +12147,54 @@ int main(int argc, char** argv)
 		FATAL("-L (network client) option requires -N (network) option");
 	if (N_timeout_given && !N_option_specified)
 		FATAL("-D option can not be used without -N option");
+	if ((N_done_close || N_done_response || N_idle_ms || N_done_cpu)
+			&& !N_option_specified)
+		FATAL("-E option can not be used without -N option");
+	if (N_persist)
+	{
+
+		if (!(N_done_close || N_done_response || N_idle_ms || N_done_cpu))
+			FATAL("-R needs -E to tell when a request has been handled");
+		if (getenv("AFL_DESOCK"))
+			FATAL("-R and AFL_DESOCK are mutually exclusive");
+
+		atexit(kill_net_server);
+
+	}
+
+	if (getenv("AFL_NET_SESSION"))
+	{
+
+		u8* tmp;
+
+		if (!N_option_specified)
+			FATAL("AFL_NET_SESSION requires -N");
+		if (getenv("AFL_DESOCK"))
+			FATAL("AFL_NET_SESSION and AFL_DESOCK are mutually exclusive");
+
+		N_session = strcmp(getenv("AFL_NET_SESSION"),"framed") ? 1 : 2;
+
+		if ((tmp = getenv("AFL_NET_PACE")))
+			N_pace_ms = atoi(tmp);
+		if ((tmp = getenv("AFL_NET_WAIT_REPLY")))
+			N_reply_ms = atoi(tmp);
+
+	}
+
+	if (getenv("AFL_NET_RESPONSES"))
+	{
+
+		if (!N_option_specified)
+			FATAL("AFL_NET_RESPONSES requires -N");
+		if (getenv("AFL_DESOCK"))
+			FATAL("AFL_NET_RESPONSES and AFL_DESOCK are mutually exclusive");
+
+		N_resp_on = 1;
+
+		if (getenv("AFL_NET_RESP_MASK"))
+			parse_resp_masks(getenv("AFL_NET_RESP_MASK"));
+
+	}
 
 	/* process network option(s), creating and configuring socket */
 	if (N_option_specified)
@@ -9509,8 +12210,13 @@ int main(int argc, char** argv)
 		/* prepare (zero) addrinfo structure used for hints to getaddrinfo()*/
 		memset(&N_hints,0,sizeof(struct addrinfo));
 
-		/* process the -N option string -- two cases depending on N_fuzz_client */
-		if (N_fuzz_client)
+		/* process the -N option string -- unix sockets first, then two cases
+		 * depending on N_fuzz_client */
+		if (parse_unix_url(N_option_string))
+		{
+			N_valid = 1;
+		}
+		else if (N_fuzz_client)
 		{
 			/* this is the case where afl-fuzz listens for the target to either
 			 * connect and write (TCP) to afl-fuzz's socket or create a socket
@@ -9732,10 +12438,15 @@ int main(int argc, char** argv)
 		no_cpu_meter_red = 1;
 	if (getenv("AFL_NO_VAR_CHECK"))
 		no_var_check = 1;
+	if (getenv("AFL_PREFORK"))
+		setenv(PREFORK_ENV_VAR,"1",1);
 
 	if (dumb_mode == 2 && no_forkserver)
 		FATAL("AFL_DUMB_FORKSRV and AFL_NO_FORKSRV are mutually exclusive");
 
+	if (N_persist && (dumb_mode == 1 || no_forkserver))
+		FATAL("-R requires the fork server");
+
 	save_cmdline(argc,argv);
 
 	fix_up_banner(argv [ optind ]);
@@ -9745,6 +12456,7 @@ int main(int argc, char** argv)
 	get_core_count();
 	check_crash_handling(); //往系统中添加一些configure
 	check_cpu_governor(); //处理核心模式,ok
+	setup_simd();
 
 	setup_post(); //不管
 	setup_shm(); //trace_bits指针(静态)指向该共享内存.
@@ -9761,6 +12473,7 @@ int main(int argc, char** argv)
 	if (!timeout_given)
 		find_timeout(); //还不理解,大概是设置时间的
 	//即从文件中读取,将文件指向测试用例
+	setup_memfd(argv + optind + 1);
 	detect_file_args(argv + optind + 1); //查看最后是否有@@符号.将指向@@参数的指针修改成指向.cur_input
 
 	if (!out_file)
@@ -9768,6 +12481,11 @@ int main(int argc, char** argv)
 
 	check_binary(argv [ optind ]);
 
+	setup_cgroup();
+	setup_desock(argv [ 0 ]);
+	setup_shm_fuzz();
+	setup_net_ns();
+
 	start_time = get_cur_time();
 
 	if (qemu_mode)
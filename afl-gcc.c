@@ -116,7 +116,7 @@ static void edit_params(u32 argc, char** argv) {
   u8 m32_set = 0;
 #endif
 
-  cc_params = ck_alloc((argc + 16) * sizeof(u8*));
+  cc_params = ck_alloc((argc + 32) * sizeof(u8*));
 
   name = strrchr(argv[0], '/');
   if (!name) name = argv[0]; else name++;
@@ -265,6 +265,38 @@ static void edit_params(u32 argc, char** argv) {
 
   }
 
+  /* Persistent mode, deferred fork server, and shared memory test cases,
+     with the same interface as in llvm_mode/; see afl-clang-fast.c for why
+     the signatures and the __asm__ aliasing are done this way. The symbols
+     come from the payload injected by afl-as, and since that's assembly,
+     they don't get the extra leading underscore on Apple systems. */
+
+  cc_params[cc_par_cnt++] = "-D__AFL_HAVE_MANUAL_CONTROL=1";
+
+  cc_params[cc_par_cnt++] = "-D__AFL_LOOP(_A)="
+    "({ static volatile char *_B __attribute__((used)); "
+    " _B = (char*)\"" PERSIST_SIG "\"; "
+    "int _L(unsigned int) __asm__(\"__afl_persistent_loop\"); "
+    "_L(_A); })";
+
+  cc_params[cc_par_cnt++] = "-D__AFL_INIT()="
+    "do { static volatile char *_A __attribute__((used)); "
+    " _A = (char*)\"" DEFER_SIG "\"; "
+    "void _I(void) __asm__(\"__afl_manual_init\"); "
+    "_I(); } while (0)";
+
+  cc_params[cc_par_cnt++] = "-D__AFL_FUZZ_TESTCASE_BUF="
+    "({ static volatile char *_S __attribute__((used)); "
+    " _S = (char*)\"" SHM_FUZZ_SIG "\"; "
+    "extern unsigned char *_P __asm__(\"__afl_fuzz_ptr\"); "
+    "_P ? _P + 4 : (unsigned char*)0; })";
+
+  cc_params[cc_par_cnt++] = "-D__AFL_FUZZ_TESTCASE_LEN="
+    "({ static volatile char *_S __attribute__((used)); "
+    " _S = (char*)\"" SHM_FUZZ_SIG "\"; "
+    "extern unsigned char *_P __asm__(\"__afl_fuzz_ptr\"); "
+    "_P ? *(unsigned int*)_P : 0; })";
+
   cc_params[cc_par_cnt] = NULL;
   //this is :gcc  /desktop/1.cpp -o aflout -B /afl-yyy -g -O3 -funroll-loops
 
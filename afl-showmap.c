@@ -22,6 +22,7 @@
  */
 
 #define AFL_MAIN
+#define _GNU_SOURCE
 
 #include "config.h"
 #include "types.h"
@@ -38,6 +39,7 @@
 #include <signal.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #include <sys/wait.h>
 #include <sys/time.h>
@@ -45,6 +47,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
 
 static s32 child_pid;                 /* PID of the tested program         */
 
@@ -207,11 +210,99 @@ static void handle_timeout(int sig) {
 }
 
 
+/* Wait for the child to exit, killing it if it runs for longer than
+   exec_tmout. The deadline is enforced with ppoll() on a pidfd, so there is
+   no signal traffic; on kernels without pidfd_open(), we fall back to
+   ITIMER_REAL and handle_timeout(). */
+
+static void wait_child(int* status) {
+
+  static struct itimerval it;
+  struct timespec now, end, left;
+  struct pollfd pfd;
+  s32 res = -1;
+
+#ifdef SYS_pidfd_open
+  pfd.fd = syscall(SYS_pidfd_open, child_pid, 0);
+#else
+  pfd.fd = -1;
+#endif /* ^SYS_pidfd_open */
+
+  pfd.events = POLLIN;
+
+  if (pfd.fd < 0 && exec_tmout) {
+
+    it.it_value.tv_sec = (exec_tmout / 1000);
+    it.it_value.tv_usec = (exec_tmout % 1000) * 1000;
+    setitimer(ITIMER_REAL, &it, NULL);
+
+  }
+
+  if (pfd.fd >= 0) {
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    end.tv_sec  += exec_tmout / 1000;
+    end.tv_nsec += (exec_tmout % 1000) * 1000000;
+
+    if (end.tv_nsec >= 1000000000) {
+      end.tv_sec++;
+      end.tv_nsec -= 1000000000;
+    }
+
+    while (1) {
+
+      if (exec_tmout) {
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        left.tv_sec  = end.tv_sec - now.tv_sec;
+        left.tv_nsec = end.tv_nsec - now.tv_nsec;
+
+        if (left.tv_nsec < 0) {
+          left.tv_sec--;
+          left.tv_nsec += 1000000000;
+        }
+
+        if (left.tv_sec < 0) { res = 0; break; }
+
+      }
+
+      res = ppoll(&pfd, 1, exec_tmout ? &left : NULL, NULL);
+
+      if (res >= 0) break;
+      if (errno != EINTR) PFATAL("ppoll() failed");
+
+    }
+
+    if (!res) {
+      child_timed_out = 1;
+      kill(child_pid, SIGKILL);
+    }
+
+    close(pfd.fd);
+
+  }
+
+  if (waitpid(child_pid, status, 0) <= 0) FATAL("waitpid() failed");
+
+  child_pid = 0;
+
+  if (pfd.fd < 0 && exec_tmout) {
+
+    it.it_value.tv_sec = 0;
+    it.it_value.tv_usec = 0;
+    setitimer(ITIMER_REAL, &it, NULL);
+
+  }
+
+}
+
+
 /* Execute target application. */
 
 static void run_target(char** argv) {
 
-  static struct itimerval it;
   int status = 0;
 
   if (!quiet_mode)
@@ -266,24 +357,11 @@ static void run_target(char** argv) {
 
   }
 
-  /* Configure timeout, wait for child, cancel timeout. */
+  /* Wait for child, enforcing the timeout. */
 
-  if (exec_tmout) {
+  child_timed_out = 0;
 
-    child_timed_out = 0;
-    it.it_value.tv_sec = (exec_tmout / 1000);
-    it.it_value.tv_usec = (exec_tmout % 1000) * 1000;
-
-  }
-
-  setitimer(ITIMER_REAL, &it, NULL);
-
-  if (waitpid(child_pid, &status, 0) <= 0) FATAL("waitpid() failed");
-
-  child_pid = 0;
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 0;
-  setitimer(ITIMER_REAL, &it, NULL);
+  wait_child(&status);
 
   MEM_BARRIER();
 
@@ -367,6 +445,41 @@ static void setup_signal_handlers(void) {
 }
 
 
+/* Copy stdin to a memfd for targets that want a file name (@@), and return
+   a path the target can open it by. This keeps afl-showmap usable as a
+   filter, without a temporary file on disk. */
+
+static u8* stdin_to_memfd(void) {
+
+#ifdef SYS_memfd_create
+
+  u8  buf[4096];
+  s32 fd, len;
+
+  fd = syscall(SYS_memfd_create, "afl-showmap-input", 0);
+  if (fd < 0) return NULL;
+
+  if (fd != MEMFD_FD) {
+    if (dup2(fd, MEMFD_FD) < 0) PFATAL("dup2() failed");
+    close(fd);
+  }
+
+  while ((len = read(0, buf, sizeof(buf))) > 0)
+    ck_write(MEMFD_FD, buf, len, "memfd");
+
+  if (len < 0) PFATAL("Unable to read stdin");
+
+  return alloc_printf("/proc/self/fd/%u", MEMFD_FD);
+
+#else
+
+  return NULL;
+
+#endif /* ^SYS_memfd_create */
+
+}
+
+
 /* Detect @@ in args. */
 
 static void detect_file_args(char** argv) {
@@ -384,6 +497,7 @@ static void detect_file_args(char** argv) {
 
       u8 *aa_subst, *n_arg;
 
+      if (!at_file) at_file = stdin_to_memfd();
       if (!at_file) FATAL("@@ syntax is not supported by this tool.");
 
       /* Be sure that we're always using fully-qualified paths. */
@@ -442,6 +556,9 @@ static void usage(u8* argv0) {
        "  -q            - sink program's output and don't show messages\n"
        "  -e            - show edge coverage only, ignore hit counts\n\n"
 
+       "If the target is given @@ in place of a file name, the input is read from\n"
+       "stdin and handed to it as an in-memory file instead.\n\n"
+
        "This tool displays raw tuple data captured by AFL instrumentation.\n"
        "For additional help, consult %s/README.\n\n",
 
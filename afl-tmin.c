@@ -20,6 +20,7 @@
  */
 
 #define AFL_MAIN
+#define _GNU_SOURCE
 
 #include "config.h"
 #include "types.h"
@@ -36,6 +37,7 @@
 #include <signal.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #include <sys/wait.h>
 #include <sys/time.h>
@@ -43,6 +45,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
 
 static s32 child_pid;                 /* PID of the tested program         */
 
@@ -72,7 +75,8 @@ static s32 shm_id,                    /* ID of the SHM region              */
 static u8  crash_mode,                /* Crash-centric mode?               */
            exit_crash,                /* Treat non-zero exit as crash?     */
            edges_only,                /* Ignore hit counts?                */
-           use_stdin = 1;             /* Use stdin for program input?      */
+           use_stdin = 1,             /* Use stdin for program input?      */
+           prog_in_memfd;             /* prog_in backed by a memfd?        */
 
 static volatile u8
            stop_soon,                 /* Ctrl-C pressed?                   */
@@ -220,6 +224,26 @@ static s32 write_to_file(u8* path, u8* mem, u32 len) {
 }
 
 
+/* Update the memfd behind prog_in in place. Returns a descriptor for the
+   child's stdin, rewound to the start, just like write_to_file(). */
+
+static s32 write_to_memfd(u8* mem, u32 len) {
+
+  s32 ret;
+
+  if (pwrite(MEMFD_FD, mem, len, 0) != len) PFATAL("pwrite() to memfd failed");
+  if (ftruncate(MEMFD_FD, len)) PFATAL("ftruncate() failed");
+
+  lseek(MEMFD_FD, 0, SEEK_SET);
+
+  ret = dup(MEMFD_FD);
+  if (ret < 0) PFATAL("dup() failed");
+
+  return ret;
+
+}
+
+
 /* Handle timeout signal. */
 
 static void handle_timeout(int sig) {
@@ -230,12 +254,100 @@ static void handle_timeout(int sig) {
 }
 
 
+/* Wait for the child to exit, killing it if it runs for longer than
+   exec_tmout. The deadline is enforced with ppoll() on a pidfd, so there is
+   no signal traffic; on kernels without pidfd_open(), we fall back to
+   ITIMER_REAL and handle_timeout(). */
+
+static void wait_child(int* status) {
+
+  static struct itimerval it;
+  struct timespec now, end, left;
+  struct pollfd pfd;
+  s32 res = -1;
+
+#ifdef SYS_pidfd_open
+  pfd.fd = syscall(SYS_pidfd_open, child_pid, 0);
+#else
+  pfd.fd = -1;
+#endif /* ^SYS_pidfd_open */
+
+  pfd.events = POLLIN;
+
+  if (pfd.fd < 0 && exec_tmout) {
+
+    it.it_value.tv_sec = (exec_tmout / 1000);
+    it.it_value.tv_usec = (exec_tmout % 1000) * 1000;
+    setitimer(ITIMER_REAL, &it, NULL);
+
+  }
+
+  if (pfd.fd >= 0) {
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    end.tv_sec  += exec_tmout / 1000;
+    end.tv_nsec += (exec_tmout % 1000) * 1000000;
+
+    if (end.tv_nsec >= 1000000000) {
+      end.tv_sec++;
+      end.tv_nsec -= 1000000000;
+    }
+
+    while (1) {
+
+      if (exec_tmout) {
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        left.tv_sec  = end.tv_sec - now.tv_sec;
+        left.tv_nsec = end.tv_nsec - now.tv_nsec;
+
+        if (left.tv_nsec < 0) {
+          left.tv_sec--;
+          left.tv_nsec += 1000000000;
+        }
+
+        if (left.tv_sec < 0) { res = 0; break; }
+
+      }
+
+      res = ppoll(&pfd, 1, exec_tmout ? &left : NULL, NULL);
+
+      if (res >= 0) break;
+      if (errno != EINTR) PFATAL("ppoll() failed");
+
+    }
+
+    if (!res) {
+      child_timed_out = 1;
+      kill(child_pid, SIGKILL);
+    }
+
+    close(pfd.fd);
+
+  }
+
+  if (waitpid(child_pid, status, 0) <= 0) FATAL("waitpid() failed");
+
+  child_pid = 0;
+
+  if (pfd.fd < 0 && exec_tmout) {
+
+    it.it_value.tv_sec = 0;
+    it.it_value.tv_usec = 0;
+    setitimer(ITIMER_REAL, &it, NULL);
+
+  }
+
+}
+
+
 /* Execute target application. Returns 0 if the changes are a dud, or
    1 if they should be kept. */
 
 static u8 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
 
-  static struct itimerval it;
   int status = 0;
 
   s32 prog_in_fd;
@@ -244,7 +356,8 @@ static u8 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
   memset(trace_bits, 0, MAP_SIZE);
   MEM_BARRIER();
 
-  prog_in_fd = write_to_file(prog_in, mem, len);
+  if (prog_in_memfd) prog_in_fd = write_to_memfd(mem, len);
+  else prog_in_fd = write_to_file(prog_in, mem, len);
 
   child_pid = fork();
 
@@ -294,21 +407,11 @@ static u8 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
 
   close(prog_in_fd);
 
-  /* Configure timeout, wait for child, cancel timeout. */
+  /* Wait for child, enforcing the timeout. */
 
   child_timed_out = 0;
-  it.it_value.tv_sec = (exec_tmout / 1000);
-  it.it_value.tv_usec = (exec_tmout % 1000) * 1000;
-
-  setitimer(ITIMER_REAL, &it, NULL);
 
-  if (waitpid(child_pid, &status, 0) <= 0) FATAL("waitpid() failed");
-
-  child_pid = 0;
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 0;
-
-  setitimer(ITIMER_REAL, &it, NULL);
+  wait_child(&status);
 
   MEM_BARRIER();
 
@@ -642,13 +745,53 @@ static void handle_stop_sig(int sig) {
 
 /* Do basic preparations - persistent fds, filenames, etc. */
 
-static void set_up_environment(void) {
+static void set_up_environment(char** argv) {
 
   u8* x;
+  u8  uses_file = !use_stdin;
+  u32 i;
 
   dev_null_fd = open("/dev/null", O_RDWR);
   if (dev_null_fd < 0) PFATAL("Unable to open /dev/null");
 
+  /* Keep the input file in memory if we can; see setup_memfd() in
+     afl-fuzz.c. A name given with -f becomes a symlink to it. A target
+     that reads stdin doesn't need it. */
+
+  for (i = 0; argv[i] && !uses_file; i++)
+    if (strstr(argv[i], "@@")) uses_file = 1;
+
+#ifdef SYS_memfd_create
+
+  if (uses_file && !getenv("AFL_NO_MEMFD")) {
+
+    s32 fd = syscall(SYS_memfd_create, "afl-tmin-input", 0);
+
+    if (fd >= 0) {
+
+      u8* fn = alloc_printf("/proc/self/fd/%u", MEMFD_FD);
+
+      if (fd != MEMFD_FD) {
+        if (dup2(fd, MEMFD_FD) < 0) PFATAL("dup2() failed");
+        close(fd);
+      }
+
+      if (prog_in) {
+
+        unlink(prog_in); /* Ignore errors */
+        if (symlink(fn, prog_in)) PFATAL("Unable to create '%s'", prog_in);
+        ck_free(fn);
+
+      } else prog_in = fn;
+
+      prog_in_memfd = 1;
+
+    }
+
+  }
+
+#endif /* SYS_memfd_create */
+
   if (!prog_in) {
 
     u8* use_dir = ".";
@@ -1015,7 +1158,7 @@ int main(int argc, char** argv) {
   setup_shm();
   setup_signal_handlers();
 
-  set_up_environment();
+  set_up_environment(argv + optind);
 
   find_binary(argv[optind]);
   detect_file_args(argv + optind);
@@ -43,6 +43,26 @@
 
 #define EXEC_TM_ROUND       20
 
+/* Readiness probing for network targets (-N): the first connection or send
+   attempt is made after NET_READY_FRAC percent of the startup latency
+   learned so far, and further ones at intervals doubling from
+   NET_PROBE_MIN_US up to NET_PROBE_MAX_US (microseconds): */
+
+#define NET_READY_FRAC      50
+#define NET_PROBE_MIN_US    50
+#define NET_PROBE_MAX_US    5000
+
+/* Default CPU sampling interval for -E cpu (milliseconds). Per-process
+   CPU time is only accounted in clock ticks, so this should stay well above
+   1000 / USER_HZ: */
+
+#define NET_CPU_IDLE_MS     50
+
+/* With -R, how long a server that has answered a request gets to go back
+   to sleep before it is restarted instead of being kept (milliseconds): */
+
+#define NET_KEEP_SETTLE_MS  50
+
 /* Default memory limit for child process (MB): */
 
 #ifndef __x86_64__ 
@@ -65,6 +85,22 @@
 
 #define CAL_CYCLES_NO_VAR   4
 
+/* Calibration of new finds stops early once enough runs in a row have not
+   revealed any new variable map bytes, and the relative standard error of
+   the mean exec time is within CAL_TIME_RSE percent. While no variable
+   behavior has been seen, "enough" means that a map byte flipping in at
+   least CAL_FLAKY_RATE percent of runs goes unnoticed with a probability
+   of at most CAL_MISS_PERC percent; afterwards, CAL_STABLE_RUNS. The mask
+   is shared by all entries, so a byte missed once is likely to be caught
+   by the next entry that hits it. Seeds are held to the stricter
+   CAL_SEED_MISS_PERC, since they teach the mask to everything else: */
+
+#define CAL_FLAKY_RATE      30
+#define CAL_MISS_PERC       25
+#define CAL_SEED_MISS_PERC  10
+#define CAL_STABLE_RUNS     10
+#define CAL_TIME_RSE        10
+
 /* Number of subsequent hangs before abandoning an input file: */
 
 #define HANG_LIMIT          250
@@ -257,6 +293,44 @@
 
 #define MAX_LINE            8192
 
+/* Separator between the messages of a session input (AFL_NET_SESSION), and
+   the most messages that are told apart in one input: */
+
+#define NET_MSG_SEP         "--afl-msg--\n"
+#define NET_MSG_SEP_LEN     (sizeof(NET_MSG_SEP) - 1)
+#define NET_MAX_MSGS        256
+
+/* Bytes of the replies to a run kept for hashing (AFL_NET_RESPONSES), the
+   most AFL_NET_RESP_MASK ranges, and the size of the map of response states
+   seen so far (must be a power of two): */
+
+#define NET_RESP_MAX        4096
+#define NET_RESP_MAX_MASKS  16
+#define NET_RESP_MAP_SIZE   (1 << 16)
+
+/* Bytes of a -L target's request searched for auto extras: */
+
+#define NET_HARVEST_MAX     4096
+
+/* Datagrams drained per recvmmsg() call when waiting for a -L target: */
+
+#define NET_RECV_BATCH      16
+
+/* Environment variable used to tell libdesock which port to take over: */
+
+#define DESOCK_ENV_VAR      "__AFL_DESOCK"
+
+/* Descriptors above this are left alone by libdesock, and the port that
+   the made-up peer appears to be using: */
+
+#define DESOCK_MAX_FD       4096
+#define DESOCK_PEER_PORT    40000
+
+/* Lowest descriptor libdesock moves its copy of stdin to, out of the way
+   of daemons that point fd 0 at /dev/null before they bind(): */
+
+#define DESOCK_INPUT_FD     (FORKSRV_FD - 10)
+
 /* Environment variable used to pass SHM ID to the called program. */
 
 #define SHM_ENV_VAR         "__AFL_SHM_ID"
@@ -265,17 +339,26 @@
 	#define VIRGIN_COUNTS   "__AFL_SHM_ID_VIRGIN_COUNTS"
 #endif
 
+/* Environment variable used to pass the ID of the test case SHM region to
+   harnesses that read their input from memory. The region holds a 32-bit
+   length followed by up to MAX_FILE bytes of data: */
+
+#define SHM_FUZZ_ENV_VAR    "__AFL_SHM_FUZZ_ID"
+#define SHM_FUZZ_MAP_SIZE   (MAX_FILE + 4)
+
 /* Other less interesting, internal-only variables. */
 
 #define CLANG_ENV_VAR       "__AFL_CLANG_MODE"
 #define AS_LOOP_ENV_VAR     "__AFL_AS_LOOPCHECK"
 #define PERSIST_ENV_VAR     "__AFL_PERSISTENT"
 #define DEFER_ENV_VAR       "__AFL_DEFER_FORKSRV"
+#define PREFORK_ENV_VAR     "__AFL_PREFORK"
 
 /* In-code signatures for deferred and persistent mode. */
 
 #define PERSIST_SIG         "##SIG_AFL_PERSISTENT##"
 #define DEFER_SIG           "##SIG_AFL_DEFER_FORKSRV##"
+#define SHM_FUZZ_SIG        "##SIG_AFL_SHM_FUZZ##"
 
 /* Distinctive bitmap signature used to indicate failed execution: */
 
@@ -290,6 +373,31 @@
 
 #define FORKSRV_FD          198
 
+/* Descriptor that the memory-backed input file for @@ / -f is moved to, so
+   that the target can open it as /proc/self/fd/MEMFD_FD: */
+
+#define MEMFD_FD            (FORKSRV_FD - 1)
+
+/* Flags the injected code may set in its initial "hello" message to the
+   fork server: */
+
+#define FORKSRV_OPT_SHM_FUZZ 0x00000001 /* Test case SHM region mapped    */
+
+/* Tag added to the status that a persistent mode child reports straight to
+   afl-fuzz after each iteration, to tell it apart from real wait() statuses
+   relayed by the fork server once the child is gone: */
+
+#define FORKSRV_PERSIST_TAG 0x40000000
+
+/* Snapshot mode (AFL_SNAPSHOT, llvm_mode only): maximum number of memory
+   mappings and file descriptors tracked, the size of the private stack used
+   while rolling back memory, and the size of the buffer for /proc reads: */
+
+#define SNAP_MAX_REGIONS    4096
+#define SNAP_MAX_FD         1024
+#define SNAP_STACK_SIZE     (64 * 1024)
+#define SNAP_BUF_SIZE       (64 * 1024)
+
 /* Fork server init timeout multiplier: we'll wait the user-selected
    timeout plus this much for the fork server to spin up. */
 
@@ -0,0 +1,115 @@
+#!/bin/sh
+#
+# american fuzzy lop - network mode benchmark
+# -------------------------------------------
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at:
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Runs afl-fuzz against the reference targets in test-net.c over loopback,
+# once for every way of delivering test cases to a network target, and
+# reports execs/sec along with where the time goes in an average exec (see
+# the net_*_us fields in docs/status_screen.txt). Meant to be run through
+# 'make bench' from the top-level directory, which builds test-net first.
+#
+# BENCH_TIME sets the number of seconds per mode (default 10), BENCH_PORT
+# the first port to use (default 17700), and BENCH_MODES a space-separated
+# subset of the modes listed below.
+#
+
+echo "network mode benchmark for afl-fuzz"
+echo
+
+AFL_DIR="${1:-.}"
+
+test "$BENCH_TIME" = "" && BENCH_TIME=10
+test "$BENCH_PORT" = "" && BENCH_PORT=17700
+test "$BENCH_MODES" = "" && BENCH_MODES="tcp tcp-keep tcp-desock udp udp-desock client"
+
+if [ ! -x "$AFL_DIR/afl-fuzz" -o ! -x "$AFL_DIR/test-net" ]; then
+
+  echo "[-] Error: '$AFL_DIR' doesn't contain afl-fuzz and test-net; use 'make bench'." 1>&2
+  exit 1
+
+fi
+
+if ! command -v timeout >/dev/null 2>&1; then
+
+  echo "[-] Error: this script needs timeout(1) from coreutils." 1>&2
+  exit 1
+
+fi
+
+AFL_DIR=`cd "$AFL_DIR" && pwd`
+TMP=`mktemp -d -t .afl-net-bench-XXXXXXXX` || exit 1
+
+trap 'rm -rf "$TMP"' EXIT
+
+mkdir "$TMP/in" || exit 1
+echo -n "0123456789" >"$TMP/in/seed"
+
+# The usual hurdles don't matter for a quick benchmark, but leave it to the
+# caller to override them.
+
+test "$AFL_SKIP_CPUFREQ" = "" && AFL_SKIP_CPUFREQ=1
+test "$AFL_NO_AFFINITY" = "" && AFL_NO_AFFINITY=1
+export AFL_SKIP_CPUFREQ AFL_NO_AFFINITY AFL_PATH="$AFL_DIR"
+
+printf "%-12s %10s %8s %8s %8s %8s %8s %8s %7s\n" mode "execs/s" \
+  "fsrv" "wait" "connect" "send" "target" "tmout" "tmouts"
+
+PORT=$BENCH_PORT
+
+for MODE in $BENCH_MODES; do
+
+  PORT=$((PORT + 1))
+  unset AFL_DESOCK
+  COUNT=""
+
+  case "$MODE" in
+
+    tcp)         OPTS="-N tcp://127.0.0.1:$PORT"; TGT=tcp ;;
+    tcp-keep)    OPTS="-N tcp://127.0.0.1:$PORT -R 1000 -E close"; TGT=tcp; COUNT=0 ;;
+    tcp-desock)  OPTS="-N tcp://127.0.0.1:$PORT"; TGT=tcp; AFL_DESOCK=1 ;;
+    udp)         OPTS="-N udp://127.0.0.1:$PORT"; TGT=udp ;;
+    udp-desock)  OPTS="-N udp://127.0.0.1:$PORT"; TGT=udp; AFL_DESOCK=1 ;;
+    client)      OPTS="-L -N tcp://127.0.0.1:$PORT"; TGT=client ;;
+    *)           echo "[-] Unknown mode '$MODE', skipping." 1>&2; continue ;;
+
+  esac
+
+  if [ "$AFL_DESOCK" = "1" -a ! -f "$AFL_DIR/libdesock.so" ]; then
+    printf "%-12s (skipped, build libdesock first)\n" "$MODE"
+    continue
+  fi
+
+  export AFL_DESOCK
+
+  rm -rf "$TMP/out"
+
+  timeout -s INT "$BENCH_TIME" "$AFL_DIR/afl-fuzz" -i "$TMP/in" -o "$TMP/out" \
+    -t 1000 $OPTS "$AFL_DIR/test-net" $TGT $PORT $COUNT >"$TMP/log" 2>&1
+
+  if [ ! -f "$TMP/out/fuzzer_stats" ]; then
+    printf "%-12s (failed, see below)\n" "$MODE"
+    tail -n 5 "$TMP/log" | sed 's/\x1b\[[0-9;]*[a-zA-Z]//g'
+    continue
+  fi
+
+  awk -v mode="$MODE" -F' *: ' '
+    { v[$1] = $2 }
+    END {
+      printf "%-12s %10s %8s %8s %8s %8s %8s %8s %7s\n", mode,
+        v["execs_per_sec"], v["net_fsrv_us"], v["net_wait_us"],
+        v["net_connect_us"], v["net_send_us"], v["net_target_us"],
+        v["net_tmout_us"], v["net_tmouts"]
+    }' "$TMP/out/fuzzer_stats"
+
+done
+
+echo
+echo "Times are in microseconds per exec, averaged over all execs; runs that"
+echo "timed out only count toward 'tmout'."
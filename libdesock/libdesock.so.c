@@ -0,0 +1,750 @@
+/*
+   american fuzzy lop - network desocketing library
+   ------------------------------------------------
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   This is an LD_PRELOAD library that takes the kernel's TCP/IP stack out of
+   the loop when fuzzing network services. afl-fuzz loads it into the target
+   when AFL_DESOCK is set together with -N, and tells it which port to take
+   over through __AFL_DESOCK ("tcp:<port>" or "udp:<port>").
+
+   Sockets bound or connected to that port are quietly replaced with AF_UNIX
+   sockets in the abstract namespace, so the target never touches the real
+   port (and parallel instances don't fight over it). A single connection
+   (or datagram) carrying the test case, read from stdin, is then queued up
+   for the target; whatever the target sends back is read and thrown away
+   by a helper thread. Stdin is set aside at startup, so daemons that point
+   fd 0 at /dev/null before they bind() still get the input.
+
+   The target is made to exit once it has handled that input: when it comes
+   back to a blocking accept(), asks for a second datagram, or - for event
+   loop servers and clients - closes the connection. Coverage is in SHM by
+   then, so this is a plain _exit(); atexit handlers and destructors would
+   only race with the target's other threads.
+
+*/
+
+#define _GNU_SOURCE
+
+#include "../config.h"
+#include "../types.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+/* Per-descriptor state. */
+
+#define DS_NONE     0                   /* Not ours                         */
+#define DS_LISTEN   1                   /* Took over the target port        */
+#define DS_CONN     2                   /* Connection carrying the input    */
+
+static u8 fd_kind[DESOCK_MAX_FD];
+
+static u16 ds_port;                     /* Port to take over                */
+static u8  ds_active;                   /* __AFL_DESOCK parsed OK           */
+
+static s32 listen_fd = -1;              /* Replacement listener, if any     */
+static s32 listen_type;                 /* SOCK_STREAM or SOCK_DGRAM        */
+static s32 input_fd;                    /* Private copy of stdin            */
+static u8  served;                      /* Input handed over in this proc   */
+static u32 dgram_reads;                 /* recv*() calls on a UDP listener  */
+
+/* The target is done with a stream connection once every descriptor for it
+   is closed. The helper thread sees EOF when that happens - but also when
+   the target merely does shutdown(SHUT_WR) - and close() knows which of
+   our descriptors are still open, so the two compare notes under a lock. */
+
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static u32 conn_fds;                    /* Open DS_CONN descriptors         */
+static u8  conn_eof;                    /* Helper thread saw EOF            */
+static ino_t conn_ino;                  /* Inode of the connection          */
+
+static struct sockaddr_un listen_name, peer_name;
+static socklen_t listen_name_len, peer_name_len;
+
+/* What the target gets to see instead of AF_UNIX addresses. */
+
+static struct sockaddr_storage fake_local, fake_peer;
+static socklen_t fake_len;
+
+static int (*real_bind)(int, const struct sockaddr*, socklen_t);
+static int (*real_listen)(int, int);
+static int (*real_accept4)(int, struct sockaddr*, socklen_t*, int);
+static int (*real_connect)(int, const struct sockaddr*, socklen_t);
+static int (*real_close)(int);
+static ssize_t (*real_recvfrom)(int, void*, size_t, int, struct sockaddr*,
+                                socklen_t*);
+static ssize_t (*real_recvmsg)(int, struct msghdr*, int);
+static ssize_t (*real_sendto)(int, const void*, size_t, int,
+                              const struct sockaddr*, socklen_t);
+static ssize_t (*real_sendmsg)(int, const struct msghdr*, int);
+
+
+/* Read the whole test case from our copy of stdin. pread() leaves the file
+   offset alone, which matters because it is shared with afl-fuzz and the
+   fork server. */
+
+static u8* read_input(u32* len) {
+
+  u32 size = 4096, got = 0;
+  u8* buf = malloc(size);
+  ssize_t res;
+
+  while (buf) {
+
+    res = pread(input_fd, buf + got, size - got, got);
+    if (res <= 0) break;
+
+    got += res;
+
+    if (got == size) {
+      if (size >= MAX_FILE) break;
+      size *= 2;
+      buf = realloc(buf, size);
+    }
+
+  }
+
+  *len = got;
+  return buf;
+
+}
+
+
+/* Helper thread: for connections, send the test case, signal EOF, and throw
+   away anything the target writes back. If the target closes its end after
+   it has been handed the input in this process, it's done with it; if it
+   only shut down its side of the connection, close() makes the call. For
+   datagrams, the input is already on its way; just keep the replies from
+   piling up. */
+
+/* Forget DS_CONN descriptors that were closed behind our back - fclose()
+   doesn't come through close() - or reused for something else. Called
+   with conn_lock held. */
+
+static void drop_stale_conns(void) {
+
+  struct stat st;
+  s32 fd;
+
+  for (fd = 0; fd < DESOCK_MAX_FD && conn_fds; fd++) {
+
+    if (fd_kind[fd] != DS_CONN) continue;
+
+    if (fstat(fd, &st) || st.st_ino != conn_ino) {
+      fd_kind[fd] = DS_NONE;
+      conn_fds--;
+    }
+
+  }
+
+}
+
+
+static void* pump_thread(void* arg) {
+
+  s32 fd = (s32)(long)arg & 0xffff;
+  u8 stream = !!((long)arg & 0x10000);
+  u8 *buf, tmp[4096];
+  u32 len, off = 0;
+  ssize_t res;
+  sigset_t all;
+
+  /* Signals are for the target's own threads to handle. */
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+  if (!stream) {
+
+    while (recv(fd, tmp, sizeof(tmp), 0) >= 0 || errno == EINTR);
+    return NULL;
+
+  }
+
+  buf = read_input(&len);
+
+  while (buf && off < len) {
+
+    res = send(fd, buf + off, len - off, MSG_NOSIGNAL);
+
+    if (res < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+
+    off += res;
+
+  }
+
+  free(buf);
+  shutdown(fd, SHUT_WR);
+
+  while ((res = recv(fd, tmp, sizeof(tmp), 0)) > 0 ||
+         (res < 0 && errno == EINTR));
+
+  pthread_mutex_lock(&conn_lock);
+
+  conn_eof = 1;
+  drop_stale_conns();
+
+  if (served && !conn_fds) _exit(0);
+
+  pthread_mutex_unlock(&conn_lock);
+
+  return NULL;
+
+}
+
+
+static void start_pump(s32 fd, u8 stream) {
+
+  pthread_t t;
+
+  if (pthread_create(&t, NULL, pump_thread,
+                     (void*)(long)(fd | (stream ? 0x10000 : 0)))) abort();
+  pthread_detach(t);
+
+}
+
+
+/* Queue up a connection (or a datagram) with the test case on the
+   replacement listener. */
+
+static void arm_listener(void) {
+
+  s32 fd;
+  u32 len;
+  u8* buf;
+
+  if (listen_type == SOCK_STREAM) {
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) abort();
+
+    if (real_connect(fd, (struct sockaddr*)&listen_name, listen_name_len))
+      abort();
+
+    start_pump(fd, 1);
+    return;
+
+  }
+
+  /* The target needs an address to reply to. */
+
+  fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) abort();
+
+  memset(&peer_name, 0, sizeof(peer_name));
+  peer_name.sun_family = AF_UNIX;
+  peer_name_len = offsetof(struct sockaddr_un, sun_path) + 1 +
+    sprintf(peer_name.sun_path + 1, "afl-desock-%d-peer", getpid());
+
+  if (real_bind(fd, (struct sockaddr*)&peer_name, peer_name_len)) abort();
+
+  buf = read_input(&len);
+
+  if (buf) real_sendto(fd, buf, len, MSG_NOSIGNAL,
+                       (struct sockaddr*)&listen_name, listen_name_len);
+  free(buf);
+
+  start_pump(fd, 0);
+
+}
+
+
+/* The fork server (or the target itself) may fork after the listener is set
+   up. Whatever was queued up in the parent is stale for the child, and the
+   parent's helper thread doesn't exist in it, so start over. */
+
+static void desock_atfork_child(void) {
+
+  s32 fl, fd;
+  u8 tmp[16];
+
+  /* The helper thread may have held the lock at fork() time. */
+
+  pthread_mutex_init(&conn_lock, NULL);
+
+  if (listen_fd < 0 || served) return;
+
+  fl = fcntl(listen_fd, F_GETFL);
+  fcntl(listen_fd, F_SETFL, fl | O_NONBLOCK);
+
+  if (listen_type == SOCK_STREAM) {
+
+    while ((fd = real_accept4(listen_fd, NULL, NULL, 0)) >= 0)
+      real_close(fd);
+
+  } else {
+
+    while (real_recvfrom(listen_fd, tmp, sizeof(tmp), 0, NULL, NULL) >= 0);
+
+  }
+
+  fcntl(listen_fd, F_SETFL, fl);
+
+  dgram_reads = 0;
+  conn_eof    = 0;
+  arm_listener();
+
+}
+
+
+__attribute__((constructor)) static void desock_init(void) {
+
+  u8* spec = (u8*)getenv(DESOCK_ENV_VAR);
+  u32 port;
+
+  real_bind     = dlsym(RTLD_NEXT, "bind");
+  real_listen   = dlsym(RTLD_NEXT, "listen");
+  real_accept4  = dlsym(RTLD_NEXT, "accept4");
+  real_connect  = dlsym(RTLD_NEXT, "connect");
+  real_close    = dlsym(RTLD_NEXT, "close");
+  real_recvfrom = dlsym(RTLD_NEXT, "recvfrom");
+  real_recvmsg  = dlsym(RTLD_NEXT, "recvmsg");
+  real_sendto   = dlsym(RTLD_NEXT, "sendto");
+  real_sendmsg  = dlsym(RTLD_NEXT, "sendmsg");
+
+  if (!spec || (strncmp((char*)spec, "tcp:", 4) &&
+      strncmp((char*)spec, "udp:", 4)) ||
+      sscanf((char*)spec + 4, "%u", &port) != 1 || !port || port > 65535)
+    return;
+
+  ds_port   = port;
+  ds_active = 1;
+
+  input_fd = fcntl(0, F_DUPFD_CLOEXEC, DESOCK_INPUT_FD);
+  if (input_fd < 0) input_fd = 0;
+
+  pthread_atfork(NULL, NULL, desock_atfork_child);
+
+}
+
+
+/* Is this an address on the port we're taking over? */
+
+static u8 is_target_addr(const struct sockaddr* addr, socklen_t len) {
+
+  if (!ds_active || !addr) return 0;
+
+  if (addr->sa_family == AF_INET && len >= sizeof(struct sockaddr_in))
+    return ntohs(((struct sockaddr_in*)addr)->sin_port) == ds_port;
+
+  if (addr->sa_family == AF_INET6 && len >= sizeof(struct sockaddr_in6))
+    return ntohs(((struct sockaddr_in6*)addr)->sin6_port) == ds_port;
+
+  return 0;
+
+}
+
+
+/* Remember the address the target asked for, and make up a loopback peer
+   of the same family for it to talk to. */
+
+static void set_fake_addrs(const struct sockaddr* addr, socklen_t len) {
+
+  memset(&fake_local, 0, sizeof(fake_local));
+  memset(&fake_peer, 0, sizeof(fake_peer));
+
+  memcpy(&fake_local, addr, len);
+  fake_len = len;
+
+  if (addr->sa_family == AF_INET) {
+
+    struct sockaddr_in* p = (struct sockaddr_in*)&fake_peer;
+
+    p->sin_family      = AF_INET;
+    p->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    p->sin_port        = htons(DESOCK_PEER_PORT);
+
+  } else {
+
+    struct sockaddr_in6* p = (struct sockaddr_in6*)&fake_peer;
+
+    p->sin6_family = AF_INET6;
+    p->sin6_addr   = in6addr_loopback;
+    p->sin6_port   = htons(DESOCK_PEER_PORT);
+
+  }
+
+}
+
+
+static void copy_addr(struct sockaddr* dst, socklen_t* len,
+                      struct sockaddr_storage* src) {
+
+  if (!dst || !len) return;
+
+  memcpy(dst, src, *len < fake_len ? *len : fake_len);
+  *len = fake_len;
+
+}
+
+
+/* Swap fd for a fresh AF_UNIX socket of the same type, keeping its flags. */
+
+static s32 replace_fd(s32 fd, s32* type) {
+
+  socklen_t tl = sizeof(s32);
+  s32 fl = fcntl(fd, F_GETFL), fdf = fcntl(fd, F_GETFD), nfd;
+
+  if (getsockopt(fd, SOL_SOCKET, SO_TYPE, type, &tl)) return -1;
+
+  nfd = socket(AF_UNIX, *type, 0);
+  if (nfd < 0) return -1;
+
+  if (dup2(nfd, fd) < 0) {
+    real_close(nfd);
+    return -1;
+  }
+
+  real_close(nfd);
+
+  fcntl(fd, F_SETFL, fl);
+  fcntl(fd, F_SETFD, fdf);
+
+  return fd;
+
+}
+
+
+int bind(int fd, const struct sockaddr* addr, socklen_t len) {
+
+  if (!is_target_addr(addr, len) || listen_fd >= 0 || fd >= DESOCK_MAX_FD)
+    return real_bind(fd, addr, len);
+
+  if (replace_fd(fd, &listen_type) < 0) return -1;
+
+  memset(&listen_name, 0, sizeof(listen_name));
+  listen_name.sun_family = AF_UNIX;
+  listen_name_len = offsetof(struct sockaddr_un, sun_path) + 1 +
+    sprintf(listen_name.sun_path + 1, "afl-desock-%d-%d", getpid(), fd);
+
+  if (real_bind(fd, (struct sockaddr*)&listen_name, listen_name_len))
+    return -1;
+
+  set_fake_addrs(addr, len);
+
+  listen_fd = fd;
+  fd_kind[fd] = DS_LISTEN;
+
+  /* Datagrams can be queued right away; connections have to wait for
+     listen(). */
+
+  if (listen_type == SOCK_DGRAM) arm_listener();
+
+  return 0;
+
+}
+
+
+int listen(int fd, int backlog) {
+
+  if (real_listen(fd, backlog)) return -1;
+
+  if (fd == listen_fd && listen_type == SOCK_STREAM && !served)
+    arm_listener();
+
+  return 0;
+
+}
+
+
+int accept4(int fd, struct sockaddr* addr, socklen_t* len, int flags) {
+
+  struct stat st;
+  s32 res;
+
+  if (fd != listen_fd || listen_fd < 0)
+    return real_accept4(fd, addr, len, flags);
+
+  /* A blocking server coming back for more is done with our input. An
+     event loop server just gets EAGAIN, and we wait for it to close the
+     connection instead. */
+
+  if (served && !(fcntl(fd, F_GETFL) & O_NONBLOCK)) _exit(0);
+
+  res = real_accept4(fd, NULL, NULL, flags);
+  if (res < 0) return res;
+
+  pthread_mutex_lock(&conn_lock);
+
+  if (res < DESOCK_MAX_FD) {
+
+    if (!fstat(res, &st)) conn_ino = st.st_ino;
+
+    fd_kind[res] = DS_CONN;
+    conn_fds++;
+
+  }
+
+  served = 1;
+
+  pthread_mutex_unlock(&conn_lock);
+
+  copy_addr(addr, len, &fake_peer);
+  return res;
+
+}
+
+
+int accept(int fd, struct sockaddr* addr, socklen_t* len) {
+
+  return accept4(fd, addr, len, 0);
+
+}
+
+
+int connect(int fd, const struct sockaddr* addr, socklen_t len) {
+
+  s32 sv[2], type, fl, fdf;
+  socklen_t tl = sizeof(s32);
+  struct stat st;
+
+  if (!is_target_addr(addr, len) || served || fd >= DESOCK_MAX_FD)
+    return real_connect(fd, addr, len);
+
+  /* A client: give it one end of a socketpair, and talk to it through the
+     other. */
+
+  if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &tl)) return -1;
+
+  fl  = fcntl(fd, F_GETFL);
+  fdf = fcntl(fd, F_GETFD);
+
+  if (socketpair(AF_UNIX, type | SOCK_CLOEXEC, 0, sv)) return -1;
+
+  if (dup2(sv[0], fd) < 0) return -1;
+  real_close(sv[0]);
+
+  fcntl(fd, F_SETFL, fl);
+  fcntl(fd, F_SETFD, fdf);
+
+  set_fake_addrs(addr, len);
+
+  /* The client is the peer here; it sees the target port on the far end. */
+
+  memcpy(&fake_peer, &fake_local, sizeof(fake_peer));
+
+  pthread_mutex_lock(&conn_lock);
+
+  if (!fstat(fd, &st)) conn_ino = st.st_ino;
+
+  fd_kind[fd] = DS_CONN;
+  conn_fds++;
+  served = 1;
+
+  pthread_mutex_unlock(&conn_lock);
+
+  /* A datagram socketpair is already connected, so the input just goes
+     out as one send(). */
+
+  if (type == SOCK_DGRAM) {
+
+    u32 len;
+    u8* buf = read_input(&len);
+
+    if (buf) send(sv[1], buf, len, MSG_NOSIGNAL);
+    free(buf);
+
+  }
+
+  start_pump(sv[1], type == SOCK_STREAM);
+  return 0;
+
+}
+
+
+int close(int fd) {
+
+  s32 res;
+
+  if (fd < 0 || fd >= DESOCK_MAX_FD || !fd_kind[fd]) return real_close(fd);
+
+  if (fd == listen_fd) listen_fd = -1;
+
+  if (fd_kind[fd] != DS_CONN) {
+    fd_kind[fd] = DS_NONE;
+    return real_close(fd);
+  }
+
+  pthread_mutex_lock(&conn_lock);
+
+  fd_kind[fd] = DS_NONE;
+  conn_fds--;
+
+  res = real_close(fd);
+
+  /* The helper thread already saw EOF, so the target had shut down its end
+     before; with the descriptor gone, it's done. */
+
+  if (served && !conn_fds && conn_eof) _exit(0);
+
+  pthread_mutex_unlock(&conn_lock);
+
+  return res;
+
+}
+
+
+/* UDP servers: the first read gets our datagram, the next means that the
+   target is done with it. Replies are addressed to the made-up peer, so
+   they need to be pointed back at the helper thread's socket. */
+
+ssize_t recvfrom(int fd, void* buf, size_t len, int flags,
+                 struct sockaddr* addr, socklen_t* alen) {
+
+  ssize_t res;
+
+  if (fd != listen_fd || listen_type != SOCK_DGRAM)
+    return real_recvfrom(fd, buf, len, flags, addr, alen);
+
+  if (dgram_reads++) _exit(0);
+
+  res = real_recvfrom(fd, buf, len, flags, NULL, NULL);
+  if (res >= 0) copy_addr(addr, alen, &fake_peer);
+
+  served = 1;
+  return res;
+
+}
+
+
+ssize_t recv(int fd, void* buf, size_t len, int flags) {
+
+  return recvfrom(fd, buf, len, flags, NULL, NULL);
+
+}
+
+
+ssize_t recvmsg(int fd, struct msghdr* msg, int flags) {
+
+  ssize_t res;
+  void* name;
+
+  if (fd != listen_fd || listen_type != SOCK_DGRAM)
+    return real_recvmsg(fd, msg, flags);
+
+  if (dgram_reads++) _exit(0);
+
+  name = msg->msg_name;
+  msg->msg_name = NULL;
+
+  res = real_recvmsg(fd, msg, flags);
+
+  msg->msg_name = name;
+  if (res >= 0) copy_addr(name, &msg->msg_namelen, &fake_peer);
+
+  served = 1;
+  return res;
+
+}
+
+
+ssize_t sendto(int fd, const void* buf, size_t len, int flags,
+               const struct sockaddr* addr, socklen_t alen) {
+
+  if (fd < 0 || fd >= DESOCK_MAX_FD || !fd_kind[fd])
+    return real_sendto(fd, buf, len, flags, addr, alen);
+
+  flags |= MSG_NOSIGNAL;
+
+  if (fd == listen_fd && listen_type == SOCK_DGRAM)
+    return real_sendto(fd, buf, len, flags, (struct sockaddr*)&peer_name,
+                       peer_name_len);
+
+  return real_sendto(fd, buf, len, flags, NULL, 0);
+
+}
+
+
+ssize_t sendmsg(int fd, const struct msghdr* msg, int flags) {
+
+  struct msghdr m;
+
+  if (fd < 0 || fd >= DESOCK_MAX_FD || !fd_kind[fd])
+    return real_sendmsg(fd, msg, flags);
+
+  m = *msg;
+
+  if (fd == listen_fd && listen_type == SOCK_DGRAM) {
+    m.msg_name    = &peer_name;
+    m.msg_namelen = peer_name_len;
+  } else {
+    m.msg_name    = NULL;
+    m.msg_namelen = 0;
+  }
+
+  return real_sendmsg(fd, &m, flags | MSG_NOSIGNAL);
+
+}
+
+
+/* The rest only needs to keep up appearances. */
+
+int getsockname(int fd, struct sockaddr* addr, socklen_t* len) {
+
+  static int (*real_gsn)(int, struct sockaddr*, socklen_t*);
+
+  if (fd >= 0 && fd < DESOCK_MAX_FD && fd_kind[fd]) {
+    copy_addr(addr, len, &fake_local);
+    return 0;
+  }
+
+  if (!real_gsn) real_gsn = dlsym(RTLD_NEXT, "getsockname");
+  return real_gsn(fd, addr, len);
+
+}
+
+
+int getpeername(int fd, struct sockaddr* addr, socklen_t* len) {
+
+  static int (*real_gpn)(int, struct sockaddr*, socklen_t*);
+
+  if (fd >= 0 && fd < DESOCK_MAX_FD && fd_kind[fd] == DS_CONN) {
+    copy_addr(addr, len, &fake_peer);
+    return 0;
+  }
+
+  if (!real_gpn) real_gpn = dlsym(RTLD_NEXT, "getpeername");
+  return real_gpn(fd, addr, len);
+
+}
+
+
+/* TCP_NODELAY, IPV6_V6ONLY and friends make no sense for AF_UNIX, but the
+   target shouldn't bail out over them. */
+
+int setsockopt(int fd, int level, int name, const void* val, socklen_t len) {
+
+  static int (*real_sso)(int, int, int, const void*, socklen_t);
+
+  if (!real_sso) real_sso = dlsym(RTLD_NEXT, "setsockopt");
+
+  if (fd >= 0 && fd < DESOCK_MAX_FD && fd_kind[fd]) {
+    if (level == SOL_SOCKET) real_sso(fd, level, name, val, len);
+    return 0;
+  }
+
+  return real_sso(fd, level, name, val, len);
+
+}
@@ -218,6 +218,31 @@ static void edit_params(u32 argc, char** argv) {
 #endif /* ^__APPLE__ */
     "_I(); } while (0)";
 
+  /* Shared memory test case delivery. The signature tells afl-fuzz to set
+     up the region; if it's not there (say, the binary is run by hand), the
+     macros evaluate to NULL / 0 and the harness should read the input the
+     usual way. */
+
+  cc_params[cc_par_cnt++] = "-D__AFL_FUZZ_TESTCASE_BUF="
+    "({ static volatile char *_S __attribute__((used)); "
+    " _S = (char*)\"" SHM_FUZZ_SIG "\"; "
+#ifdef __APPLE__
+    "extern unsigned char *_P __asm__(\"___afl_fuzz_ptr\"); "
+#else
+    "extern unsigned char *_P __asm__(\"__afl_fuzz_ptr\"); "
+#endif /* ^__APPLE__ */
+    "_P ? _P + 4 : (unsigned char*)0; })";
+
+  cc_params[cc_par_cnt++] = "-D__AFL_FUZZ_TESTCASE_LEN="
+    "({ static volatile char *_S __attribute__((used)); "
+    " _S = (char*)\"" SHM_FUZZ_SIG "\"; "
+#ifdef __APPLE__
+    "extern unsigned char *_P __asm__(\"___afl_fuzz_ptr\"); "
+#else
+    "extern unsigned char *_P __asm__(\"__afl_fuzz_ptr\"); "
+#endif /* ^__APPLE__ */
+    "_P ? *(unsigned int*)_P : 0; })";
+
   if (maybe_linking) {
 
     if (x_set) {
@@ -31,6 +31,18 @@
 #include <sys/shm.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+
+#ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+#endif /* !MSG_NOSIGNAL */
+
+#ifdef __linux__
+#  include <string.h>
+#  include <fcntl.h>
+#  include <ucontext.h>
+#  include <sys/syscall.h>
+#endif /* __linux__ */
 
 
 /* Globals needed by the injected instrumentation. The __afl_area_initial region
@@ -41,12 +53,598 @@ u8  __afl_area_initial[MAP_SIZE];
 u8* __afl_area_ptr = __afl_area_initial;
 u16 __afl_prev_loc;
 
+/* Test case SHM region (32-bit length, then data), if afl-fuzz provides one.
+   Harnesses get to it through __AFL_FUZZ_TESTCASE_BUF and _LEN. */
+
+u8* __afl_fuzz_ptr;
+
 
 /* Running in persistent mode? */
 
 static u8 is_persistent;
 
 
+/* Running in snapshot mode? */
+
+static u8 snapshot_req;
+
+
+#ifdef __linux__
+
+/* Snapshot mode. Instead of having the fork server clone the process for
+   every input, the child saves its writable memory right after fork(), runs
+   the target and, when the target calls exit(), rolls back just the pages
+   written to in the meantime, as reported by the kernel's soft-dirty bits.
+   It then talks to afl-fuzz the same way a persistent mode child does, and
+   resumes at the snapshot point. Crashes, hangs and _exit() calls simply end
+   the child, and the fork server makes a new one for the next input.
+
+   Everything that needs to survive a rollback lives in a separate mapping
+   that is never rolled back itself. */
+
+#define SNAP_PM_PRESENT  (1ULL << 63)
+#define SNAP_PM_SWAPPED  (1ULL << 62)
+#define SNAP_PM_DIRTY    (1ULL << 55)
+
+struct snap_region {
+  u8* start;                          /* Start of the mapping               */
+  u8* end;                            /* End of the mapping                 */
+  u8* data;                           /* Saved pages (NULL = not saved)     */
+  u8* present;                        /* Pages present at snapshot time     */
+};
+
+struct snap_state {
+
+  ucontext_t snap_ctx;                /* Where to resume after a rollback   */
+  ucontext_t exit_ctx;                /* Back into exit(), if rollback fails*/
+  ucontext_t restore_ctx;             /* Rollback code, on the stack below  */
+
+  struct snap_region reg[SNAP_MAX_REGIONS];
+  u32 reg_cnt;
+
+  struct snap_region cur[SNAP_MAX_REGIONS];
+  u32 cur_cnt;
+
+  u8* backup;                         /* Saved page contents                */
+  u64 backup_len, backup_used;
+
+  u8* brk;                            /* Program break at snapshot time     */
+  u8  fds[SNAP_MAX_FD / 8];           /* Descriptors open at snapshot time  */
+  s32 dir_fd;                         /* Descriptor used by snap_walk_dir() */
+
+  s32 pagemap_fd, clear_fd;
+  u32 page_size;
+  s32 pid;
+  u8  taken, failed;
+  int status;
+
+  u8  buf[SNAP_BUF_SIZE];
+  u8  stack[SNAP_STACK_SIZE];
+
+};
+
+static struct snap_state* snap;
+
+
+/* Give up on snapshot mode and free up everything it used. */
+
+static void snap_drop(void) {
+
+  if (snap->pagemap_fd >= 0) close(snap->pagemap_fd);
+  if (snap->clear_fd >= 0) close(snap->clear_fd);
+
+  if (snap->backup && snap->backup != MAP_FAILED)
+    munmap(snap->backup, snap->backup_len);
+
+  munmap(snap, sizeof(struct snap_state));
+  snap = NULL;
+
+}
+
+
+/* Reset soft-dirty bits for the whole process. */
+
+static u8 snap_clear_refs(void) {
+
+  return pwrite(snap->clear_fd, "4", 1, 0) == 1;
+
+}
+
+
+/* Read pagemap entries for cnt pages starting at addr. */
+
+static u8 snap_pagemap(u8* addr, u32 cnt, u64* out) {
+
+  s64 len = cnt * 8;
+  u64 off = (u64)addr / snap->page_size * 8;
+
+  return pread(snap->pagemap_fd, out, len, off) == len;
+
+}
+
+
+/* Walk /proc/self/maps, calling cb() for every mapping. Returns 0 on
+   failure. Sticks to raw reads and no allocations, since it also runs in
+   the middle of exit(). */
+
+static u8 snap_read_maps(void (*cb)(u8*, u8*, u8*)) {
+
+  s32 fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  u32 have = 0;
+
+  if (fd < 0) return 0;
+
+  while (1) {
+
+    s32 len = read(fd, snap->buf + have, SNAP_BUF_SIZE - have - 1);
+    u8 *ptr = snap->buf, *nl;
+
+    if (len < 0) { close(fd); return 0; }
+    if (!len) break;
+
+    have += len;
+    snap->buf[have] = 0;
+
+    while ((nl = (u8*)strchr((char*)ptr, '\n'))) {
+
+      u8 *start, *end;
+
+      start = (u8*)strtoull((char*)ptr, (char**)&ptr, 16);
+      end   = (u8*)strtoull((char*)ptr + 1, (char**)&ptr, 16);
+
+      cb(start, end, ptr + 1);
+
+      ptr = nl + 1;
+
+    }
+
+    have -= ptr - snap->buf;
+    memmove(snap->buf, ptr, have);
+
+    if (have == SNAP_BUF_SIZE - 1) { close(fd); return 0; }
+
+  }
+
+  close(fd);
+  return 1;
+
+}
+
+
+/* Walk the numeric entries of a /proc directory, calling cb() for each.
+   Returns the number of entries, or 0 on failure. */
+
+static u32 snap_walk_dir(const char* path, void (*cb)(u32)) {
+
+  u32 cnt = 0;
+
+  snap->dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (snap->dir_fd < 0) return 0;
+
+  while (1) {
+
+    s32 len = syscall(SYS_getdents64, snap->dir_fd, snap->buf, SNAP_BUF_SIZE);
+    s32 pos = 0;
+
+    if (len <= 0) break;
+
+    while (pos < len) {
+
+      /* struct linux_dirent64: d_ino, d_off, d_reclen, d_type, d_name. */
+
+      u8* name = snap->buf + pos + 19;
+
+      if (*name >= '0' && *name <= '9') {
+        if (cb) cb(atoi((char*)name));
+        cnt++;
+      }
+
+      pos += *(u16*)(snap->buf + pos + 16);
+
+    }
+
+  }
+
+  close(snap->dir_fd);
+  snap->dir_fd = -1;
+
+  return cnt;
+
+}
+
+
+/* Callbacks used to take the snapshot. */
+
+static void snap_count_pages(u8* start, u8* end, u8* perms) {
+
+  u64 pages = (end - start) / snap->page_size;
+
+  if (perms[0] != 'r' || perms[1] != 'w' || perms[3] != 'p') return;
+
+  snap->backup_len += pages * snap->page_size +
+                      (pages / 8 + snap->page_size) / snap->page_size *
+                      snap->page_size;
+
+}
+
+
+static void snap_add_region(u8* start, u8* end, u8 save) {
+
+  struct snap_region* r;
+  u64 pages = (end - start) / snap->page_size;
+
+  if (start >= end) return;
+
+  if (snap->reg_cnt == SNAP_MAX_REGIONS) {
+    snap->failed = 1;
+    return;
+  }
+
+  r = &snap->reg[snap->reg_cnt++];
+
+  r->start = start;
+  r->end   = end;
+
+  if (!save) {
+    r->data = r->present = NULL;
+    return;
+  }
+
+  r->data    = snap->backup + snap->backup_used;
+  r->present = r->data + pages * snap->page_size;
+
+  snap->backup_used += pages * snap->page_size +
+                       (pages / 8 + snap->page_size) / snap->page_size *
+                       snap->page_size;
+
+  if (snap->backup_used > snap->backup_len) snap->failed = 1;
+
+}
+
+
+static void snap_record_mapping(u8* start, u8* end, u8* perms) {
+
+  u8* skip[2][2] = {
+    { (u8*)snap, (u8*)snap + sizeof(struct snap_state) },
+    { snap->backup, snap->backup + snap->backup_len }
+  };
+
+  u8 save = perms[0] == 'r' && perms[1] == 'w' && perms[3] == 'p';
+  u32 i;
+
+  if (skip[0][0] > skip[1][0]) {
+    u8* tmp[2] = { skip[0][0], skip[0][1] };
+    skip[0][0] = skip[1][0]; skip[0][1] = skip[1][1];
+    skip[1][0] = tmp[0];     skip[1][1] = tmp[1];
+  }
+
+  /* Our own state and the backup itself are kept, but never saved. These
+     may have been merged with neighboring mappings, so split around them. */
+
+  for (i = 0; i < 2; i++) {
+
+    if (skip[i][1] <= start || skip[i][0] >= end) continue;
+
+    if (skip[i][0] > start) snap_add_region(start, skip[i][0], save);
+
+    snap_add_region(start > skip[i][0] ? start : skip[i][0],
+                    end < skip[i][1] ? end : skip[i][1], 0);
+
+    start = skip[i][1];
+    if (start >= end) return;
+
+  }
+
+  snap_add_region(start, end, save);
+
+}
+
+
+static void snap_record_fd(u32 fd) {
+
+  if (fd < SNAP_MAX_FD && fd != snap->dir_fd) snap->fds[fd / 8] |= 1 << (fd % 8);
+
+}
+
+
+/* Save the writable memory of the process. */
+
+static u8 snap_take(void) {
+
+  u64 pm[512];
+  u32 i;
+
+  snap->pid = getpid();
+  snap->brk = (u8*)syscall(SYS_brk, 0);
+
+  /* Pass one: figure out how much room we need and grab it. The backup is
+     sparse; only pages that are actually present get copied. */
+
+  if (!snap_read_maps(snap_count_pages)) return 0;
+
+  snap->backup_len += 4 * snap->page_size;
+  snap->backup = mmap(NULL, snap->backup_len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (snap->backup == MAP_FAILED) return 0;
+
+  /* Pass two: record all mappings, including the backup we just made. */
+
+  if (!snap_read_maps(snap_record_mapping) || snap->failed) return 0;
+
+  for (i = 0; i < snap->reg_cnt; i++) {
+
+    struct snap_region* r = &snap->reg[i];
+    u32 pages = (r->end - r->start) / snap->page_size, j, k;
+
+    if (!r->data) continue;
+
+    for (j = 0; j < pages; j += 512) {
+
+      u32 cnt = pages - j > 512 ? 512 : pages - j;
+
+      if (!snap_pagemap(r->start + j * snap->page_size, cnt, pm)) return 0;
+
+      for (k = 0; k < cnt; k++) {
+
+        u32 pg = j + k;
+
+        if (!(pm[k] & (SNAP_PM_PRESENT | SNAP_PM_SWAPPED))) continue;
+
+        r->present[pg / 8] |= 1 << (pg % 8);
+        memcpy(r->data + pg * snap->page_size,
+               r->start + pg * snap->page_size, snap->page_size);
+
+      }
+
+    }
+
+  }
+
+  if (!snap_walk_dir("/proc/self/fd", snap_record_fd)) return 0;
+
+  return snap_clear_refs();
+
+}
+
+
+/* Callbacks used to roll back. */
+
+static void snap_record_current(u8* start, u8* end, u8* perms) {
+
+  struct snap_region* r;
+
+  if (snap->cur_cnt == SNAP_MAX_REGIONS) {
+    snap->failed = 1;
+    return;
+  }
+
+  r = &snap->cur[snap->cur_cnt++];
+
+  r->start = start;
+  r->end   = end;
+  r->data  = (perms[0] == 'r' && perms[1] == 'w' && perms[3] == 'p') ?
+             start : NULL;
+
+}
+
+
+static void snap_close_fd(u32 fd) {
+
+  if (fd == snap->dir_fd || fd >= SNAP_MAX_FD) return;
+  if (!(snap->fds[fd / 8] & (1 << (fd % 8)))) close(fd);
+
+}
+
+
+/* Check that the memory layout still allows a rollback. Changes nothing if
+   it doesn't. */
+
+static u8 snap_can_restore(void) {
+
+  u32 i, j = 0;
+
+  /* Threads would be left running on top of memory we're rewinding. */
+
+  if (snap_walk_dir("/proc/self/task", NULL) != 1) return 0;
+
+  snap->cur_cnt = 0;
+  snap->failed  = 0;
+
+  if (!snap_read_maps(snap_record_current) || snap->failed) return 0;
+
+  /* Every saved region must still be there, readable and writable. */
+
+  for (i = 0; i < snap->reg_cnt; i++) {
+
+    struct snap_region* r = &snap->reg[i];
+    u8* pos = r->start;
+
+    if (!r->data) continue;
+
+    while (j < snap->cur_cnt && snap->cur[j].end <= pos) j++;
+
+    while (j < snap->cur_cnt && pos < r->end && snap->cur[j].data &&
+           snap->cur[j].start <= pos) pos = snap->cur[j++].end;
+
+    if (pos < r->end) return 0;
+
+    /* The next region may start within the last mapping we looked at. */
+
+    if (j) j--;
+
+  }
+
+  return 1;
+
+}
+
+
+/* Roll back memory, mappings, program break and descriptors. */
+
+static void snap_restore(void) {
+
+  u64 pm[512];
+  u32 i, j, k;
+
+  syscall(SYS_brk, snap->brk);
+
+  /* Unmap anything that wasn't there before. */
+
+  for (i = 0, j = 0; i < snap->cur_cnt; i++) {
+
+    u8 *pos = snap->cur[i].start, *end = snap->cur[i].end;
+
+    while (j < snap->reg_cnt && snap->reg[j].end <= pos) j++;
+
+    for (k = j; k < snap->reg_cnt && snap->reg[k].start < end; k++) {
+
+      if (snap->reg[k].start > pos)
+        munmap(pos, snap->reg[k].start - pos);
+
+      if (snap->reg[k].end > pos) pos = snap->reg[k].end;
+
+    }
+
+    if (pos < end) munmap(pos, end - pos);
+
+  }
+
+  /* Put back the dirty pages. Pages that weren't there to begin with are
+     simply dropped; they'll come back zeroed or fresh from the file. */
+
+  for (i = 0; i < snap->reg_cnt; i++) {
+
+    struct snap_region* r = &snap->reg[i];
+    u32 pages = (r->end - r->start) / snap->page_size;
+
+    if (!r->data) continue;
+
+    for (j = 0; j < pages; j += 512) {
+
+      u32 cnt = pages - j > 512 ? 512 : pages - j;
+
+      if (!snap_pagemap(r->start + j * snap->page_size, cnt, pm)) _exit(1);
+
+      for (k = 0; k < cnt; k++) {
+
+        u32 pg = j + k;
+        u8* addr = r->start + pg * snap->page_size;
+
+        if (!(pm[k] & SNAP_PM_DIRTY)) continue;
+
+        if (r->present[pg / 8] & (1 << (pg % 8)))
+          memcpy(addr, r->data + pg * snap->page_size, snap->page_size);
+        else
+          madvise(addr, snap->page_size, MADV_DONTNEED);
+
+      }
+
+    }
+
+  }
+
+  snap_walk_dir("/proc/self/fd", snap_close_fd);
+
+  if (!snap_clear_refs()) _exit(1);
+
+}
+
+
+/* Runs on our own stack when the target calls exit(). */
+
+static void snap_rollback(void) {
+
+  u32 status;
+  s32 pid;
+
+  if (!snap_can_restore()) setcontext(&snap->exit_ctx);
+
+  snap_restore();
+
+  /* Tell afl-fuzz how it went, just like a persistent mode child would,
+     then wait for the next input and start over. */
+
+  status = FORKSRV_PERSIST_TAG | ((snap->status & 0xff) << 8);
+  pid    = snap->pid;
+
+  if (write(FORKSRV_FD + 1, &status, 4) != 4) _exit(1);
+  if (read(FORKSRV_FD, &status, 4) != 4) _exit(1);
+  if (write(FORKSRV_FD + 1, &pid, 4) != 4) _exit(1);
+
+  setcontext(&snap->snap_ctx);
+
+  _exit(1);
+
+}
+
+
+static void snap_on_exit(int status, void* arg) {
+
+  /* Not in the snapshot child, or in a process it spawned? */
+
+  if (!snap || !snap->taken || getpid() != snap->pid) return;
+
+  snap->status = status;
+  swapcontext(&snap->exit_ctx, &snap->restore_ctx);
+
+  /* Only get here if the rollback isn't possible; let exit() carry on. */
+
+}
+
+
+/* Set up snapshot mode in a fresh child. Returns 0 if soft-dirty tracking
+   is not available, or anything else goes wrong. */
+
+static u8 snap_init(void) {
+
+  u64 pm;
+
+  snap = mmap(NULL, sizeof(struct snap_state), PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (snap == MAP_FAILED) {
+    snap = NULL;
+    return 0;
+  }
+
+  snap->page_size  = sysconf(_SC_PAGESIZE);
+  snap->dir_fd     = -1;
+  snap->pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  snap->clear_fd   = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+
+  if (snap->pagemap_fd < 0 || snap->clear_fd < 0) goto fail;
+
+  /* Make sure the kernel actually tracks soft-dirty bits. */
+
+  if (!snap_clear_refs()) goto fail;
+
+  snap->buf[0] = 1;
+
+  if (!snap_pagemap(snap->buf, 1, &pm) || !(pm & SNAP_PM_DIRTY)) goto fail;
+
+  if (getcontext(&snap->restore_ctx)) goto fail;
+
+  snap->restore_ctx.uc_stack.ss_sp   = snap->stack;
+  snap->restore_ctx.uc_stack.ss_size = SNAP_STACK_SIZE;
+  snap->restore_ctx.uc_link          = NULL;
+
+  makecontext(&snap->restore_ctx, snap_rollback, 0);
+
+  if (on_exit(snap_on_exit, NULL)) goto fail;
+
+  return 1;
+
+fail:
+
+  snap_drop();
+  return 0;
+
+}
+
+#endif /* __linux__ */
+
+
 /* SHM setup. */
 
 static void __afl_map_shm(void) {
@@ -74,6 +672,19 @@ static void __afl_map_shm(void) {
 
   }
 
+  id_str = getenv(SHM_FUZZ_ENV_VAR);
+
+  /* The test case region is optional; if we can't get it, the harness will
+     fall back to reading the input file, and afl-fuzz will keep writing it. */
+
+  if (id_str) {
+
+    u8* ptr = shmat(atoi(id_str), NULL, 0);
+
+    if (ptr != (void *)-1) __afl_fuzz_ptr = ptr;
+
+  }
+
 }
 
 
@@ -81,84 +692,149 @@ static void __afl_map_shm(void) {
 
 static void __afl_start_forkserver(void) {
 
-  static u8 tmp[4];
-  s32 child_pid;
+  u32 hello = __afl_fuzz_ptr ? FORKSRV_OPT_SHM_FUZZ : 0;
+  s32 child_pid, parked_pid = 0, rel_fds[2];
+  u8  prefork = !!getenv(PREFORK_ENV_VAR), keep_fds = is_persistent;
+
+  /* A child that goes on to talk to afl-fuzz directly sends its PID on its
+     own; if we did it, the write could land after the child's first report. */
 
-  u8  child_stopped = 0;
+  u8  child_reports = is_persistent || snapshot_req;
 
   /* Phone home and tell the parent that we're OK. If parent isn't there,
-     assume we're not running in forkserver mode and just execute program. */
+     assume we're not running in forkserver mode and just execute program;
+     this also means that there is nobody to run persistent mode with. */
 
-  if (write(FORKSRV_FD + 1, tmp, 4) != 4) return;
+  if (write(FORKSRV_FD + 1, &hello, 4) != 4) {
+    is_persistent = 0;
+    return;
+  }
 
   while (1) {
 
     u32 was_killed;
     int status;
 
+    /* With pre-forking, the next child is created while afl-fuzz is still
+       busy with the results of the previous one, and parked on a socket
+       until we get the go-ahead. If we go away instead, so does the child. */
+
+    if (prefork && !parked_pid) {
+
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, rel_fds)) {
+
+        prefork = 0;
+
+      } else {
+
+        parked_pid = fork();
+        if (parked_pid < 0) _exit(1);
+
+        if (!parked_pid) {
+
+          u8 tmp;
+
+          close(rel_fds[0]);
+          if (read(rel_fds[1], &tmp, 1) != 1) _exit(0);
+          close(rel_fds[1]);
+
+          break;
+
+        }
+
+        close(rel_fds[1]);
+
+      }
+
+    }
+
     /* Wait for parent by reading from the pipe. Abort if read fails. */
 
     if (read(FORKSRV_FD, &was_killed, 4) != 4) _exit(1);
 
-    /* If we stopped the child in persistent mode, but there was a race
-       condition and afl-fuzz already issued SIGKILL, write off the old
-       process. */
+    /* Release the parked child. If it's gone in the meantime, reap it and
+       fall back to a regular fork(). Its PID goes out only afterwards, so
+       that we don't report a child that no longer exists; this is safe, as
+       a child that writes to the status pipe at all sends its PID first. */
+
+    child_pid = 0;
+
+    if (parked_pid) {
+
+      if (send(rel_fds[0], "", 1, MSG_NOSIGNAL) == 1) child_pid = parked_pid;
+      else waitpid(parked_pid, NULL, 0);
+
+      close(rel_fds[0]);
+      parked_pid = 0;
 
-    if (child_stopped && was_killed) {
-      child_stopped = 0;
-      if (waitpid(child_pid, &status, 0) < 0) _exit(1);
     }
 
-    if (!child_stopped) {
+    /* Once woken up, create a clone of our process. */
 
-      /* Once woken up, create a clone of our process. */
+    if (!child_pid) {
 
       child_pid = fork();
       if (child_pid < 0) _exit(1);
 
-      /* In child process: close fds, resume execution. */
+      if (!child_pid) break;
 
-      if (!child_pid) {
+    }
 
-        close(FORKSRV_FD);
-        close(FORKSRV_FD + 1);
-        return;
-  
-      }
+    /* In parent process: write PID to pipe, then wait for child. A persistent
+       mode child will go through any number of inputs on its own; we only
+       get to hear from it once it's dead - crashed, killed on a timeout, or
+       done with its iteration count. */
 
-    } else {
+    if (!child_reports && write(FORKSRV_FD + 1, &child_pid, 4) != 4) _exit(1);
 
-      /* Special handling for persistent mode: if the child is alive but
-         currently stopped, simply restart it with SIGCONT. */
+    if (waitpid(child_pid, &status, 0) < 0) _exit(1);
 
-      kill(child_pid, SIGCONT);
-      child_stopped = 0;
+    /* Relay wait status to pipe, then loop back. */
 
-    }
+    if (write(FORKSRV_FD + 1, &status, 4) != 4) _exit(1);
 
-    /* In parent process: write PID to pipe, then wait for child. */
+  }
 
-    if (write(FORKSRV_FD + 1, &child_pid, 4) != 4) _exit(1);
+  /* In child process: close fds, resume execution. In persistent mode,
+     the child keeps them, because it reports to afl-fuzz directly. */
 
-    if (waitpid(child_pid, &status, is_persistent ? WUNTRACED : 0) < 0)
-      _exit(1);
+  if (child_reports) {
 
-    /* In persistent mode, the child stops itself with SIGSTOP to indicate
-       a successful run. In this case, we want to wake it up without forking
-       again. */
+    s32 pid = getpid();
+    if (write(FORKSRV_FD + 1, &pid, 4) != 4) _exit(1);
 
-    if (WIFSTOPPED(status)) child_stopped = 1;
+  }
 
-    /* Relay wait status to pipe, then loop back. */
+#ifdef __linux__
 
-    if (write(FORKSRV_FD + 1, &status, 4) != 4) _exit(1);
+  /* In snapshot mode, the target resumes right here after every rollback. */
+
+  if (snapshot_req && !is_persistent && snap_init()) {
+
+    getcontext(&snap->snap_ctx);
 
+    if (!snap->taken) {
+      if (snap_take()) snap->taken = 1; else snap_drop();
+    }
+
+    keep_fds = !!snap;
+
+  }
+
+#endif /* __linux__ */
+
+  if (!keep_fds) {
+    close(FORKSRV_FD);
+    close(FORKSRV_FD + 1);
   }
 
 }
 
 
-/* A simplified persistent mode handler, used as explained in README.llvm. */
+/* A simplified persistent mode handler, used as explained in README.llvm.
+   At the end of every iteration, we tell afl-fuzz that the input went
+   through fine, wait for the next one, and hand back our PID - the same
+   exchange the fork server would otherwise perform for a new child. */
 
 int __afl_persistent_loop(unsigned int max_cnt) {
 
@@ -175,7 +851,14 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
   if (is_persistent && --cycle_cnt) {
 
-    raise(SIGSTOP);
+    u32 status = FORKSRV_PERSIST_TAG, was_killed;
+    s32 pid = getpid();
+
+    if (write(FORKSRV_FD + 1, &status, 4) != 4) _exit(1);
+    if (read(FORKSRV_FD, &was_killed, 4) != 4) _exit(1);
+    if (write(FORKSRV_FD + 1, &pid, 4) != 4) _exit(1);
+
+    __afl_prev_loc = 0;
     return 1;
 
   } else return 0;
@@ -206,6 +889,7 @@ void __afl_manual_init(void) {
 __attribute__((constructor(0))) void __afl_auto_init(void) {
 
   is_persistent = !!getenv(PERSIST_ENV_VAR);
+  snapshot_req  = !!getenv("AFL_SNAPSHOT");
 
   if (getenv(DEFER_ENV_VAR)) return;
 
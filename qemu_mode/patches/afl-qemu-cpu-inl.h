@@ -82,6 +82,10 @@ abi_ulong afl_entry_point, /* ELF entry point (_start) */
 static unsigned char afl_fork_child;
 unsigned int afl_forksrv_pid;
 
+/* Test case SHM region, for the network emulation in afl-qemu-net-inl.h: */
+
+unsigned char *afl_net_input;
+
 /* Instrumentation ratio: */
 
 static unsigned int afl_inst_rms = MAP_SIZE;
@@ -167,6 +171,20 @@ static void afl_setup(void) {
     }
 #endif
 
+  /* With AFL_DESOCK, afl-fuzz hands us the test case in memory; the
+     syscall layer serves it to the guest in place of the network. */
+
+  id_str = getenv(SHM_FUZZ_ENV_VAR);
+
+  if (id_str && getenv(DESOCK_ENV_VAR)) {
+
+    shm_id = atoi(id_str);
+    afl_net_input = shmat(shm_id, NULL, SHM_RDONLY);
+
+    if (afl_net_input == (void*)-1) exit(1);
+
+  }
+
   if (getenv("AFL_INST_LIBS")) {
 
     afl_start_code = 0;
@@ -182,13 +200,14 @@ static void afl_setup(void) {
 static void afl_forkserver(CPUArchState *env) {
 
   static unsigned char tmp[4];
+  unsigned int hello = afl_net_input ? FORKSRV_OPT_SHM_FUZZ : 0;
 
   if (!afl_area_ptr) return;
 
   /* Tell the parent that we're alive. If the parent doesn't want
      to talk, assume that we're not running in forkserver mode. */
 
-  if (write(FORKSRV_FD + 1, tmp, 4) != 4) return; //写给afl的forkserver,失败就返回,表示存活
+  if (write(FORKSRV_FD + 1, &hello, 4) != 4) return; //写给afl的forkserver,失败就返回,表示存活
 
   afl_forksrv_pid = getpid(); //当前pid,即子进程的pid
 
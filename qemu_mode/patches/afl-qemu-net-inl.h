@@ -0,0 +1,608 @@
+/*
+   american fuzzy lop - network emulation for binary-only targets
+   --------------------------------------------------------------
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   This code is a shim patched into linux-user/syscall.c. It does for QEMU
+   what libdesock does for natively built targets: when afl-fuzz runs with
+   -Q, -N and AFL_DESOCK, it names the port in __AFL_DESOCK ("tcp:<port>" or
+   "udp:<port>"), and the guest's sockets on that port are quietly swapped
+   for AF_UNIX sockets in the abstract namespace.
+
+   The guest is handed a single connection (or datagram) carrying the test
+   case, which comes straight from the SHM region mapped in afl_setup(); if
+   that isn't available, it is read from stdin. Replies are read and thrown
+   away by a host thread. The guest is made to exit once it has handled the
+   input: when it comes back to a blocking accept(), asks for a second
+   datagram, or closes the connection.
+
+   Guest descriptors are host descriptors in linux-user, so everything past
+   accept() - read(), write(), poll() and friends - just works on the real
+   AF_UNIX socket. The hooks below take and return host values, with errors
+   reported through errno; the callers in syscall.c do the rest.
+
+*/
+
+#include <stddef.h>
+#include <pthread.h>
+#include "../../config.h"
+
+/* Set up by afl_setup() in afl-qemu-cpu-inl.h: */
+
+extern unsigned char *afl_net_input;
+
+/* Per-descriptor state. */
+
+#define AFL_NET_NONE    0               /* Not ours                         */
+#define AFL_NET_LISTEN  1               /* Took over the target port        */
+#define AFL_NET_CONN    2               /* Connection carrying the input    */
+
+static unsigned char afl_net_kind[DESOCK_MAX_FD];
+
+static unsigned short afl_net_port;     /* Port to take over, 0 = disabled  */
+static unsigned char  afl_net_init_done,
+                      afl_net_served;   /* Input handed over in this proc   */
+
+static int afl_net_listen_fd = -1,      /* Replacement listener, if any     */
+           afl_net_listen_type;         /* SOCK_STREAM or SOCK_DGRAM        */
+
+static unsigned int afl_net_dgram_reads;
+
+static struct sockaddr_un afl_net_listen_name, afl_net_peer_name;
+static socklen_t afl_net_listen_name_len, afl_net_peer_name_len;
+
+/* What the guest gets to see instead of AF_UNIX addresses. */
+
+static struct sockaddr_storage afl_net_fake_local, afl_net_fake_peer;
+static socklen_t afl_net_fake_len;
+
+
+/* Parse __AFL_DESOCK on first use. */
+
+static void afl_net_init(void) {
+
+  char *spec = getenv(DESOCK_ENV_VAR);
+  unsigned int port;
+
+  afl_net_init_done = 1;
+
+  if (!spec || (strncmp(spec, "tcp:", 4) && strncmp(spec, "udp:", 4)) ||
+      sscanf(spec + 4, "%u", &port) != 1 || !port || port > 65535)
+    return;
+
+  afl_net_port = port;
+
+}
+
+
+/* Get hold of the test case. The SHM region holds a 32-bit length followed
+   by the data; stdin is read with pread(), which leaves the file offset
+   shared with afl-fuzz alone. *own tells the caller to free() the buffer. */
+
+static unsigned char *afl_net_get_input(unsigned int *len, unsigned char *own) {
+
+  unsigned int size = 4096, got = 0;
+  unsigned char *buf;
+  ssize_t res;
+
+  if (afl_net_input) {
+
+    *len = *(unsigned int *)afl_net_input;
+    if (*len > MAX_FILE) *len = MAX_FILE;
+
+    *own = 0;
+    return afl_net_input + 4;
+
+  }
+
+  buf  = malloc(size);
+  *own = 1;
+
+  while (buf) {
+
+    res = pread(0, buf + got, size - got, got);
+    if (res <= 0) break;
+
+    got += res;
+
+    if (got == size) {
+      if (size >= MAX_FILE) break;
+      size *= 2;
+      buf = realloc(buf, size);
+    }
+
+  }
+
+  *len = got;
+  return buf;
+
+}
+
+
+/* Host thread: for connections, send the test case, signal EOF, and throw
+   away anything the guest writes back. If the guest closes its end after
+   it has been handed the input, it's done with it. For datagrams, the input
+   is already on its way; just keep the replies from piling up. */
+
+static void *afl_net_pump(void *arg) {
+
+  int fd = (int)(long)arg & 0xffff;
+  unsigned char stream = !!((long)arg & 0x10000), own, *buf, tmp[4096];
+  unsigned int len, off = 0;
+  ssize_t res;
+  sigset_t all;
+
+  /* Guest signals must land on the CPU thread. */
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+  if (!stream) {
+
+    while (recv(fd, tmp, sizeof(tmp), 0) >= 0 || errno == EINTR);
+    return NULL;
+
+  }
+
+  buf = afl_net_get_input(&len, &own);
+
+  while (buf && off < len) {
+
+    res = send(fd, buf + off, len - off, MSG_NOSIGNAL);
+
+    if (res < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+
+    off += res;
+
+  }
+
+  if (own) free(buf);
+  shutdown(fd, SHUT_WR);
+
+  while ((res = recv(fd, tmp, sizeof(tmp), 0)) > 0 ||
+         (res < 0 && errno == EINTR));
+
+  if (afl_net_served) _exit(0);
+
+  return NULL;
+
+}
+
+
+static void afl_net_start_pump(int fd, unsigned char stream) {
+
+  pthread_t t;
+
+  if (pthread_create(&t, NULL, afl_net_pump,
+                     (void *)(long)(fd | (stream ? 0x10000 : 0)))) abort();
+  pthread_detach(t);
+
+}
+
+
+/* Queue up a connection (or a datagram) with the test case on the
+   replacement listener. */
+
+static void afl_net_arm_listener(void) {
+
+  unsigned char own, *buf;
+  unsigned int len;
+  int fd;
+
+  if (afl_net_listen_type == SOCK_STREAM) {
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) abort();
+
+    if (connect(fd, (struct sockaddr *)&afl_net_listen_name,
+                afl_net_listen_name_len)) abort();
+
+    afl_net_start_pump(fd, 1);
+    return;
+
+  }
+
+  /* The guest needs an address to reply to. */
+
+  fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) abort();
+
+  memset(&afl_net_peer_name, 0, sizeof(afl_net_peer_name));
+  afl_net_peer_name.sun_family = AF_UNIX;
+  afl_net_peer_name_len = offsetof(struct sockaddr_un, sun_path) + 1 +
+    sprintf(afl_net_peer_name.sun_path + 1, "afl-qemu-net-%d-peer", getpid());
+
+  if (bind(fd, (struct sockaddr *)&afl_net_peer_name, afl_net_peer_name_len))
+    abort();
+
+  buf = afl_net_get_input(&len, &own);
+
+  if (buf) sendto(fd, buf, len, MSG_NOSIGNAL,
+                  (struct sockaddr *)&afl_net_listen_name,
+                  afl_net_listen_name_len);
+  if (own) free(buf);
+
+  afl_net_start_pump(fd, 0);
+
+}
+
+
+/* Is this an address on the port we're taking over? */
+
+static int afl_net_is_target(const struct sockaddr *addr, socklen_t len) {
+
+  if (!afl_net_init_done) afl_net_init();
+
+  if (!afl_net_port || !addr) return 0;
+
+  if (addr->sa_family == AF_INET && len >= sizeof(struct sockaddr_in))
+    return ntohs(((struct sockaddr_in *)addr)->sin_port) == afl_net_port;
+
+  if (addr->sa_family == AF_INET6 && len >= sizeof(struct sockaddr_in6))
+    return ntohs(((struct sockaddr_in6 *)addr)->sin6_port) == afl_net_port;
+
+  return 0;
+
+}
+
+
+static int afl_net_ours(int fd) {
+
+  return fd >= 0 && fd < DESOCK_MAX_FD && afl_net_kind[fd];
+
+}
+
+
+/* Remember the address the guest asked for, and make up a loopback peer of
+   the same family for it to talk to. */
+
+static void afl_net_set_fake_addrs(const struct sockaddr *addr,
+                                   socklen_t len) {
+
+  memset(&afl_net_fake_local, 0, sizeof(afl_net_fake_local));
+  memset(&afl_net_fake_peer, 0, sizeof(afl_net_fake_peer));
+
+  memcpy(&afl_net_fake_local, addr, len);
+  afl_net_fake_len = len;
+
+  if (addr->sa_family == AF_INET) {
+
+    struct sockaddr_in *p = (struct sockaddr_in *)&afl_net_fake_peer;
+
+    p->sin_family      = AF_INET;
+    p->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    p->sin_port        = htons(DESOCK_PEER_PORT);
+
+  } else {
+
+    struct sockaddr_in6 *p = (struct sockaddr_in6 *)&afl_net_fake_peer;
+
+    p->sin6_family = AF_INET6;
+    p->sin6_addr   = in6addr_loopback;
+    p->sin6_port   = htons(DESOCK_PEER_PORT);
+
+  }
+
+}
+
+
+static void afl_net_copy_addr(struct sockaddr *dst, socklen_t *len,
+                              struct sockaddr_storage *src) {
+
+  if (!dst || !len) return;
+
+  memcpy(dst, src, *len < afl_net_fake_len ? *len : afl_net_fake_len);
+  *len = afl_net_fake_len;
+
+}
+
+
+/* Swap fd for a fresh AF_UNIX socket of the same type, keeping its flags. */
+
+static int afl_net_replace_fd(int fd, int *type) {
+
+  socklen_t tl = sizeof(int);
+  int fl = fcntl(fd, F_GETFL), fdf = fcntl(fd, F_GETFD), nfd;
+
+  if (getsockopt(fd, SOL_SOCKET, SO_TYPE, type, &tl)) return -1;
+
+  nfd = socket(AF_UNIX, *type, 0);
+  if (nfd < 0) return -1;
+
+  if (dup2(nfd, fd) < 0) {
+    close(nfd);
+    return -1;
+  }
+
+  close(nfd);
+
+  fcntl(fd, F_SETFL, fl);
+  fcntl(fd, F_SETFD, fdf);
+
+  return fd;
+
+}
+
+
+static int afl_net_bind(int fd, struct sockaddr *addr, socklen_t len) {
+
+  if (!afl_net_is_target(addr, len) || afl_net_listen_fd >= 0 ||
+      fd >= DESOCK_MAX_FD)
+    return bind(fd, addr, len);
+
+  if (afl_net_replace_fd(fd, &afl_net_listen_type) < 0) return -1;
+
+  memset(&afl_net_listen_name, 0, sizeof(afl_net_listen_name));
+  afl_net_listen_name.sun_family = AF_UNIX;
+  afl_net_listen_name_len = offsetof(struct sockaddr_un, sun_path) + 1 +
+    sprintf(afl_net_listen_name.sun_path + 1, "afl-qemu-net-%d-%d",
+            getpid(), fd);
+
+  if (bind(fd, (struct sockaddr *)&afl_net_listen_name,
+           afl_net_listen_name_len))
+    return -1;
+
+  afl_net_set_fake_addrs(addr, len);
+
+  afl_net_listen_fd = fd;
+  afl_net_kind[fd]  = AFL_NET_LISTEN;
+
+  /* Datagrams can be queued right away; connections have to wait for
+     listen(). */
+
+  if (afl_net_listen_type == SOCK_DGRAM) afl_net_arm_listener();
+
+  return 0;
+
+}
+
+
+static int afl_net_listen(int fd, int backlog) {
+
+  if (listen(fd, backlog)) return -1;
+
+  if (fd == afl_net_listen_fd && afl_net_listen_type == SOCK_STREAM &&
+      !afl_net_served)
+    afl_net_arm_listener();
+
+  return 0;
+
+}
+
+
+/* Without a system accept4(), do_accept4() makes sure that flags is 0. */
+
+static int afl_net_real_accept4(int fd, struct sockaddr *addr, socklen_t *len,
+                                int flags) {
+
+#ifdef CONFIG_ACCEPT4
+  return accept4(fd, addr, len, flags);
+#else
+  return accept(fd, addr, len);
+#endif /* ^CONFIG_ACCEPT4 */
+
+}
+
+
+static int afl_net_accept4(int fd, struct sockaddr *addr, socklen_t *len,
+                           int flags) {
+
+  int res;
+
+  if (fd != afl_net_listen_fd || afl_net_listen_fd < 0)
+    return afl_net_real_accept4(fd, addr, len, flags);
+
+  /* A blocking server coming back for more is done with our input. An
+     event loop server just gets EAGAIN, and we wait for it to close the
+     connection instead. */
+
+  if (afl_net_served && !(fcntl(fd, F_GETFL) & O_NONBLOCK)) _exit(0);
+
+  res = afl_net_real_accept4(fd, NULL, NULL, flags);
+  if (res < 0) return res;
+
+  if (res < DESOCK_MAX_FD) afl_net_kind[res] = AFL_NET_CONN;
+  afl_net_served = 1;
+
+  afl_net_copy_addr(addr, len, &afl_net_fake_peer);
+  return res;
+
+}
+
+
+static int afl_net_connect(int fd, struct sockaddr *addr, socklen_t len) {
+
+  int sv[2], type, fl, fdf;
+  socklen_t tl = sizeof(int);
+
+  if (!afl_net_is_target(addr, len) || afl_net_served ||
+      fd >= DESOCK_MAX_FD)
+    return connect(fd, addr, len);
+
+  /* A client: give it one end of a socketpair, and talk to it through the
+     other. */
+
+  if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &tl)) return -1;
+
+  fl  = fcntl(fd, F_GETFL);
+  fdf = fcntl(fd, F_GETFD);
+
+  if (socketpair(AF_UNIX, type | SOCK_CLOEXEC, 0, sv)) return -1;
+
+  if (dup2(sv[0], fd) < 0) return -1;
+  close(sv[0]);
+
+  fcntl(fd, F_SETFL, fl);
+  fcntl(fd, F_SETFD, fdf);
+
+  afl_net_set_fake_addrs(addr, len);
+
+  /* The guest is the client here; it sees the target port on the far end. */
+
+  memcpy(&afl_net_fake_peer, &afl_net_fake_local, sizeof(afl_net_fake_peer));
+
+  afl_net_kind[fd] = AFL_NET_CONN;
+  afl_net_served   = 1;
+
+  /* A datagram socketpair is already connected, so the input just goes out
+     as one send(). */
+
+  if (type == SOCK_DGRAM) {
+
+    unsigned char own, *buf;
+    unsigned int ilen;
+
+    buf = afl_net_get_input(&ilen, &own);
+
+    if (buf) send(sv[1], buf, ilen, MSG_NOSIGNAL);
+    if (own) free(buf);
+
+  }
+
+  afl_net_start_pump(sv[1], type == SOCK_STREAM);
+  return 0;
+
+}
+
+
+static void afl_net_close(int fd) {
+
+  if (fd < 0 || fd >= DESOCK_MAX_FD) return;
+
+  if (fd == afl_net_listen_fd) afl_net_listen_fd = -1;
+  afl_net_kind[fd] = AFL_NET_NONE;
+
+}
+
+
+/* UDP servers: the first read gets our datagram, the next means that the
+   guest is done with it. MSG_DONTWAIT reads are let through, since that is
+   how recvmmsg() asks for more after the first one. Replies are addressed
+   to the made-up peer, so they need to be pointed back at the host thread's
+   socket. */
+
+static ssize_t afl_net_recvfrom(int fd, void *buf, size_t len, int flags,
+                                struct sockaddr *addr, socklen_t *alen) {
+
+  ssize_t res;
+
+  if (fd != afl_net_listen_fd || afl_net_listen_type != SOCK_DGRAM)
+    return addr ? recvfrom(fd, buf, len, flags, addr, alen)
+                : qemu_recv(fd, buf, len, flags);
+
+  if (afl_net_dgram_reads++ && !(flags & MSG_DONTWAIT)) _exit(0);
+
+  res = recvfrom(fd, buf, len, flags, NULL, NULL);
+  if (res >= 0) afl_net_copy_addr(addr, alen, &afl_net_fake_peer);
+
+  afl_net_served = 1;
+  return res;
+
+}
+
+
+static ssize_t afl_net_recvmsg(int fd, struct msghdr *msg, int flags) {
+
+  ssize_t res;
+  void *name;
+
+  if (fd != afl_net_listen_fd || afl_net_listen_type != SOCK_DGRAM)
+    return recvmsg(fd, msg, flags);
+
+  if (afl_net_dgram_reads++ && !(flags & MSG_DONTWAIT)) _exit(0);
+
+  name = msg->msg_name;
+  msg->msg_name = NULL;
+
+  res = recvmsg(fd, msg, flags);
+
+  msg->msg_name = name;
+  if (res >= 0) afl_net_copy_addr(name, &msg->msg_namelen, &afl_net_fake_peer);
+
+  afl_net_served = 1;
+  return res;
+
+}
+
+
+static ssize_t afl_net_sendto(int fd, const void *buf, size_t len, int flags,
+                              const struct sockaddr *addr, socklen_t alen) {
+
+  if (!afl_net_ours(fd))
+    return addr ? sendto(fd, buf, len, flags, addr, alen)
+                : send(fd, buf, len, flags);
+
+  flags |= MSG_NOSIGNAL;
+
+  if (fd == afl_net_listen_fd && afl_net_listen_type == SOCK_DGRAM)
+    return sendto(fd, buf, len, flags,
+                  (struct sockaddr *)&afl_net_peer_name,
+                  afl_net_peer_name_len);
+
+  return send(fd, buf, len, flags);
+
+}
+
+
+static ssize_t afl_net_sendmsg(int fd, struct msghdr *msg, int flags) {
+
+  struct msghdr m;
+
+  if (!afl_net_ours(fd)) return sendmsg(fd, msg, flags);
+
+  m = *msg;
+
+  if (fd == afl_net_listen_fd && afl_net_listen_type == SOCK_DGRAM) {
+    m.msg_name    = &afl_net_peer_name;
+    m.msg_namelen = afl_net_peer_name_len;
+  } else {
+    m.msg_name    = NULL;
+    m.msg_namelen = 0;
+  }
+
+  return sendmsg(fd, &m, flags | MSG_NOSIGNAL);
+
+}
+
+
+/* The rest only needs to keep up appearances. */
+
+static int afl_net_getsockname(int fd, struct sockaddr *addr,
+                               socklen_t *len) {
+
+  if (!afl_net_ours(fd)) return getsockname(fd, addr, len);
+
+  afl_net_copy_addr(addr, len, &afl_net_fake_local);
+  return 0;
+
+}
+
+
+static int afl_net_getpeername(int fd, struct sockaddr *addr,
+                               socklen_t *len) {
+
+  if (!afl_net_ours(fd) || afl_net_kind[fd] != AFL_NET_CONN)
+    return getpeername(fd, addr, len);
+
+  afl_net_copy_addr(addr, len, &afl_net_fake_peer);
+  return 0;
+
+}
+
+
+/* TCP_NODELAY, IPV6_V6ONLY and friends make no sense for AF_UNIX, but the
+   guest shouldn't bail out over them. do_setsockopt() checks this first. */
+
+static int afl_net_skip_sockopt(int fd, int level) {
+
+  return afl_net_ours(fd) && level != SOL_SOCKET;
+
+}
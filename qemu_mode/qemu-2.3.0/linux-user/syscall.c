@@ -1356,6 +1356,8 @@ static inline abi_long host_to_target_cmsg(struct target_msghdr *target_msgh,
     return 0;
 }
 
+#include "../../patches/afl-qemu-net-inl.h"
+
 /* do_setsockopt() Must return target values and target errnos. */
 static abi_long do_setsockopt(int sockfd, int level, int optname,
                               abi_ulong optval_addr, socklen_t optlen)
@@ -1365,6 +1367,9 @@ static abi_long do_setsockopt(int sockfd, int level, int optname,
     struct ip_mreqn *ip_mreq;
     struct ip_mreq_source *ip_mreq_source;
 
+    if (afl_net_skip_sockopt(sockfd, level))
+        return 0;
+
     switch(level) {
     case SOL_TCP:
         /* TCP options all take an 'int' value.  */
@@ -2018,7 +2023,7 @@ static abi_long do_bind(int sockfd, abi_ulong target_addr,
     if (ret)
         return ret;
 
-    return get_errno(bind(sockfd, addr, addrlen));
+    return get_errno(afl_net_bind(sockfd, addr, addrlen));
 }
 
 /* do_connect() Must return target values and target errnos. */
@@ -2038,7 +2043,7 @@ static abi_long do_connect(int sockfd, abi_ulong target_addr,
     if (ret)
         return ret;
 
-    return get_errno(connect(sockfd, addr, addrlen));
+    return get_errno(afl_net_connect(sockfd, addr, addrlen));
 }
 
 /* do_sendrecvmsg_locked() Must return target values and target errnos. */
@@ -2081,9 +2086,9 @@ static abi_long do_sendrecvmsg_locked(int fd, struct target_msghdr *msgp,
     if (send) {
         ret = target_to_host_cmsg(&msg, msgp);
         if (ret == 0)
-            ret = get_errno(sendmsg(fd, &msg, flags));
+            ret = get_errno(afl_net_sendmsg(fd, &msg, flags));
     } else {
-        ret = get_errno(recvmsg(fd, &msg, flags));
+        ret = get_errno(afl_net_recvmsg(fd, &msg, flags));
         if (!is_error(ret)) {
             len = ret;
             ret = host_to_target_cmsg(msgp, &msg);
@@ -2199,7 +2204,7 @@ static abi_long do_accept4(int fd, abi_ulong target_addr,
     host_flags = target_to_host_bitmask(flags, fcntl_flags_tbl);
 
     if (target_addr == 0) {
-        return get_errno(accept4(fd, NULL, NULL, host_flags));
+        return get_errno(afl_net_accept4(fd, NULL, NULL, host_flags));
     }
 
     /* linux returns EINVAL if addrlen pointer is invalid */
@@ -2215,7 +2220,7 @@ static abi_long do_accept4(int fd, abi_ulong target_addr,
 
     addr = alloca(addrlen);
 
-    ret = get_errno(accept4(fd, addr, &addrlen, host_flags));
+    ret = get_errno(afl_net_accept4(fd, addr, &addrlen, host_flags));
     if (!is_error(ret)) {
         host_to_target_sockaddr(target_addr, addr, addrlen);
         if (put_user_u32(addrlen, target_addrlen_addr))
@@ -2244,7 +2249,7 @@ static abi_long do_getpeername(int fd, abi_ulong target_addr,
 
     addr = alloca(addrlen);
 
-    ret = get_errno(getpeername(fd, addr, &addrlen));
+    ret = get_errno(afl_net_getpeername(fd, addr, &addrlen));
     if (!is_error(ret)) {
         host_to_target_sockaddr(target_addr, addr, addrlen);
         if (put_user_u32(addrlen, target_addrlen_addr))
@@ -2273,7 +2278,7 @@ static abi_long do_getsockname(int fd, abi_ulong target_addr,
 
     addr = alloca(addrlen);
 
-    ret = get_errno(getsockname(fd, addr, &addrlen));
+    ret = get_errno(afl_net_getsockname(fd, addr, &addrlen));
     if (!is_error(ret)) {
         host_to_target_sockaddr(target_addr, addr, addrlen);
         if (put_user_u32(addrlen, target_addrlen_addr))
@@ -2322,9 +2327,10 @@ static abi_long do_sendto(int fd, abi_ulong msg, size_t len, int flags,
             unlock_user(host_msg, msg, 0);
             return ret;
         }
-        ret = get_errno(sendto(fd, host_msg, len, flags, addr, addrlen));
+        ret = get_errno(afl_net_sendto(fd, host_msg, len, flags, addr,
+                                        addrlen));
     } else {
-        ret = get_errno(send(fd, host_msg, len, flags));
+        ret = get_errno(afl_net_sendto(fd, host_msg, len, flags, NULL, 0));
     }
     unlock_user(host_msg, msg, 0);
     return ret;
@@ -2353,10 +2359,12 @@ static abi_long do_recvfrom(int fd, abi_ulong msg, size_t len, int flags,
             goto fail;
         }
         addr = alloca(addrlen);
-        ret = get_errno(recvfrom(fd, host_msg, len, flags, addr, &addrlen));
+        ret = get_errno(afl_net_recvfrom(fd, host_msg, len, flags, addr,
+                                          &addrlen));
     } else {
         addr = NULL; /* To keep compiler quiet.  */
-        ret = get_errno(qemu_recv(fd, host_msg, len, flags));
+        ret = get_errno(afl_net_recvfrom(fd, host_msg, len, flags, NULL,
+                                          NULL));
     }
     if (!is_error(ret)) {
         if (target_addr) {
@@ -2420,7 +2428,7 @@ static abi_long do_socketcall(int num, abi_ulong vptr)
     case SOCKOP_connect: /* sockfd, addr, addrlen */
         return do_connect(a[0], a[1], a[2]);
     case SOCKOP_listen: /* sockfd, backlog */
-        return get_errno(listen(a[0], a[1]));
+        return get_errno(afl_net_listen(a[0], a[1]));
     case SOCKOP_accept: /* sockfd, addr, addrlen */
         return do_accept4(a[0], a[1], a[2], 0);
     case SOCKOP_accept4: /* sockfd, addr, addrlen, flags */
@@ -5612,6 +5620,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         unlock_user(p, arg2, 0);
         break;
     case TARGET_NR_close:
+        afl_net_close(arg1);
         ret = get_errno(close(arg1));
         break;
     case TARGET_NR_brk:
@@ -7122,7 +7131,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
 #endif
 #ifdef TARGET_NR_listen
     case TARGET_NR_listen:
-        ret = get_errno(listen(arg1, arg2));
+        ret = get_errno(afl_net_listen(arg1, arg2));
         break;
 #endif
 #ifdef TARGET_NR_recv
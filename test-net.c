@@ -0,0 +1,147 @@
+/*
+   american fuzzy lop - trivial network targets for testing and benchmarks
+   -----------------------------------------------------------------------
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Reference targets for the -N / -L modes of afl-fuzz, used by 'make bench'
+   (see experimental/net_bench/). Usage:
+
+     test-net tcp <port> [count]   - TCP echo server on 127.0.0.1
+     test-net udp <port> [count]   - UDP echo server on 127.0.0.1
+     test-net client <port>        - TCP client, reads a reply from the port
+
+   The servers handle count requests (default 1, 0 = no limit) and exit. Like
+   test-instr, each one takes a different branch depending on the first
+   byte of what it was sent.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+static void handle(char* buf, ssize_t len) {
+
+  if (len < 1) return;
+
+  if (buf[0] == '0')
+    buf[0] = 'Z';
+  else
+    buf[0] = 'N';
+
+}
+
+
+static int open_sock(int type, unsigned short port, int server) {
+
+  struct sockaddr_in sa;
+  int one = 1, fd = socket(AF_INET, type, 0);
+
+  if (fd < 0) {
+    perror("socket");
+    exit(1);
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family      = AF_INET;
+  sa.sin_port        = htons(port);
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (server) {
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) ||
+        (type == SOCK_STREAM && listen(fd, 16))) {
+      perror("bind");
+      exit(1);
+    }
+
+  } else if (connect(fd, (struct sockaddr*)&sa, sizeof(sa))) {
+
+    perror("connect");
+    exit(1);
+
+  }
+
+  return fd;
+
+}
+
+
+int main(int argc, char** argv) {
+
+  char buf[1024];
+  unsigned int count = 1, done = 0;
+  unsigned short port;
+  ssize_t len;
+  int fd, c;
+
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s tcp|udp|client <port> [count]\n", argv[0]);
+    exit(1);
+  }
+
+  port = atoi(argv[2]);
+  if (argc > 3) count = atoi(argv[3]);
+
+  if (!strcmp(argv[1], "tcp")) {
+
+    fd = open_sock(SOCK_STREAM, port, 1);
+
+    while ((!count || done++ < count) && (c = accept(fd, NULL, NULL)) >= 0) {
+
+      len = read(c, buf, sizeof(buf));
+      handle(buf, len);
+
+      if (len > 0 && write(c, buf, len) != len) perror("write");
+      close(c);
+
+    }
+
+  } else if (!strcmp(argv[1], "udp")) {
+
+    struct sockaddr_storage peer;
+    socklen_t plen;
+
+    fd = open_sock(SOCK_DGRAM, port, 1);
+
+    while (!count || done++ < count) {
+
+      plen = sizeof(peer);
+      len  = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr*)&peer, &plen);
+      if (len < 0) break;
+
+      handle(buf, len);
+      sendto(fd, buf, len, 0, (struct sockaddr*)&peer, plen);
+
+    }
+
+  } else if (!strcmp(argv[1], "client")) {
+
+    fd = open_sock(SOCK_STREAM, port, 0);
+
+    if (write(fd, "HELLO\n", 6) != 6) perror("write");
+
+    len = read(fd, buf, sizeof(buf));
+    handle(buf, len);
+
+  } else {
+
+    fprintf(stderr, "Unknown mode '%s'.\n", argv[1]);
+    exit(1);
+
+  }
+
+  exit(0);
+
+}